@@ -1,12 +1,16 @@
 #include <solanaceae/plugin/solana_plugin_v1.h>
 
 #include <solanaceae/zox/ngc.hpp>
+#include <solanaceae/zox/ngca_recorder.hpp>
+#include <solanaceae/zox/trace.hpp>
 
 #include <memory>
 #include <limits>
+#include <cstdlib>
 #include <iostream>
 
 static std::unique_ptr<ZoxNGCEventProvider> g_zngc = nullptr;
+static std::unique_ptr<ZoxNGCARecorder> g_ngca_recorder = nullptr;
 
 constexpr const char* plugin_name = "ZoxNGC";
 
@@ -34,8 +38,28 @@ SOLANA_PLUGIN_EXPORT uint32_t solana_plugin_start(struct SolanaAPI* solana_api)
 		// construct with fetched dependencies
 		g_zngc = std::make_unique<ZoxNGCEventProvider>(*tox_event_provider_i);
 
+		// record traffic for offline replay (tools/zox_replay)
+		if (const char* capture_path = std::getenv("SOLANACEAE_ZOX_CAPTURE"); capture_path != nullptr) {
+			g_zngc->startCapture(capture_path);
+		}
+
+		// record group audio (ngca) as ogg/opus files, one per peer
+		if (const char* record_dir = std::getenv("SOLANACEAE_ZOX_NGCA_RECORD"); record_dir != nullptr) {
+			g_ngca_recorder = std::make_unique<ZoxNGCARecorder>(*g_zngc, record_dir);
+		}
+
 		// register types
 		PLUG_PROVIDE_INSTANCE(ZoxNGCEventProviderI, plugin_name, g_zngc.get());
+		// for the scoped subscriptions
+		PLUG_PROVIDE_INSTANCE(ZoxNGCEventProvider, plugin_name, g_zngc.get());
+		PLUG_PROVIDE_INSTANCE(ZoxNGCMetrics, plugin_name, &g_zngc->metrics());
+		PLUG_PROVIDE_INSTANCE(ZoxNGCAStats, plugin_name, &g_zngc->ngcaStats());
+		if (g_ngca_recorder) {
+			PLUG_PROVIDE_INSTANCE(ZoxNGCARecorderMetrics, plugin_name, &g_ngca_recorder->metrics());
+		}
+		// one trace for all zox plugins, the host can dump it any time with ZoxTrace::dumpToFile()
+		// (only has content if built with SOLANACEAE_ZOX_TRACE)
+		PLUG_PROVIDE_INSTANCE(ZoxTrace, plugin_name, &ZoxTrace::local());
 	} catch (const ResolveException& e) {
 		std::cerr << "PLUGIN " << plugin_name << " " << e.what << "\n";
 		return 2;
@@ -47,6 +71,7 @@ SOLANA_PLUGIN_EXPORT uint32_t solana_plugin_start(struct SolanaAPI* solana_api)
 SOLANA_PLUGIN_EXPORT void solana_plugin_stop(void) {
 	std::cout << "PLUGIN " << plugin_name << " STOP()\n";
 
+	g_ngca_recorder.reset();
 	g_zngc.reset();
 }
 
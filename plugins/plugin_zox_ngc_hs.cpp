@@ -4,6 +4,8 @@
 
 #include <solanaceae/zox/ngc.hpp>
 #include <solanaceae/zox/ngc_hs.hpp>
+#include <solanaceae/zox/ngc_hs_source.hpp>
+#include <solanaceae/zox/trace.hpp>
 #include <solanaceae/toxcore/tox_interface.hpp>
 #include <solanaceae/tox_contacts/tox_contact_model2.hpp>
 
@@ -11,6 +13,7 @@
 #include <entt/fwd.hpp>
 
 #include <memory>
+#include <cstdlib>
 #include <iostream>
 
 static std::unique_ptr<ZoxNGCHistorySync> g_zngchs = nullptr;
@@ -46,8 +49,23 @@ SOLANA_PLUGIN_EXPORT uint32_t solana_plugin_start(struct SolanaAPI* solana_api)
 		// construct with fetched dependencies
 		g_zngchs = std::make_unique<ZoxNGCHistorySync>(*tox_event_provider_i, *zox_ngc_event_provider_i, *tox_i, *cs, *tcm, *rmm);
 
+		// optional, provided by a message storage plugin started before us
+		try {
+			auto* history_source = PLUG_RESOLVE_INSTANCE(ZoxNGCHistorySourceI);
+			g_zngchs->setHistorySource(history_source);
+			std::cout << "PLUGIN " << plugin_name << " serving history from ZoxNGCHistorySourceI\n";
+		} catch (const ResolveException&) {
+		}
+
+		// record into the trace of plugin_zox_ngc, so one dump has the spans of both
+		try {
+			ZoxTrace::use(PLUG_RESOLVE_INSTANCE(ZoxTrace));
+		} catch (const ResolveException&) {
+		}
+
 		// register types
 		PLUG_PROVIDE_INSTANCE(ZoxNGCHistorySync, plugin_name, g_zngchs.get());
+		PLUG_PROVIDE_INSTANCE(ZoxNGCHistorySyncMetrics, plugin_name, &g_zngchs->metrics());
 	} catch (const ResolveException& e) {
 		std::cerr << "PLUGIN " << plugin_name << " " << e.what << "\n";
 		return 2;
@@ -60,6 +78,13 @@ SOLANA_PLUGIN_EXPORT void solana_plugin_stop(void) {
 	std::cout << "PLUGIN " << plugin_name << " STOP()\n";
 
 	g_zngchs.reset();
+
+	// only has content if built with SOLANACEAE_ZOX_TRACE
+	// plugin_zox_ngc is still loaded here, so its spans are included
+	if (const char* trace_path = std::getenv("SOLANACEAE_ZOX_TRACE_FILE"); trace_path != nullptr) {
+		ZoxTrace::active().dumpToFile(trace_path);
+	}
+	ZoxTrace::use(nullptr);
 }
 
 SOLANA_PLUGIN_EXPORT float solana_plugin_tick(float delta) {
@@ -0,0 +1,60 @@
+#include "./clock_skew.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+
+static int64_t median(std::array<int64_t, ZoxClockSkewEstimator::max_samples>& values, size_t count) {
+	const auto mid = values.begin() + count/2;
+	std::nth_element(values.begin(), mid, values.begin() + count);
+	return *mid;
+}
+
+bool ZoxClockSkewEstimator::addSample(int64_t offset_ms) {
+	bool restarted = false;
+
+	if (_valid && std::abs(offset_ms - _offset_ms) > _window_ms) {
+		_misses++;
+	} else {
+		_misses = 0;
+	}
+
+	_samples[_next] = offset_ms;
+	_next = (_next + 1) % max_samples;
+	_count = std::min(_count + 1, max_samples);
+
+	if (_misses >= max_misses) {
+		// keep only the run that did not fit
+		std::array<int64_t, max_samples> recent {};
+		for (size_t i = 0; i < _misses; i++) {
+			recent[i] = _samples[(_next + max_samples - _misses + i) % max_samples];
+		}
+		_samples = recent;
+		_count = _misses;
+		_next = _misses;
+		_misses = 0;
+		restarted = true;
+	}
+
+	update();
+
+	return restarted;
+}
+
+void ZoxClockSkewEstimator::update(void) {
+	if (_count < min_samples) {
+		_valid = false;
+		return;
+	}
+
+	std::array<int64_t, max_samples> values = _samples;
+	_offset_ms = median(values, _count);
+
+	for (size_t i = 0; i < _count; i++) {
+		values[i] = std::abs(_samples[i] - _offset_ms);
+	}
+	const int64_t mad = median(values, _count);
+
+	_window_ms = std::max(min_window_ms, resolution_ms + 4*mad);
+	_valid = true;
+}
+
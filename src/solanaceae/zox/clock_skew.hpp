@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+
+// estimates how far a peers clock is off from ours (theirs - ours, ms)
+// from timestamps both sides recorded for the same messages
+// median and median absolute deviation of the last max_samples, so a few bad pairs dont matter
+// a run of samples that do not fit the estimate (their clock was changed) starts over
+class ZoxClockSkewEstimator {
+	public:
+		static constexpr size_t max_samples = 32;
+		static constexpr size_t min_samples = 5; // before the estimate is valid
+		static constexpr size_t max_misses = 3; // in a row, before starting over
+
+		// syncmsg timestamps are whole seconds
+		static constexpr int64_t resolution_ms = 1000;
+		// also covers the delay differences of the message reaching us and them
+		static constexpr int64_t min_window_ms = 10*1000;
+
+	private:
+		std::array<int64_t, max_samples> _samples {};
+		size_t _count {0u};
+		size_t _next {0u}; // ring position
+		size_t _misses {0u};
+
+		bool _valid {false};
+		int64_t _offset_ms {0};
+		int64_t _window_ms {0};
+
+		void update(void);
+
+	public:
+		// returns true if the sample made the estimate start over
+		bool addSample(int64_t offset_ms);
+
+		bool valid(void) const { return _valid; }
+		size_t sampleCount(void) const { return _count; }
+
+		// only meaningful if valid()
+		int64_t offset(void) const { return _offset_ms; }
+		// how far a timestamp of theirs, corrected by offset(), can be from ours for the same message
+		int64_t window(void) const { return _window_ms; }
+};
+
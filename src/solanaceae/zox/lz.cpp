@@ -0,0 +1,180 @@
+#include "./lz.hpp"
+
+#include <algorithm>
+
+namespace ZoxLZ {
+
+static constexpr size_t min_match = 4;
+static constexpr size_t max_offset = 0xffff;
+static constexpr size_t hash_bits = 12;
+
+static uint32_t read32(const uint8_t* p) {
+	return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+}
+
+static size_t hash4(uint32_t v) {
+	return (v * 2654435761u) >> (32 - hash_bits);
+}
+
+static void push_length(std::vector<uint8_t>& out, size_t len) {
+	while (len >= 0xff) {
+		out.push_back(0xff);
+		len -= 0xff;
+	}
+	out.push_back(len);
+}
+
+static bool read_length(const uint8_t* data, size_t data_size, size_t& i, size_t& len) {
+	uint8_t b = 0;
+	do {
+		if (i >= data_size) {
+			return false;
+		}
+		b = data[i++];
+		len += b;
+	} while (b == 0xff);
+
+	return true;
+}
+
+bool compress(
+	const uint8_t* dict, size_t dict_size,
+	const uint8_t* data, size_t data_size,
+	std::vector<uint8_t>& out, size_t max_size
+) {
+	out.clear();
+
+	// only the end of the dictionary is reachable
+	if (dict_size > max_offset) {
+		dict += dict_size - max_offset;
+		dict_size = max_offset;
+	}
+
+	// one buffer, so matches can reach back into the dictionary
+	std::vector<uint8_t> buf;
+	buf.reserve(dict_size + data_size);
+	buf.insert(buf.end(), dict, dict + dict_size);
+	buf.insert(buf.end(), data, data + data_size);
+	const size_t end = buf.size();
+
+	std::vector<int32_t> table(size_t(1) << hash_bits, -1);
+	for (size_t i = 0; i + min_match <= dict_size; i++) {
+		table[hash4(read32(&buf[i]))] = i;
+	}
+
+	const auto push_sequence = [&](size_t lit_begin, size_t lit_len, size_t offset, size_t match_len, bool last) {
+		const size_t match_code = last ? 0 : match_len - min_match;
+		out.push_back(std::min<size_t>(lit_len, 15) << 4 | std::min<size_t>(match_code, 15));
+		if (lit_len >= 15) {
+			push_length(out, lit_len - 15);
+		}
+		out.insert(out.end(), buf.cbegin() + lit_begin, buf.cbegin() + lit_begin + lit_len);
+
+		if (!last) {
+			out.push_back(0xff & (offset >> 8*0));
+			out.push_back(0xff & (offset >> 8*1));
+			if (match_code >= 15) {
+				push_length(out, match_code - 15);
+			}
+		}
+
+		return out.size() <= max_size;
+	};
+
+	size_t anchor = dict_size;
+	size_t pos = dict_size;
+	while (pos + min_match <= end) {
+		const uint32_t v = read32(&buf[pos]);
+		const size_t h = hash4(v);
+		const int32_t candidate = table[h];
+		table[h] = pos;
+
+		if (candidate < 0 || pos - size_t(candidate) > max_offset || read32(&buf[candidate]) != v) {
+			pos++;
+			continue;
+		}
+
+		size_t len = min_match;
+		while (pos + len < end && buf[candidate + len] == buf[pos + len]) {
+			len++;
+		}
+
+		if (!push_sequence(anchor, pos - anchor, pos - candidate, len, false)) {
+			return false;
+		}
+
+		for (size_t i = pos + 1; i < pos + len && i + min_match <= end; i++) {
+			table[hash4(read32(&buf[i]))] = i;
+		}
+
+		pos += len;
+		anchor = pos;
+	}
+
+	return push_sequence(anchor, end - anchor, 0, 0, true);
+}
+
+bool decompress(
+	const uint8_t* dict, size_t dict_size,
+	const uint8_t* data, size_t data_size,
+	std::vector<uint8_t>& out, size_t max_size
+) {
+	out.clear();
+
+	if (data_size == 0) {
+		return false;
+	}
+
+	size_t i = 0;
+	while (i < data_size) {
+		const uint8_t token = data[i++];
+
+		size_t lit_len = token >> 4;
+		if (lit_len == 15 && !read_length(data, data_size, i, lit_len)) {
+			return false;
+		}
+
+		if (lit_len > data_size - i || lit_len > max_size - out.size()) {
+			return false;
+		}
+
+		out.insert(out.end(), data + i, data + i + lit_len);
+		i += lit_len;
+
+		if (i == data_size) {
+			// last sequence has no match
+			return true;
+		}
+
+		if (data_size - i < 2) {
+			return false;
+		}
+
+		const size_t offset = size_t(data[i]) | size_t(data[i+1]) << 8;
+		i += 2;
+
+		size_t match_len = token & 0x0f;
+		if (match_len == 15 && !read_length(data, data_size, i, match_len)) {
+			return false;
+		}
+		match_len += min_match;
+
+		const size_t pos = out.size();
+		if (offset == 0 || offset > pos + dict_size || match_len > max_size - pos) {
+			return false;
+		}
+
+		out.resize(pos + match_len);
+		uint8_t* o = out.data();
+		for (size_t j = pos; j < pos + match_len; j++) {
+			// can overlap, so byte by byte
+			o[j] = offset <= j ? o[j - offset] : dict[dict_size - (offset - j)];
+		}
+	}
+
+	// ended on a match, the last sequence is always literals only
+	return false;
+}
+
+} // ZoxLZ
+
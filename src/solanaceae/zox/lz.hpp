@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// small lz77 style codec for sync payloads, dependency free
+// both sides need to use the exact same dictionary
+// matches can reference the dictionary as if it was prepended to the data
+//
+// stream of sequences:
+//| what      | Length in bytes| Contents |
+//|-----------|----------------|----------|
+//| token     |       1        |  high nibble literal length, low nibble match length - 4 (15 means more follows) |
+//| lit len   |    [0, ...]    |  only if literal length nibble is 15, bytes added until one is < 255 |
+//| literals  |    [0, ...]    |  |
+//| offset    |       2        |  uint16_t (littleendian) distance back, not present for the last sequence |
+//| match len |    [0, ...]    |  only if match length nibble is 15, bytes added until one is < 255 |
+namespace ZoxLZ {
+
+	// returns false if the compressed data would be larger than max_size
+	bool compress(
+		const uint8_t* dict, size_t dict_size,
+		const uint8_t* data, size_t data_size,
+		std::vector<uint8_t>& out, size_t max_size
+	);
+
+	// returns false on malformed data or if the result would be larger than max_size
+	bool decompress(
+		const uint8_t* dict, size_t dict_size,
+		const uint8_t* data, size_t data_size,
+		std::vector<uint8_t>& out, size_t max_size
+	);
+
+} // ZoxLZ
+
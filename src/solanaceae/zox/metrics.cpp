@@ -0,0 +1,76 @@
+#include "./metrics.hpp"
+
+void ZoxMetricHistogram::observe(uint64_t v) {
+	size_t bucket = 0;
+	while (bucket < bucket_count - 1 && (v >> bucket) != 0) {
+		bucket++;
+	}
+
+	buckets[bucket].fetch_add(1u, std::memory_order_relaxed);
+	count.fetch_add(1u, std::memory_order_relaxed);
+	sum.fetch_add(v, std::memory_order_relaxed);
+}
+
+void ZoxMetricHistogram::reset(void) {
+	for (auto& bucket : buckets) {
+		bucket.store(0u, std::memory_order_relaxed);
+	}
+	count.store(0u, std::memory_order_relaxed);
+	sum.store(0u, std::memory_order_relaxed);
+}
+
+void zox_metric_write(std::ostream& out, std::string_view name, const ZoxMetricCounter& counter) {
+	zox_metric_write(out, name, {}, counter);
+}
+
+void zox_metric_write(std::ostream& out, std::string_view name, const ZoxMetricGauge& gauge) {
+	zox_metric_write(out, name, {}, gauge);
+}
+
+void zox_metric_write(std::ostream& out, std::string_view name, const ZoxMetricHistogram& histogram) {
+	zox_metric_write(out, name, {}, histogram);
+}
+
+static void write_labels(std::ostream& out, std::string_view labels) {
+	if (!labels.empty()) {
+		out << "{" << labels << "}";
+	}
+}
+
+void zox_metric_write(std::ostream& out, std::string_view name, std::string_view labels, const ZoxMetricCounter& counter) {
+	out << name;
+	write_labels(out, labels);
+	out << " " << counter.get() << "\n";
+}
+
+void zox_metric_write(std::ostream& out, std::string_view name, std::string_view labels, const ZoxMetricGauge& gauge) {
+	out << name;
+	write_labels(out, labels);
+	out << " " << gauge.get() << "\n";
+}
+
+void zox_metric_write(std::ostream& out, std::string_view name, std::string_view labels, const ZoxMetricHistogram& histogram) {
+	// prometheus buckets are cumulative
+	uint64_t cumulative = 0;
+	for (size_t i = 0; i < histogram.bucket_count; i++) {
+		cumulative += histogram.buckets[i].load(std::memory_order_relaxed);
+		out << name << "_bucket{";
+		if (!labels.empty()) {
+			out << labels << ",";
+		}
+		out << "le=\"";
+		if (i == histogram.bucket_count - 1) {
+			out << "+Inf";
+		} else {
+			out << ((uint64_t(1) << i) - 1);
+		}
+		out << "\"} " << cumulative << "\n";
+	}
+	out << name << "_sum";
+	write_labels(out, labels);
+	out << " " << histogram.sum.load(std::memory_order_relaxed) << "\n";
+	out << name << "_count";
+	write_labels(out, labels);
+	out << " " << histogram.count.load(std::memory_order_relaxed) << "\n";
+}
+
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <atomic>
+#include <ostream>
+#include <string_view>
+
+// always-on metrics, all updates are relaxed atomics
+// scrape by reading the values or with the writeText() functions (prometheus text format)
+
+struct ZoxMetricCounter {
+	std::atomic<uint64_t> value {0u};
+
+	void add(uint64_t n = 1u) { value.fetch_add(n, std::memory_order_relaxed); }
+	uint64_t get(void) const { return value.load(std::memory_order_relaxed); }
+	void reset(void) { value.store(0u, std::memory_order_relaxed); }
+};
+
+struct ZoxMetricGauge {
+	std::atomic<int64_t> value {0};
+
+	void set(int64_t v) { value.store(v, std::memory_order_relaxed); }
+	int64_t get(void) const { return value.load(std::memory_order_relaxed); }
+	void reset(void) { set(0); }
+};
+
+// power of 2 buckets, bucket i counts values < 2^i (and >= 2^(i-1))
+struct ZoxMetricHistogram {
+	static constexpr size_t bucket_count = 33; // up to 2^32, larger values land in the last bucket
+
+	std::array<std::atomic<uint64_t>, bucket_count> buckets {};
+	std::atomic<uint64_t> count {0u};
+	std::atomic<uint64_t> sum {0u};
+
+	void observe(uint64_t v);
+	void reset(void);
+};
+
+void zox_metric_write(std::ostream& out, std::string_view name, const ZoxMetricCounter& counter);
+void zox_metric_write(std::ostream& out, std::string_view name, const ZoxMetricGauge& gauge);
+void zox_metric_write(std::ostream& out, std::string_view name, const ZoxMetricHistogram& histogram);
+
+// with labels, eg. `group="1",peer="2"`
+void zox_metric_write(std::ostream& out, std::string_view name, std::string_view labels, const ZoxMetricCounter& counter);
+void zox_metric_write(std::ostream& out, std::string_view name, std::string_view labels, const ZoxMetricGauge& gauge);
+void zox_metric_write(std::ostream& out, std::string_view name, std::string_view labels, const ZoxMetricHistogram& histogram);
+
@@ -1,10 +1,31 @@
 #include "./ngc.hpp"
 
+#include "./ngc_hs_packer.hpp"
+#include "./ngc_capture.hpp"
+#include "./lz.hpp"
+#include "./utf8.hpp"
+#include "./trace.hpp"
+
+#include <solanaceae/util/time.hpp>
+
 #include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <optional>
 #include <tuple>
 #include <iostream>
+#include <algorithm>
+
+// trims at the first \0 and replaces invalid utf-8 sequences, see zox_utf8_sanitize()
+// the result points into str or storage, which has to outlive it
+static std::string_view sanitize_text(std::string_view str, std::string& storage, ZoxMetricCounter& invalid_counter) {
+	str = str.substr(0, str.find_first_of('\0'));
+	const auto valid = zox_utf8_sanitize(str, storage);
+	if (valid.data() != str.data() || valid.size() != str.size()) {
+		invalid_counter.add();
+	}
+	return valid;
+}
 
 constexpr size_t zox_magic_size = 6;
 static bool is_zox_magic(const uint8_t* data, size_t size) {
@@ -42,9 +63,146 @@ ZoxNGCEventProvider::ZoxNGCEventProvider(ToxEventProviderI& tep) : _tep_sr(tep.n
 	_tep_sr
 		.subscribe(Tox_Event_Type::TOX_EVENT_GROUP_CUSTOM_PACKET)
 		.subscribe(Tox_Event_Type::TOX_EVENT_GROUP_CUSTOM_PRIVATE_PACKET)
+		.subscribe(Tox_Event_Type::TOX_EVENT_GROUP_PEER_EXIT)
 	;
 }
 
+ZoxNGCEventProvider::~ZoxNGCEventProvider(void) {
+}
+
+void ZoxNGCEventProvider::subscribeScoped(ZoxNGCEventI* object, ZoxNGC_Event event_type, uint32_t group_number, uint32_t peer_number) {
+	auto& subs = _scoped_subscribers.at(size_t(event_type))[group_number];
+	for (const auto& sub : subs) {
+		if (sub.object == object && sub.peer_number == peer_number) {
+			return; // already
+		}
+	}
+	subs.push_back({object, peer_number});
+}
+
+void ZoxNGCEventProvider::unsubscribeScoped(ZoxNGCEventI* object, ZoxNGC_Event event_type, uint32_t group_number, uint32_t peer_number) {
+	auto& groups = _scoped_subscribers.at(size_t(event_type));
+	const auto it = groups.find(group_number);
+	if (it == groups.end()) {
+		return;
+	}
+
+	it->second.erase(
+		std::remove_if(
+			it->second.begin(), it->second.end(),
+			[object, peer_number](const auto& sub) { return sub.object == object && sub.peer_number == peer_number; }
+		),
+		it->second.end()
+	);
+
+	// keeps the empty check in dispatch() meaningful
+	if (it->second.empty()) {
+		groups.erase(it);
+	}
+}
+
+void ZoxNGCEventProvider::unsubscribeScoped(ZoxNGCEventI* object) {
+	for (auto& groups : _scoped_subscribers) {
+		for (auto it = groups.begin(); it != groups.end();) {
+			it->second.erase(
+				std::remove_if(
+					it->second.begin(), it->second.end(),
+					[object](const auto& sub) { return sub.object == object; }
+				),
+				it->second.end()
+			);
+
+			if (it->second.empty()) {
+				it = groups.erase(it);
+			} else {
+				it++;
+			}
+		}
+	}
+}
+
+bool ZoxNGCEventProvider::startCapture(const std::string& path) {
+	_capture = std::make_unique<ZoxNGCCaptureWriter>(path);
+	if (!_capture->isOpen()) {
+		std::cerr << "ZOX error: failed to open capture file '" << _capture->path() << "'\n";
+		_capture.reset();
+		return false;
+	}
+
+	std::cout << "ZOX capturing group custom packets to '" << _capture->path() << "'\n";
+	return true;
+}
+
+void ZoxNGCEventProvider::stopCapture(void) {
+	_capture.reset();
+}
+
+bool ZoxNGCEventProvider::onGroupCustomPacket(
+	uint32_t group_number, uint32_t peer_number,
+	const uint8_t* data, size_t data_size,
+	bool _private
+) {
+	ZOX_TRACE_SCOPE("ZoxNGCEventProvider::onGroupCustomPacket");
+
+	if (_capture) {
+		_capture->write(getTimeMS(), group_number, peer_number, _private, data, data_size);
+	}
+
+	_metrics.packets_in.add();
+	_metrics.bytes_in.add(data_size);
+
+	auto res_opt = parse_zox_pkg_header(data, data_size);
+	if (!res_opt) {
+		_metrics.packets_not_zox.add();
+		return false;
+	}
+
+	auto [version, pkt_id] = *res_opt;
+
+	if (version == 0x01) {
+		_metrics.packets_by_id[pkt_id].add();
+		_metrics.bytes_by_id[pkt_id].add(data_size);
+	}
+
+	data += zox_header_size;
+	data_size -= zox_header_size;
+
+	const auto start = std::chrono::steady_clock::now();
+
+	const bool handled = onZoxGroupEvent(
+		group_number, peer_number,
+		version, pkt_id,
+		data, data_size,
+		_private
+	);
+
+	_metrics.handle_us.observe(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+	if (!handled) {
+		_metrics.packets_unhandled.add();
+	}
+
+	return handled;
+}
+
+void ZoxNGCMetrics::writeText(std::ostream& out) const {
+	zox_metric_write(out, "zox_ngc_packets_in_total", packets_in);
+	zox_metric_write(out, "zox_ngc_bytes_in_total", bytes_in);
+	zox_metric_write(out, "zox_ngc_packets_not_zox_total", packets_not_zox);
+	zox_metric_write(out, "zox_ngc_packets_unhandled_total", packets_unhandled);
+	zox_metric_write(out, "zox_ngc_text_invalid_utf8_total", text_invalid_utf8);
+	zox_metric_write(out, "zox_ngc_compressed_failures_total", compressed_failures);
+
+	for (size_t i = 0; i < packets_by_id.size(); i++) {
+		if (packets_by_id[i].get() == 0) {
+			continue;
+		}
+		out << "zox_ngc_packets_by_id_total{id=\"" << i << "\"} " << packets_by_id[i].get() << "\n";
+		out << "zox_ngc_bytes_by_id_total{id=\"" << i << "\"} " << bytes_by_id[i].get() << "\n";
+	}
+
+	zox_metric_write(out, "zox_ngc_handle_us", handle_us);
+}
+
 bool ZoxNGCEventProvider::onZoxGroupEvent(
 	uint32_t group_number, uint32_t peer_number,
 	uint8_t version, uint8_t pkt_id,
@@ -59,6 +217,18 @@ bool ZoxNGCEventProvider::onZoxGroupEvent(
 		return parse_ngch_syncmsg(group_number, peer_number, data, data_size, _private);
 	} else if (version == 0x01 && pkt_id == 0x03) {
 		std::cout << "ZOX waring: ngch_syncmsg_file not implemented\n";
+	} else if (version == 0x01 && pkt_id == 0x04) {
+		// ngch_caps (extension)
+		return parse_ngch_caps(group_number, peer_number, data, data_size, _private);
+	} else if (version == 0x01 && pkt_id == 0x05) {
+		// ngch_request_digest (extension)
+		return parse_ngch_request_digest(group_number, peer_number, data, data_size, _private);
+	} else if (version == 0x01 && pkt_id == 0x06) {
+		// ngch_syncmsg_packed (extension)
+		return parse_ngch_syncmsg_packed(group_number, peer_number, data, data_size, _private);
+	} else if (version == 0x01 && pkt_id == 0x07) {
+		// ngch_syncmsg_compressed (extension)
+		return parse_ngch_syncmsg_compressed(group_number, peer_number, data, data_size, _private);
 	} else if (version == 0x01 && pkt_id == 0x11) {
 		std::cout << "ZOX waring: ngc_ft not implemented\n";
 	} else if (version == 0x01 && pkt_id == 0x31) {
@@ -80,6 +250,8 @@ bool ZoxNGCEventProvider::parse_ngch_request(
 	const uint8_t* data, size_t data_size,
 	bool _private
 ) {
+	ZOX_TRACE_SCOPE("ZoxNGCEventProvider::parse_ngch_request");
+
 
 //| what      | Length in bytes| Contents         |
 //|-----------|----------------|------------------|
@@ -121,6 +293,8 @@ bool ZoxNGCEventProvider::parse_ngch_syncmsg(
 	const uint8_t* data, size_t data_size,
 	bool _private
 ) {
+	ZOX_TRACE_SCOPE("ZoxNGCEventProvider::parse_ngch_syncmsg");
+
 
 //| what        | Length in bytes| Contents                                                                      |
 //|-------------|----------------|-------------------------------------------------------------------------------|
@@ -171,15 +345,21 @@ bool ZoxNGCEventProvider::parse_ngch_syncmsg(
 	data_size -= 4;
 
 	// 25 bytes, sender name, truncated/filled with 0
+	std::string sender_name_storage;
 	std::string_view sender_name{reinterpret_cast<const char*>(data), 25};
-	sender_name = sender_name.substr(0, sender_name.find_first_of('\0')); // trim \0
+	sender_name = sanitize_text(sender_name, sender_name_storage, _metrics.text_invalid_utf8);
 
 	data += 25;
 	data_size -= 25;
 
 	// up to 39927 bytes, message
+	std::string message_text_storage;
 	std::string_view message_text{reinterpret_cast<const char*>(data), data_size};
-	message_text = message_text.substr(0, message_text.find_first_of('\0')); // trim \0
+	message_text = sanitize_text(message_text, message_text_storage, _metrics.text_invalid_utf8);
+	if (message_text.empty()) {
+		std::cerr << "ZOX ngch_syncmsg without valid text\n";
+		return false;
+	}
 
 	return dispatch(
 		ZoxNGC_Event::ngch_syncmsg,
@@ -196,11 +376,335 @@ bool ZoxNGCEventProvider::parse_ngch_syncmsg(
 	);
 }
 
+bool ZoxNGCEventProvider::parse_ngch_caps(
+	uint32_t group_number, uint32_t peer_number,
+	const uint8_t* data, size_t data_size,
+	bool _private
+) {
+	ZOX_TRACE_SCOPE("ZoxNGCEventProvider::parse_ngch_caps");
+
+
+//| what      | Length in bytes| Contents         |
+//|-----------|----------------|------------------|
+//| magic     |       6        |  0x667788113435  |
+//| version   |       1        |  0x01            |
+//| pkt id    |       1        |  0x04            |
+//| caps      |       1        |  bitset of ZoxNGCCaps, unknown bits are ignored |
+//| ...       |    [0, ...]    |  reserved, ignored |
+
+	if (data_size < 1) {
+		std::cerr << "ZOX ngch_caps has wrong size, should: >=1 , is: " << data_size << "\n";
+		return false;
+	}
+
+	return dispatch(
+		ZoxNGC_Event::ngch_caps,
+		Events::ZoxNGC_ngch_caps{
+			group_number,
+			peer_number,
+			_private,
+			data[0]
+		}
+	);
+}
+
+bool ZoxNGCEventProvider::parse_ngch_request_digest(
+	uint32_t group_number, uint32_t peer_number,
+	const uint8_t* data, size_t data_size,
+	bool _private
+) {
+	ZOX_TRACE_SCOPE("ZoxNGCEventProvider::parse_ngch_request_digest");
+
+
+//| what          | Length in bytes| Contents         |
+//|---------------|----------------|------------------|
+//| magic         |       6        |  0x667788113435  |
+//| version       |       1        |  0x01            |
+//| pkt id        |       1        |  0x05            |
+//| sync delta    |       1        |  same as ngch_request |
+//| bucket minutes|       1        |  width of a bucket in minutes, >= 1 |
+//| first bucket  |       4        |  uint32_t (bigendian) unixtime in seconds / (bucket minutes * 60) of the first bucket |
+//| bucket count  |       1        |  number of buckets following |
+//| buckets       |  count * 10    |  uint16_t message count, uint64_t sum of message hashes (both bigendian) |
+
+	constexpr size_t min_pkg_size = 1 + 1 + 4 + 1;
+	if (data_size < min_pkg_size) {
+		std::cerr << "ZOX ngch_request_digest has wrong size, should: >=" << min_pkg_size << " , is: " << data_size << "\n";
+		return false;
+	}
+
+	uint8_t sync_delta = data[0];
+	// clamp
+	if (sync_delta < 5u) {
+		sync_delta = 5u;
+	} else if (sync_delta > 130u) {
+		sync_delta = 130u;
+	}
+
+	const uint8_t bucket_minutes = data[1];
+	if (bucket_minutes == 0) {
+		std::cerr << "ZOX ngch_request_digest has invalid bucket width 0\n";
+		return false;
+	}
+
+	uint32_t first_bucket = 0;
+	first_bucket |= uint32_t(data[2]) << 8*3;
+	first_bucket |= uint32_t(data[3]) << 8*2;
+	first_bucket |= uint32_t(data[4]) << 8*1;
+	first_bucket |= uint32_t(data[5]) << 8*0;
+
+	const size_t bucket_count = data[6];
+
+	data += min_pkg_size;
+	data_size -= min_pkg_size;
+
+	if (data_size != bucket_count * 10) {
+		std::cerr << "ZOX ngch_request_digest has wrong size, should: " << min_pkg_size + bucket_count*10 << " , is: " << min_pkg_size + data_size << "\n";
+		return false;
+	}
+
+	std::vector<Events::ZoxNGC_ngch_request_digest::Bucket> buckets;
+	buckets.reserve(bucket_count);
+	for (size_t i = 0; i < bucket_count; i++, data += 10) {
+		auto& b = buckets.emplace_back();
+
+		b.count |= uint16_t(data[0]) << 8*1;
+		b.count |= uint16_t(data[1]) << 8*0;
+
+		for (size_t j = 0; j < 8; j++) {
+			b.hash |= uint64_t(data[2+j]) << 8*(7-j);
+		}
+	}
+
+	return dispatch(
+		ZoxNGC_Event::ngch_request_digest,
+		Events::ZoxNGC_ngch_request_digest{
+			group_number,
+			peer_number,
+			_private,
+			sync_delta,
+			bucket_minutes,
+			first_bucket,
+			std::move(buckets)
+		}
+	);
+}
+
+bool ZoxNGCEventProvider::parse_ngch_syncmsg_packed(
+	uint32_t group_number, uint32_t peer_number,
+	const uint8_t* data, size_t data_size,
+	bool _private
+) {
+	ZOX_TRACE_SCOPE("ZoxNGCEventProvider::parse_ngch_syncmsg_packed");
+
+
+//| what        | Length in bytes| Contents                                                       |
+//|-------------|----------------|----------------------------------------------------------------|
+//| magic       |       6        |  0x667788113435                                                |
+//| version     |       1        |  0x01                                                          |
+//| pkt id      |       1        |  0x06 <-- packed text                                          |
+//| sender count|       1        |  number of sender entries following                            |
+//| senders     | count * [33, 161] | 32 bytes pubkey, 1 byte name length, [0, 128] bytes name    |
+//| records     | [12, ...]      |  until the end of the packet, see below                        |
+//
+// record:
+//| what        | Length in bytes| Contents                                                       |
+//|-------------|----------------|----------------------------------------------------------------|
+//| sender      |       1        |  index into the sender entries                                 |
+//| msg id      |       4        |  same as ngch_syncmsg                                          |
+//| timestamp   |       4        |  same as ngch_syncmsg                                          |
+//| length      |       2        |  uint16_t (bigendian) length of the message text              |
+//| message     | [1, 65535]     |  message text, zero length message not allowed!                |
+
+	if (data_size < 1) {
+		std::cerr << "ZOX ngch_syncmsg_packed has wrong size, should: >=1 , is: " << data_size << "\n";
+		return false;
+	}
+
+	struct Sender {
+		std::array<uint8_t, 32> pub_key;
+		std::string_view name;
+		std::string name_storage; // only if name needed fixing
+	};
+	std::vector<Sender> senders;
+	senders.reserve(data[0]); // no reallocation, name can point into name_storage
+
+	{ // senders
+		const size_t sender_count = data[0];
+		data += 1;
+		data_size -= 1;
+
+		for (size_t i = 0; i < sender_count; i++) {
+			if (data_size < 32 + 1 || data_size < 32 + 1 + size_t(data[32])) {
+				std::cerr << "ZOX ngch_syncmsg_packed sender " << i << " truncated\n";
+				return false;
+			}
+			if (data[32] > ZoxNGCSyncMsgPacker::max_name_size) {
+				// the packer never writes longer names
+				std::cerr << "ZOX ngch_syncmsg_packed sender " << i << " name too long: " << int(data[32]) << "\n";
+				return false;
+			}
+
+			auto& sender = senders.emplace_back();
+			std::copy(data, data+32, sender.pub_key.begin());
+			sender.name = {reinterpret_cast<const char*>(data+32+1), data[32]};
+			sender.name = sanitize_text(sender.name, sender.name_storage, _metrics.text_invalid_utf8);
+
+			data_size -= 32 + 1 + data[32];
+			data += 32 + 1 + data[32];
+		}
+	}
+
+	bool handled = false;
+	size_t record_count = 0;
+	while (data_size > 0) {
+		constexpr size_t record_header_size = 1 + 4 + 4 + 2;
+		if (data_size < record_header_size) {
+			std::cerr << "ZOX ngch_syncmsg_packed record " << record_count << " truncated\n";
+			return handled;
+		}
+
+		const size_t sender_idx = data[0];
+
+		uint32_t message_id = 0;
+		message_id |= uint32_t(data[1]) << 8*3;
+		message_id |= uint32_t(data[2]) << 8*2;
+		message_id |= uint32_t(data[3]) << 8*1;
+		message_id |= uint32_t(data[4]) << 8*0;
+
+		uint32_t timestamp = 0;
+		timestamp |= uint32_t(data[5]) << 8*3;
+		timestamp |= uint32_t(data[6]) << 8*2;
+		timestamp |= uint32_t(data[7]) << 8*1;
+		timestamp |= uint32_t(data[8]) << 8*0;
+
+		size_t text_size = 0;
+		text_size |= size_t(data[9]) << 8*1;
+		text_size |= size_t(data[10]) << 8*0;
+
+		data += record_header_size;
+		data_size -= record_header_size;
+
+		if (text_size > data_size) {
+			std::cerr << "ZOX ngch_syncmsg_packed record " << record_count << " truncated\n";
+			return handled;
+		}
+
+		std::string message_text_storage;
+		std::string_view message_text{reinterpret_cast<const char*>(data), text_size};
+		message_text = sanitize_text(message_text, message_text_storage, _metrics.text_invalid_utf8);
+
+		data += text_size;
+		data_size -= text_size;
+		record_count++;
+
+		if (sender_idx >= senders.size()) {
+			std::cerr << "ZOX ngch_syncmsg_packed record with invalid sender " << sender_idx << "\n";
+			continue;
+		}
+
+		if (message_text.empty()) {
+			std::cerr << "ZOX ngch_syncmsg_packed record with empty text\n";
+			continue;
+		}
+
+		handled = dispatch(
+			ZoxNGC_Event::ngch_syncmsg,
+			Events::ZoxNGC_ngch_syncmsg{
+				group_number,
+				peer_number,
+				_private,
+				message_id,
+				senders[sender_idx].pub_key,
+				timestamp,
+				senders[sender_idx].name,
+				message_text
+			}
+		) || handled;
+	}
+
+	return handled;
+}
+
+bool ZoxNGCEventProvider::parse_ngch_syncmsg_compressed(
+	uint32_t group_number, uint32_t peer_number,
+	const uint8_t* data, size_t data_size,
+	bool _private
+) {
+	ZOX_TRACE_SCOPE("ZoxNGCEventProvider::parse_ngch_syncmsg_compressed");
+
+
+//| what        | Length in bytes| Contents                                                       |
+//|-------------|----------------|----------------------------------------------------------------|
+//| magic       |       6        |  0x667788113435                                                |
+//| version     |       1        |  0x01                                                          |
+//| pkt id      |       1        |  0x07 <-- compressed packed text                               |
+//| flags       |       1        |  0x01: the previous packet is part of the dictionary           |
+//| seq         |       2        |  uint16_t (bigendian) packet sequence number                   |
+//| size        |       2        |  uint16_t (bigendian) uncompressed size                        |
+//| data        | [1, ...]       |  ZoxLZ compressed ngch_syncmsg_packed body (without magic and header) |
+//
+// the dictionary is ZoxNGCSyncMsgPacker::buildDictionary() with the body of the packet seq-1 if flag 0x01 is set
+
+	constexpr size_t min_pkg_size = 1 + 2 + 2 + 1;
+	if (data_size < min_pkg_size) {
+		std::cerr << "ZOX ngch_syncmsg_compressed has wrong size, should: >=" << min_pkg_size << " , is: " << data_size << "\n";
+		return false;
+	}
+
+	const uint8_t flags = data[0];
+
+	uint16_t seq = 0;
+	seq |= uint16_t(data[1]) << 8*1;
+	seq |= uint16_t(data[2]) << 8*0;
+
+	size_t body_size = 0;
+	body_size |= size_t(data[3]) << 8*1;
+	body_size |= size_t(data[4]) << 8*0;
+
+	data += min_pkg_size - 1;
+	data_size -= min_pkg_size - 1;
+
+	auto& state = _compressed_sync_state[{group_number, peer_number}];
+
+	static const std::vector<uint8_t> no_body;
+	const bool uses_prev = (flags & 0x01) != 0;
+	if (uses_prev && (state.body.empty() || uint16_t(state.seq + 1u) != seq)) {
+		// lost or reordered, everything until the sender starts a new chain is lost too
+		// they still get synced with the next request
+		std::cerr << "ZOX ngch_syncmsg_compressed missing previous packet " << (uint16_t)(seq-1u) << ", waiting for a new chain\n";
+		_metrics.compressed_failures.add();
+		state.body.clear();
+		return false;
+	}
+
+	std::vector<uint8_t> dict;
+	ZoxNGCSyncMsgPacker::buildDictionary(uses_prev ? state.body : no_body, dict);
+
+	std::vector<uint8_t> body;
+	if (!ZoxLZ::decompress(dict.data(), dict.size(), data, data_size, body, body_size) || body.size() != body_size) {
+		std::cerr << "ZOX ngch_syncmsg_compressed failed to decompress, waiting for a new chain\n";
+		_metrics.compressed_failures.add();
+		state.body.clear();
+		return false;
+	}
+
+	const bool handled = parse_ngch_syncmsg_packed(group_number, peer_number, body.data(), body.size(), _private);
+
+	// keep for the next packet
+	state.seq = seq;
+	state.body = std::move(body);
+
+	return handled;
+}
+
 bool ZoxNGCEventProvider::parse_ngca(
 	uint32_t group_number, uint32_t peer_number,
 	const uint8_t* data, size_t data_size,
 	bool _private
 ) {
+	ZOX_TRACE_SCOPE("ZoxNGCEventProvider::parse_ngca");
+
 
 //| what          | Length in bytes| Contents                            |
 //|------         |--------        |------------------                   |
@@ -211,15 +715,19 @@ bool ZoxNGCEventProvider::parse_ngca(
 //| sampling freq |       1        |  uint8_t always 48 (for 48kHz)      |
 //| data          |[1, 1362]       |  *uint8_t  bytes, zero not allowed! |
 
+	const uint64_t now_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
 	constexpr size_t min_pkg_size = 1 + 1 + 1;
 	if (data_size < min_pkg_size) {
 		std::cerr << "ZOX ngca has wrong size, should: >=" << min_pkg_size << " , is: " << data_size << "\n";
+		_ngca_stats.observeMalformed(group_number, peer_number, now_us);
 		return false;
 	}
 
 	constexpr size_t max_pkg_size = 1 + 1 + 1362;
 	if (data_size > max_pkg_size) {
 		std::cerr << "ZOX ngca has wrong size, should: <=" << max_pkg_size << " , is: " << data_size << "\n";
+		_ngca_stats.observeMalformed(group_number, peer_number, now_us);
 		return false;
 	}
 
@@ -242,6 +750,7 @@ bool ZoxNGCEventProvider::parse_ngca(
 	}
 
 	// 1-1362 bytes, data
+	_ngca_stats.observe(group_number, peer_number, now_us, audio_channels, sampling_freq, data, data_size);
 	std::vector<uint8_t> v_data{data, data+data_size};
 
 	return dispatch(
@@ -263,19 +772,8 @@ bool ZoxNGCEventProvider::onToxEvent(const Tox_Event_Group_Custom_Packet* e) {
 	const uint8_t* data = tox_event_group_custom_packet_get_data(e);
 	size_t size = tox_event_group_custom_packet_get_data_length(e);
 
-	auto res_opt = parse_zox_pkg_header(data, size);
-	if (!res_opt) {
-		return false;
-	}
-
-	auto [version, pkt_id] = *res_opt;
-
-	data += zox_header_size;
-	size -= zox_header_size;
-
-	return onZoxGroupEvent(
+	return onGroupCustomPacket(
 		group_number, peer_number,
-		version, pkt_id,
 		data, size,
 		false
 	);
@@ -287,21 +785,20 @@ bool ZoxNGCEventProvider::onToxEvent(const Tox_Event_Group_Custom_Private_Packet
 	const uint8_t* data = tox_event_group_custom_private_packet_get_data(e);
 	size_t size = tox_event_group_custom_private_packet_get_data_length(e);
 
-	auto res_opt = parse_zox_pkg_header(data, size);
-	if (!res_opt) {
-		return false;
-	}
-
-	auto [version, pkt_id] = *res_opt;
-
-	data += zox_header_size;
-	size -= zox_header_size;
-
-	return onZoxGroupEvent(
+	return onGroupCustomPacket(
 		group_number, peer_number,
-		version, pkt_id,
 		data, size,
 		true
 	);
 }
 
+bool ZoxNGCEventProvider::onToxEvent(const Tox_Event_Group_Peer_Exit* e) {
+	const uint32_t group_number = tox_event_group_peer_exit_get_group_number(e);
+	const uint32_t peer_number = tox_event_group_peer_exit_get_peer_id(e);
+
+	// the peer number might get reused, and a new session starts a new chain anyway
+	_compressed_sync_state.erase({group_number, peer_number});
+
+	return false; // others need it too
+}
+
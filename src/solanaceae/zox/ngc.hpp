@@ -4,12 +4,21 @@
 
 #include <solanaceae/util/event_provider.hpp>
 
+#include "./metrics.hpp"
+#include "./ngca_stats.hpp"
+
 #include <cstdint>
 #include <array>
 #include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <ostream>
+#include <string>
 
 // fwd
 //struct ToxI;
+class ZoxNGCCaptureWriter;
 
 // zoff ngc history sync
 // https://github.com/zoff99/c-toxcore/blob/zoff99/zoxcore_local_fork/docs/ngc_group_history_sync.md
@@ -18,6 +27,19 @@
 // zoff ngc audio
 // https://github.com/zoff99/c-toxcore/blob/zoff99/zoxcore_local_fork/docs/ngc_audio.md
 
+// capability bits for ngch_caps
+// NOTE: ngch_caps and everything negotiated through it are extensions, not part of zoffs spec
+namespace ZoxNGCCaps {
+	// peer understands ngch_request_digest
+	constexpr uint8_t request_digest = 1u << 0;
+
+	// peer understands ngch_syncmsg_packed
+	constexpr uint8_t syncmsg_packed = 1u << 1;
+
+	// peer understands ngch_syncmsg_compressed
+	constexpr uint8_t syncmsg_compressed = 1u << 2;
+} // ZoxNGCCaps
+
 namespace Events {
 
 	struct ZoxNGC_ngch_request {
@@ -29,6 +51,36 @@ namespace Events {
 		uint8_t sync_delta {130u};
 	};
 
+	struct ZoxNGC_ngch_caps {
+		uint32_t group_number {0u};
+		uint32_t peer_number {0u};
+
+		bool _private {true};
+
+		uint8_t caps {0u}; // ZoxNGCCaps bits
+	};
+
+	// like ngch_request, but the requester tells us what it already has
+	struct ZoxNGC_ngch_request_digest {
+		uint32_t group_number {0u};
+		uint32_t peer_number {0u};
+
+		bool _private {true};
+
+		uint8_t sync_delta {130u};
+
+		// buckets are absolute, bucket i covers unixtime seconds
+		// [(first_bucket+i)*bucket_minutes*60, (first_bucket+i+1)*bucket_minutes*60)
+		uint8_t bucket_minutes {1u};
+		uint32_t first_bucket {0u};
+
+		struct Bucket {
+			uint16_t count {0u};
+			uint64_t hash {0u}; // sum of the message hashes
+		};
+		std::vector<Bucket> buckets;
+	};
+
 	struct ZoxNGC_ngch_syncmsg {
 		uint32_t group_number {0u};
 		uint32_t peer_number {0u};
@@ -67,8 +119,14 @@ enum class ZoxNGC_Event : uint32_t {
 	v0x01_id0x03,
 	ngch_syncmsg_file = v0x01_id0x03,
 
-	//v0x01_id0x04,
-	//v0x01_id0x05,
+	// extension
+	v0x01_id0x04,
+	ngch_caps = v0x01_id0x04,
+
+	// extension
+	v0x01_id0x05,
+	ngch_request_digest = v0x01_id0x05,
+
 	//v0x01_id0x06,
 	//v0x01_id0x07,
 	//v0x01_id0x08,
@@ -102,19 +160,138 @@ struct ZoxNGCEventI {
 	using enumType = ZoxNGC_Event;
 	virtual bool onEvent(const Events::ZoxNGC_ngch_request&) { return false; }
 	virtual bool onEvent(const Events::ZoxNGC_ngch_syncmsg&) { return false; }
+	virtual bool onEvent(const Events::ZoxNGC_ngch_caps&) { return false; }
+	virtual bool onEvent(const Events::ZoxNGC_ngch_request_digest&) { return false; }
 	virtual bool onEvent(const Events::ZoxNGC_ngca&) { return false; }
 };
 
 using ZoxNGCEventProviderI = EventProviderI<ZoxNGCEventI>;
 
+// incoming traffic, updated on the tox thread, safe to read from anywhere
+struct ZoxNGCMetrics {
+	ZoxMetricCounter packets_in;
+	ZoxMetricCounter bytes_in;
+	ZoxMetricCounter packets_not_zox; // no magic or header
+	ZoxMetricCounter packets_unhandled; // unknown, or failed to parse
+	ZoxMetricCounter text_invalid_utf8; // names and texts with invalid sequences replaced, or a cut off one dropped
+	// ngch_syncmsg_compressed that could not be decoded (previous packet lost/broken, or malformed)
+	// the sender starts a new chain regularly, see ZoxNGCSyncEncoder::compressed_chain_max
+	ZoxMetricCounter compressed_failures;
+
+	// version 0x01, by pkt_id
+	std::array<ZoxMetricCounter, 256> packets_by_id;
+	std::array<ZoxMetricCounter, 256> bytes_by_id;
+
+	// parsing and dispatching one zox packet, includes the subscribers handling it
+	ZoxMetricHistogram handle_us;
+
+	void writeText(std::ostream& out) const;
+};
+
 class ZoxNGCEventProvider : public ToxEventI, public ZoxNGCEventProviderI {
 	ToxEventProviderI::SubscriptionReference _tep_sr;
 	//ToxI& _t;
 
+	// ngch_syncmsg_compressed uses the previous packet from the same peer as part of the dictionary
+	struct CompressedSyncState {
+		uint16_t seq {0u};
+		std::vector<uint8_t> body;
+	};
+	// (group, peer) -> last decompressed body, dropped when the peer leaves
+	std::map<std::pair<uint32_t, uint32_t>, CompressedSyncState> _compressed_sync_state;
+
+	// optional recording of all incoming group custom packets
+	std::unique_ptr<ZoxNGCCaptureWriter> _capture;
+
+	ZoxNGCMetrics _metrics;
+	ZoxNGCAStats _ngca_stats;
+
+	public:
+		static constexpr uint32_t any_peer {~uint32_t(0)};
+
+	private:
+		struct ScopedSubscriber {
+			ZoxNGCEventI* object;
+			uint32_t peer_number; // or any_peer
+		};
+		// per event type, group_number -> subscribers
+		std::array<std::unordered_map<uint32_t, std::vector<ScopedSubscriber>>, size_t(ZoxNGC_Event::MAX)> _scoped_subscribers;
+
 	public:
 		ZoxNGCEventProvider(ToxEventProviderI& tep/*, ToxI& t*/);
+		~ZoxNGCEventProvider(void);
+
+		// like subscribing through ZoxNGCEventProviderI, but only for events of group_number (and peer_number)
+		// scoped subscribers get the event before the unscoped ones
+		// dont (un)subscribe from inside a handler
+		void subscribeScoped(ZoxNGCEventI* object, ZoxNGC_Event event_type, uint32_t group_number, uint32_t peer_number = any_peer);
+		void unsubscribeScoped(ZoxNGCEventI* object, ZoxNGC_Event event_type, uint32_t group_number, uint32_t peer_number = any_peer);
+		// all scoped subscriptions of object
+		void unsubscribeScoped(ZoxNGCEventI* object);
+
+		// unsubscribes everything on destruction
+		class ScopedSubscriptionReference {
+			ZoxNGCEventProvider& _provider;
+			ZoxNGCEventI* _object;
+
+			public:
+				ScopedSubscriptionReference(ZoxNGCEventProvider& provider, ZoxNGCEventI* object) : _provider(provider), _object(object) {}
+				~ScopedSubscriptionReference(void) { _provider.unsubscribeScoped(_object); }
+
+				ScopedSubscriptionReference(const ScopedSubscriptionReference&) = delete;
+				ScopedSubscriptionReference& operator=(const ScopedSubscriptionReference&) = delete;
+
+				ScopedSubscriptionReference& subscribe(ZoxNGC_Event event_type, uint32_t group_number, uint32_t peer_number = any_peer) {
+					_provider.subscribeScoped(_object, event_type, group_number, peer_number);
+					return *this;
+				}
+
+				ScopedSubscriptionReference& unsubscribe(ZoxNGC_Event event_type, uint32_t group_number, uint32_t peer_number = any_peer) {
+					_provider.unsubscribeScoped(_object, event_type, group_number, peer_number);
+					return *this;
+				}
+		};
+
+		ScopedSubscriptionReference newScopedSubRef(ZoxNGCEventI* object) {
+			return {*this, object};
+		}
+
+		// records raw group custom packets to path (see ngc_capture.hpp), replaces a running capture
+		// an existing file is kept, the capture then goes to "path.N"
+		bool startCapture(const std::string& path);
+		void stopCapture(void);
+
+		ZoxNGCMetrics& metrics(void) { return _metrics; }
+
+		// per (group, peer) audio receive quality, readable from any thread
+		ZoxNGCAStats& ngcaStats(void) { return _ngca_stats; }
+
+		// entry point for raw group custom packets, magic and header included
+		// used by the tox events, and to replay captures
+		bool onGroupCustomPacket(
+			uint32_t group_number, uint32_t peer_number,
+			const uint8_t* data, size_t data_size,
+			bool _private
+		);
 
 	protected:
+		// scoped subscribers of the events group first, then everyone subscribed through ZoxNGCEventProviderI
+		template<typename EventType>
+		bool dispatch(ZoxNGC_Event event_type, const EventType& event) {
+			const auto& groups = _scoped_subscribers[size_t(event_type)];
+			if (!groups.empty()) {
+				if (const auto it = groups.find(event.group_number); it != groups.end()) {
+					for (const auto& sub : it->second) {
+						if ((sub.peer_number == any_peer || sub.peer_number == event.peer_number) && sub.object->onEvent(event)) {
+							return true;
+						}
+					}
+				}
+			}
+
+			return ZoxNGCEventProviderI::dispatch(event_type, event);
+		}
+
 		bool onZoxGroupEvent(
 			uint32_t group_number, uint32_t peer_number,
 			uint8_t version, uint8_t pkt_id,
@@ -134,6 +311,32 @@ class ZoxNGCEventProvider : public ToxEventI, public ZoxNGCEventProviderI {
 			bool _private
 		);
 
+		bool parse_ngch_caps(
+			uint32_t group_number, uint32_t peer_number,
+			const uint8_t* data, size_t data_size,
+			bool _private
+		);
+
+		bool parse_ngch_request_digest(
+			uint32_t group_number, uint32_t peer_number,
+			const uint8_t* data, size_t data_size,
+			bool _private
+		);
+
+		// extension, dispatches a ngch_syncmsg for each contained message
+		bool parse_ngch_syncmsg_packed(
+			uint32_t group_number, uint32_t peer_number,
+			const uint8_t* data, size_t data_size,
+			bool _private
+		);
+
+		// extension, decompresses and hands off to parse_ngch_syncmsg_packed()
+		bool parse_ngch_syncmsg_compressed(
+			uint32_t group_number, uint32_t peer_number,
+			const uint8_t* data, size_t data_size,
+			bool _private
+		);
+
 		bool parse_ngca(
 			uint32_t group_number, uint32_t peer_number,
 			const uint8_t* data, size_t data_size,
@@ -143,5 +346,6 @@ class ZoxNGCEventProvider : public ToxEventI, public ZoxNGCEventProviderI {
 	protected:
 		bool onToxEvent(const Tox_Event_Group_Custom_Packet* e) override;
 		bool onToxEvent(const Tox_Event_Group_Custom_Private_Packet* e) override;
+		bool onToxEvent(const Tox_Event_Group_Peer_Exit* e) override;
 };
 
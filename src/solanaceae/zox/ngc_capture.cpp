@@ -0,0 +1,161 @@
+#include "./ngc_capture.hpp"
+
+#include <array>
+#include <algorithm>
+#include <filesystem>
+
+static constexpr std::array<char, 6> capture_magic {'Z', 'O', 'X', 'C', 'A', 'P'};
+static constexpr uint8_t capture_version = 0x01;
+
+// writes happen from the event loop, so they are batched
+static constexpr size_t capture_buffer_size = 64*1024;
+// but not held for long, so a crash loses little
+static constexpr uint64_t capture_flush_interval_ms = 5u*1000u;
+// "path.1" to "path.N"
+static constexpr size_t capture_max_suffix = 1000;
+
+static void push_varint(std::vector<uint8_t>& out, uint64_t v) {
+	while (v >= 0x80) {
+		out.push_back(0x80 | (v & 0x7f));
+		v >>= 7;
+	}
+	out.push_back(v);
+}
+
+static bool read_varint(std::ifstream& file, uint64_t& v) {
+	v = 0;
+	for (size_t shift = 0; shift < 64; shift += 7) {
+		const int c = file.get();
+		if (c == std::ifstream::traits_type::eof()) {
+			return false;
+		}
+
+		v |= uint64_t(c & 0x7f) << shift;
+		if ((c & 0x80) == 0) {
+			return true;
+		}
+	}
+
+	return false; // too long
+}
+
+ZoxNGCCaptureWriter::ZoxNGCCaptureWriter(const std::string& path) {
+	// a previous run might have left a capture there
+	std::error_code ec;
+	_path = path;
+	for (size_t i = 1; std::filesystem::exists(_path, ec) && i <= capture_max_suffix; i++) {
+		_path = path + "." + std::to_string(i);
+	}
+	if (ec || std::filesystem::exists(_path, ec)) {
+		return; // not opened
+	}
+
+	_file.open(_path, std::ios::binary | std::ios::out | std::ios::trunc);
+	if (!_file.is_open()) {
+		return;
+	}
+
+	_buffer.reserve(capture_buffer_size);
+	_buffer.insert(_buffer.end(), capture_magic.cbegin(), capture_magic.cend());
+	_buffer.push_back(capture_version);
+}
+
+ZoxNGCCaptureWriter::~ZoxNGCCaptureWriter(void) {
+	flush();
+}
+
+void ZoxNGCCaptureWriter::write(
+	uint64_t ts,
+	uint32_t group_number, uint32_t peer_number,
+	bool _private,
+	const uint8_t* data, size_t data_size
+) {
+	if (!_file.is_open()) {
+		return;
+	}
+
+	// clock going backwards is recorded as 0
+	push_varint(_buffer, ts > _last_ts ? ts - _last_ts : 0);
+	_last_ts = std::max(_last_ts, ts);
+
+	push_varint(_buffer, group_number);
+	push_varint(_buffer, peer_number);
+	_buffer.push_back(_private ? 0x01 : 0x00);
+	push_varint(_buffer, data_size);
+	_buffer.insert(_buffer.end(), data, data + data_size);
+
+	if (_last_flush_ts == 0) {
+		_last_flush_ts = ts;
+	}
+
+	if (_buffer.size() >= capture_buffer_size || ts - std::min(ts, _last_flush_ts) >= capture_flush_interval_ms) {
+		flush();
+		_last_flush_ts = ts;
+	}
+}
+
+void ZoxNGCCaptureWriter::flush(void) {
+	if (!_file.is_open() || _buffer.empty()) {
+		return;
+	}
+
+	_file.write(reinterpret_cast<const char*>(_buffer.data()), _buffer.size());
+	_file.flush();
+	_buffer.clear();
+}
+
+ZoxNGCCaptureReader::ZoxNGCCaptureReader(const std::string& path) {
+	_file.open(path, std::ios::binary | std::ios::in);
+	if (!_file.is_open()) {
+		return;
+	}
+
+	std::array<char, capture_magic.size() + 1> header;
+	if (!_file.read(header.data(), header.size())) {
+		return;
+	}
+
+	_valid =
+		std::equal(capture_magic.cbegin(), capture_magic.cend(), header.cbegin()) &&
+		uint8_t(header.back()) == capture_version
+	;
+}
+
+bool ZoxNGCCaptureReader::next(ZoxNGCCaptureRecord& record) {
+	if (!_valid) {
+		return false;
+	}
+
+	uint64_t ts_delta = 0;
+	uint64_t group_number = 0;
+	uint64_t peer_number = 0;
+	uint64_t data_size = 0;
+
+	if (!read_varint(_file, ts_delta) || !read_varint(_file, group_number) || !read_varint(_file, peer_number)) {
+		return false;
+	}
+
+	const int flags = _file.get();
+	if (flags == std::ifstream::traits_type::eof() || !read_varint(_file, data_size)) {
+		return false;
+	}
+
+	// sanity, custom packets are way smaller
+	if (data_size > 0xffff) {
+		return false;
+	}
+
+	record.data.resize(data_size);
+	if (!_file.read(reinterpret_cast<char*>(record.data.data()), data_size)) {
+		return false;
+	}
+
+	_last_ts += ts_delta;
+	record.ts = _last_ts;
+	record.group_number = group_number;
+	record.peer_number = peer_number;
+	record._private = (flags & 0x01) != 0;
+
+	return true;
+}
+
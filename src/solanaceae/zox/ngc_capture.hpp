@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <fstream>
+
+// append-only capture of raw group custom packets, for replaying traffic offline
+//
+//| what      | Length in bytes| Contents                          |
+//|-----------|----------------|-----------------------------------|
+//| magic     |       6        |  "ZOXCAP"                         |
+//| version   |       1        |  0x01                             |
+//| records   |    [0, ...]    |  until the end of the file        |
+//
+// record:
+//| what      | Length in bytes| Contents                          |
+//|-----------|----------------|-----------------------------------|
+//| ts delta  |   varint       |  ms since the previous record (first: since unix epoch) |
+//| group     |   varint       |  group number                     |
+//| peer      |   varint       |  peer number                      |
+//| flags     |       1        |  0x01: private                    |
+//| size      |   varint       |  packet size                      |
+//| data      |    size        |  the packet, as received          |
+//
+// varints are little endian base 128 (7 bits per byte, high bit set if more follow)
+
+struct ZoxNGCCaptureRecord {
+	uint64_t ts {0u}; // ms
+	uint32_t group_number {0u};
+	uint32_t peer_number {0u};
+	bool _private {false};
+	std::vector<uint8_t> data;
+};
+
+// buffered, written when the buffer is full or every few seconds (by record ts), and on flush()/destruction
+class ZoxNGCCaptureWriter {
+	std::string _path;
+	std::ofstream _file;
+	std::vector<uint8_t> _buffer;
+	uint64_t _last_ts {0u};
+	uint64_t _last_flush_ts {0u};
+
+	public:
+		// never overwrites, if path exists the capture goes to the first free "path.N" instead
+		explicit ZoxNGCCaptureWriter(const std::string& path);
+		~ZoxNGCCaptureWriter(void);
+
+		bool isOpen(void) const { return _file.is_open(); }
+
+		// the file actually written
+		const std::string& path(void) const { return _path; }
+
+		void write(
+			uint64_t ts,
+			uint32_t group_number, uint32_t peer_number,
+			bool _private,
+			const uint8_t* data, size_t data_size
+		);
+
+		void flush(void);
+};
+
+class ZoxNGCCaptureReader {
+	std::ifstream _file;
+	uint64_t _last_ts {0u};
+	bool _valid {false};
+
+	public:
+		explicit ZoxNGCCaptureReader(const std::string& path);
+
+		// false if the file could not be opened or is not a capture
+		bool isValid(void) const { return _valid; }
+
+		// false at the end of the file or on a truncated record
+		bool next(ZoxNGCCaptureRecord& record);
+};
+
@@ -1,5 +1,11 @@
 #include "./ngc_hs.hpp"
 
+#include "./ngc_hs_snapshot.hpp"
+#include "./ngc_hs_source.hpp"
+#include "./ngc_hs_components.hpp"
+#include "./worker_pool.hpp"
+#include "./trace.hpp"
+
 #include <solanaceae/util/time.hpp>
 
 #include <solanaceae/toxcore/tox_interface.hpp>
@@ -16,136 +22,460 @@
 #include <variant>
 #include <vector>
 #include <algorithm>
+#include <unordered_set>
 
 ZoxNGCHistorySync::ZoxNGCHistorySync(ToxEventProviderI& tep, ZoxNGCEventProviderI& zngcepi, ToxI& t, ContactStore4I& cs, ToxContactModel2& tcm, RegistryMessageModelI& rmm)
 	: _tep_sr(tep.newSubRef(this)), _zngcepi_sr(zngcepi.newSubRef(this)), _t(t), _cs(cs), _tcm(tcm), _rmm(rmm), _rng(std::random_device{}())
 {
-	_tep_sr.subscribe(Tox_Event_Type::TOX_EVENT_GROUP_PEER_JOIN);
+	_tep_sr
+		.subscribe(Tox_Event_Type::TOX_EVENT_GROUP_PEER_JOIN)
+		.subscribe(Tox_Event_Type::TOX_EVENT_GROUP_PEER_EXIT)
+	;
+
+	// also fires when the contact gets destroyed
+	_cs.registry().on_destroy<Contact::Components::ToxGroupPeerEphemeral>().connect<&ZoxNGCHistorySync::onPeerEphemeralDestroy>(*this);
 
 	_zngcepi_sr
 		.subscribe(ZoxNGC_Event::ngch_request)
 		.subscribe(ZoxNGC_Event::ngch_syncmsg)
+		.subscribe(ZoxNGC_Event::ngch_caps)
+		.subscribe(ZoxNGC_Event::ngch_request_digest)
 	;
+
+	_session_start_ms = nowMS();
+}
+
+ZoxNGCHistorySync::~ZoxNGCHistorySync(void) {
+	// dont lose what is still buffered
+	flushIngestBuffer();
+
+	auto& cr = _cs.registry();
+	cr.on_destroy<Contact::Components::ToxGroupPeerEphemeral>().disconnect<&ZoxNGCHistorySync::onPeerEphemeralDestroy>(*this);
+
+	// before the worker pool goes away
+	cr.clear<RequestQueueInfo, SyncQueueInfo, PeerExtInfo, PeerOfflineInfo, PeerOnlineInfo, ZoxClockSkewEstimator>();
+}
+
+void ZoxNGCHistorySync::setRNGSeed(uint32_t seed) {
+	_rng.seed(seed);
+}
+
+void ZoxNGCHistorySync::setTimeSource(std::function<uint64_t(void)>&& fn) {
+	_time_source = std::move(fn);
+	_session_start_ms = nowMS();
+}
+
+uint64_t ZoxNGCHistorySync::nowMS(void) const {
+	return _time_source ? _time_source() : getTimeMS();
+}
+
+bool ZoxNGCHistorySync::sendPacket(uint32_t group_number, uint32_t peer_number, const std::vector<uint8_t>& packet) {
+	const auto ret = _t.toxGroupSendCustomPrivatePacket(group_number, peer_number, true, packet);
+	// TODO: log error
+	if (ret != TOX_ERR_GROUP_SEND_CUSTOM_PRIVATE_PACKET_OK) {
+		_metrics.send_failures.add();
+		return false;
+	}
+
+	_metrics.packets_out.add();
+	_metrics.bytes_out.add(packet.size());
+	return true;
+}
+
+void ZoxNGCHistorySyncMetrics::writeText(std::ostream& out) const {
+	zox_metric_write(out, "zox_ngchs_requests_in_total", requests_in);
+	zox_metric_write(out, "zox_ngchs_requests_ignored_total", requests_ignored);
+	zox_metric_write(out, "zox_ngchs_requests_merged_total", requests_merged);
+	zox_metric_write(out, "zox_ngchs_request_selected", request_selected);
+	zox_metric_write(out, "zox_ngchs_request_select_us", request_select_us);
+	zox_metric_write(out, "zox_ngchs_rejoin_pushes_total", rejoin_pushes);
+	zox_metric_write(out, "zox_ngchs_source_records_total", source_records);
+	zox_metric_write(out, "zox_ngchs_source_pages_total", source_pages);
+	zox_metric_write(out, "zox_ngchs_sync_jobs_lost_total", sync_jobs_lost);
+
+	zox_metric_write(out, "zox_ngchs_syncmsgs_in_total", syncmsgs_in);
+	zox_metric_write(out, "zox_ngchs_syncmsgs_known_total", syncmsgs_known);
+	zox_metric_write(out, "zox_ngchs_syncmsgs_new_total", syncmsgs_new);
+	zox_metric_write(out, "zox_ngchs_syncmsgs_rejected_total", syncmsgs_rejected);
+	zox_metric_write(out, "zox_ngchs_syncmsg_ingest_us", syncmsg_ingest_us);
+	zox_metric_write(out, "zox_ngchs_syncers_untracked_total", syncers_untracked);
+	zox_metric_write(out, "zox_ngchs_ingest_reorder_buffered", ingest_reorder_buffered);
+	zox_metric_write(out, "zox_ngchs_clock_skew_samples_total", clock_skew_samples);
+	zox_metric_write(out, "zox_ngchs_clock_skew_restarts_total", clock_skew_restarts);
+	zox_metric_write(out, "zox_ngchs_syncmsgs_skew_mismatch_total", syncmsgs_skew_mismatch);
+
+	zox_metric_write(out, "zox_ngchs_request_queue_depth", request_queue_depth);
+	zox_metric_write(out, "zox_ngchs_requests_refused_total", requests_refused);
+	zox_metric_write(out, "zox_ngchs_sync_queue_depth", sync_queue_depth);
+	zox_metric_write(out, "zox_ngchs_sync_queue_waiting", sync_queue_waiting);
+	zox_metric_write(out, "zox_ngchs_sync_queue_pending", sync_queue_pending);
+	zox_metric_write(out, "zox_ngchs_sync_queue_bytes", sync_queue_bytes);
+	zox_metric_write(out, "zox_ngchs_sync_queue_wait_ms", sync_queue_wait_ms);
+
+	zox_metric_write(out, "zox_ngchs_packets_out_total", packets_out);
+	zox_metric_write(out, "zox_ngchs_bytes_out_total", bytes_out);
+	zox_metric_write(out, "zox_ngchs_send_failures_total", send_failures);
+	zox_metric_write(out, "zox_ngchs_sync_sessions_dropped_total", sync_sessions_dropped);
+
+	zox_metric_write(out, "zox_ngchs_tick_us", tick_us);
+	zox_metric_write(out, "zox_ngchs_ticks_over_budget_total", ticks_over_budget);
 }
 
 float ZoxNGCHistorySync::tick(float delta) {
+	ZOX_TRACE_SCOPE("ZoxNGCHistorySync::tick");
+
+	const auto tick_start = std::chrono::steady_clock::now();
+
 	float min_interval {_delay_next_request_min*60.f};
 
+	// checked before each send, timers keep running for everything
+	const auto deadline = tick_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float, std::milli>(_tick_budget_ms));
+	size_t ops = 0;
+	bool over_budget = false;
+	const auto budget_left = [&]() {
+		if (
+			(_tick_budget_ops != 0 && ops >= _tick_budget_ops) ||
+			(_tick_budget_ms > 0.f && std::chrono::steady_clock::now() >= deadline)
+		) {
+			over_budget = true;
+			return false;
+		}
+		return true;
+	};
+	const auto take_budget = [&]() {
+		if (!budget_left()) {
+			return false;
+		}
+		ops++;
+		return true;
+	};
+
+	auto& cr = _cs.registry();
+
 	// send queued requests
-	for (auto it = _request_queue.begin(); it != _request_queue.end();) {
-		it->second.timer += delta;
+	std::vector<Contact4> request_done;
+	auto request_view = cr.view<RequestQueueInfo>();
+	for (const Contact4 c : request_view) {
+		auto& rqi = request_view.get<RequestQueueInfo>(c);
+		rqi.timer += delta;
+
+		if (rqi.timer < rqi.delay) {
+			min_interval = std::min(min_interval, rqi.delay - rqi.timer);
+			continue;
+		}
 
-		if (it->second.timer >= it->second.delay) {
-			const auto& cr = _cs.registry();
+		if (!cr.all_of<Contact::Components::ToxGroupPeerEphemeral>(c)) {
+			// peer nolonger online, should have been removed on exit
+			request_done.push_back(c);
+			continue;
+		}
 
-			if (!cr.all_of<Contact::Components::ToxGroupPeerEphemeral>(it->first)) {
-				// peer nolonger online
-				it = _request_queue.erase(it);
+		if (!take_budget()) {
+			continue; // stays due
+		}
+		const auto [group_number, peer_number] = cr.get<Contact::Components::ToxGroupPeerEphemeral>(c);
+
+		auto& ext = cr.get_or_emplace<PeerExtInfo>(c);
+		if (!ext.caps_known && !ext.caps_sent) {
+			// first request, announce our extensions and give the peer a moment to answer
+			// peers without extensions will just ignore it
+			ext.caps_sent = true;
+			if (sendCaps(group_number, peer_number)) {
+				rqi.timer = 0.f;
+				rqi.delay = _delay_caps_reply_min + _rng_dist(_rng)*_delay_caps_reply_add;
+
+				min_interval = std::min(min_interval, rqi.delay);
 				continue;
 			}
-			const auto [group_number, peer_number] = cr.get<Contact::Components::ToxGroupPeerEphemeral>(it->first);
-
-			if (sendRequest(group_number, peer_number, it->second.sync_delta)) {
-				// on success, requeue with longer delay (minutes)
+		}
 
-				it->second.timer = 0.f;
-				it->second.delay = _delay_next_request_min + _rng_dist(_rng)*_delay_next_request_add;
+		const bool request_sent = (ext.caps & ZoxNGCCaps::request_digest) != 0
+			? sendRequestDigest(group_number, peer_number, rqi.sync_delta)
+			: sendRequest(group_number, peer_number, rqi.sync_delta)
+		;
 
-				// double the delay for overlap (9m-15m)
-				// TODO: finetune
-				it->second.sync_delta = uint8_t((it->second.delay/60.f)*2.f) + 1;
+		if (request_sent) {
+			// on success, requeue with longer delay (minutes)
 
-				std::cout << "ZOX #### requeued request in " << it->second.delay << "s\n";
+			rqi.timer = 0.f;
+			rqi.delay = _delay_next_request_min + _rng_dist(_rng)*_delay_next_request_add;
 
-				it++;
-			} else {
-				// on failure, assume disconnected
-				it = _request_queue.erase(it);
-			}
+			// double the delay for overlap (9m-15m)
+			// TODO: finetune
+			rqi.sync_delta = uint8_t((rqi.delay/60.f)*2.f) + 1;
 
-			// just choose something small, since we expect a response might arrive soon
-			min_interval = std::min(min_interval, _delay_between_syncs_min);
+			std::cout << "ZOX #### requeued request in " << rqi.delay << "s\n";
 		} else {
-			min_interval = std::min(min_interval, it->second.delay - it->second.timer);
-			it++;
+			// on failure, assume disconnected
+			request_done.push_back(c);
 		}
+
+		// just choose something small, since we expect a response might arrive soon
+		min_interval = std::min(min_interval, _delay_between_syncs_min);
 	}
+	cr.remove<RequestQueueInfo>(request_done.cbegin(), request_done.cend());
 
-	for (auto it = _sync_queue.begin(); it != _sync_queue.end();) {
-		it->second.timer += delta;
-		if (it->second.timer >= it->second.delay) {
-			it->second.timer = 0.f;
-			// TODO: set min_interval?
+	// serving budget, at most one second worth of burst
+	_sync_budget = std::min(_sync_budget + delta * _max_sync_bytes_per_second, float(_max_sync_bytes_per_second));
 
-			Message3 msg_e = it->second.ents.front();
-			it->second.ents.pop();
+	// activation and ordering scale with the session count, so they count against the budget too
+	// if nothing is left, the sessions wait for the next tick and keep the time they missed
+	auto sync_view = cr.view<SyncQueueInfo>();
+	std::vector<Contact4> sync_order;
+	const float sync_delta = delta + _sync_delta_carry;
+	if (budget_left()) {
+		_sync_delta_carry = 0.f;
 
-			const auto& cr = _cs.registry();
+		activateSyncSessions();
 
-			if (!cr.all_of<Contact::Components::ToxGroupPeerEphemeral>(it->first)) {
-				// peer nolonger online
-				it = _sync_queue.erase(it);
-				continue;
+		// round robin in entity order, starting after the session served last
+		sync_order.assign(sync_view.begin(), sync_view.end());
+		std::sort(sync_order.begin(), sync_order.end());
+		std::rotate(sync_order.begin(), std::upper_bound(sync_order.begin(), sync_order.end(), _sync_rr_last), sync_order.end());
+	} else {
+		_sync_delta_carry = sync_delta;
+	}
+
+	for (const Contact4 c : sync_order) {
+		auto& sqi = sync_view.get<SyncQueueInfo>(c);
+		if (!sqi.active) {
+			continue;
+		}
+
+		sqi.timer += sync_delta;
+		if (sqi.timer < sqi.delay + sqi.backoff) {
+			min_interval = std::min(min_interval, sqi.delay + sqi.backoff - sqi.timer);
+			continue;
+		}
+
+		if (_sync_budget <= 0.f) {
+			// out of budget, stays due until it refills
+			min_interval = std::min(min_interval, -_sync_budget / _max_sync_bytes_per_second + _delay_between_syncs_min);
+			continue;
+		}
+
+		if (!cr.all_of<Contact::Components::ToxGroupPeerEphemeral>(c)) {
+			// peer nolonger online, should have been removed on exit
+			cr.remove<SyncQueueInfo>(c);
+			continue;
+		}
+		const auto [group_number, peer_number] = cr.get<Contact::Components::ToxGroupPeerEphemeral>(c);
+
+		// collect from worker, in order
+		while (!sqi.encoded_futures.empty() && sqi.encoded_futures.front().wait_for(std::chrono::seconds{0}) == std::future_status::ready) {
+			try {
+				for (auto& packet : sqi.encoded_futures.front().get()) {
+					sqi.encoded.push_back(std::move(packet));
+				}
+			} catch (const std::future_error& err) {
+				// should not happen, setWorkerThreads() moves queued jobs to the new pool
+				// the part of the window is lost, the peer will get it with a later request
+				std::cerr << "ZOX NGCHS error: lost encoded sync packets of a session: " << err.what() << "\n";
+				_metrics.sync_jobs_lost.add();
+			}
+			sqi.encoded_futures.pop_front();
+		}
+		if (sqi.encoded_futures.empty()) {
+			sqi.snapshot_bytes = 0;
+		}
+
+		// snapshots (encoded) of extensions are older than the pending main thread messages (ents)
+		// so for newest_first they go after them
+		const bool encoded_first = sqi.order == ZoxNGCSyncOrder::oldest_first || sqi.ents.empty();
+
+		// history source pages, read before the queue runs dry
+		// with a worker one packet early, so the next page is ready in time
+		// pages with nothing to send are skipped right away, each read takes from the tick budget
+		while (
+			!sqi.source_ranges.empty() &&
+			encoded_first && sqi.encoded_futures.empty() && sqi.encoded.size() <= 1 &&
+			take_budget()
+		) {
+			fetchSourcePage(ContactHandle4{cr, c}, sqi);
+		}
+
+		if (encoded_first && sqi.encoded.empty() && !sqi.encoded_futures.empty()) {
+			// worker not done yet, nothing to send, so it neither uses the budget nor its turn
+			// stays due and gets checked again soon
+			min_interval = std::min(min_interval, _delay_between_syncs_min);
+			continue;
+		}
+
+		if (sqi.encoded.empty() && sqi.ents.empty()) {
+			if (sqi.source_ranges.empty()) {
+				// the remaining pages had nothing to send
+				cr.remove<SyncQueueInfo>(c);
 			}
-			const auto [group_number, peer_number] = cr.get<Contact::Components::ToxGroupPeerEphemeral>(it->first);
+			// else out of tick budget, stays due
+			continue;
+		}
+
+		if (!take_budget()) {
+			continue; // stays due
+		}
+
+		sqi.timer = 0.f;
+		// TODO: set min_interval?
+
+		bool sent = false;
+		if (encoded_first && !sqi.encoded.empty()) {
+			sent = sendPacket(group_number, peer_number, sqi.encoded.front());
+			if (sent) {
+				_sync_budget -= sqi.encoded.front().size();
+				sqi.encoded.pop_front();
 
-			auto* reg_ptr = _rmm.get(it->first);
+				if (!sqi.ents.empty()) {
+					// the peer's compressed stream state is now the worker's, start over for the rest
+					sqi.encoder = ZoxNGCSyncEncoder{peerCaps(c), TOX_GROUP_MAX_CUSTOM_LOSSLESS_PACKET_LENGTH, _compressed_body_budget};
+				}
+			}
+		} else {
+			// snapshot sessions dont need the registry, it might not even be loaded
+			auto* reg_ptr = _rmm.get(c);
 			if (reg_ptr == nullptr) {
 				//std::cout << "°°°°°°°° no reg for contact\n";
-				it = _sync_queue.erase(it);
+				cr.remove<SyncQueueInfo>(c);
 				continue;
 			}
 
-			Message3Registry& reg = *reg_ptr;
+			sent = sendSyncBatch(group_number, peer_number, *reg_ptr, sqi);
+		}
 
-			if (!reg.valid(msg_e)) {
-				std::cerr << "ZOX NGCHS error: invalid message in sync send queue\n";
-				it = _sync_queue.erase(it);
-				continue;
-			}
+		_sync_rr_last = c;
 
-			if (!reg.all_of<Message::Components::ContactFrom>(msg_e)) {
-				std::cerr << "ZOX NGCHS error: msg without sender\n";
+		if (sent) {
+			sqi.failures = 0;
+			sqi.backoff = 0.f;
+		} else {
+			// probably transient (eg. full send queue), resume with what is still queued later
+			sqi.failures++;
+			if (sqi.failures > _max_sync_send_failures) {
+				std::cerr << "ZOX NGCHS error: dropping sync session after " << sqi.failures << " failed sends\n";
+				_metrics.sync_sessions_dropped.add();
+				cr.remove<SyncQueueInfo>(c);
 				continue;
 			}
-			const auto& msg_sender = reg.get<Message::Components::ContactFrom>(msg_e).c;
+			sqi.backoff = _delay_sync_retry * sqi.failures;
+		}
 
-			if (!cr.all_of<Contact::Components::ToxGroupPeerPersistent>(msg_sender)) {
-				std::cerr << "ZOX NGCHS error: msg sender without persistant\n";
-				continue;
-			}
-			//if (auto peer_persist_opt = _cm.toPersistent(msg_sender); peer_persist_opt.has_value() && std::holds_alternative<ContactGroupPeerPersistent>(peer_persist_opt.value())) {
-			// get name for peer
-			// TODO: make sure there is no alias leaked
-			//const auto msg_sender_name = _cm.getContactName(msg_sender);
-			std::string_view msg_sender_name;
-			if (cr.all_of<Contact::Components::Name>(msg_sender)) {
-				msg_sender_name = cr.get<Contact::Components::Name>(msg_sender).name;
-			}
+		if (sqi.ents.empty() && sqi.encoded.empty() && sqi.encoded_futures.empty() && sqi.source_ranges.empty()) {
+			cr.remove<SyncQueueInfo>(c);
+			continue;
+		}
+	}
 
+	if (!_ingest_buffer.empty()) {
+		// the oldest buffered syncmsg decides
+		const uint64_t now_ts = nowMS();
+		uint64_t first_received_ts = now_ts;
+		for (const auto& msg : _ingest_buffer) {
+			first_received_ts = std::min(first_received_ts, msg.received_ts);
+		}
 
-			if (!sendSyncMessage(
-				group_number,
-				peer_number,
-				reg.get<Message::Components::ToxGroupMessageID>(msg_e).id,
-				cr.get<Contact::Components::ToxGroupPeerPersistent>(msg_sender).peer_key.data,
-				std::chrono::duration_cast<std::chrono::seconds>(std::chrono::milliseconds{reg.get<Message::Components::Timestamp>(msg_e).ts}).count(),
-				msg_sender_name,
-				reg.get<Message::Components::MessageText>(msg_e).text
-			) || it->second.ents.empty()) {
-				it = _sync_queue.erase(it);
-				continue;
-			}
+		if (now_ts - first_received_ts >= _ingest_reorder_delay_ms) {
+			flushIngestBuffer();
 		} else {
-			min_interval = std::min(min_interval, it->second.delay - it->second.timer);
+			min_interval = std::min(min_interval, (_ingest_reorder_delay_ms - (now_ts - first_received_ts)) / 1000.f);
 		}
+	}
+
+	// the gauges scan all sessions, they are refreshed by the next tick with budget left
+	if (budget_left()) {
+		size_t active = 0;
+		size_t pending = 0;
+		for (const auto& [c, sqi] : sync_view.each()) {
+			active += sqi.active ? 1 : 0;
+			pending += sqi.ents.size() + sqi.encoded.size();
+		}
+
+		// freed slots get used next tick
+		if (active < sync_view.size()) {
+			min_interval = std::min(min_interval, _delay_between_syncs_min);
+		}
+
+		_metrics.request_queue_depth.set(request_view.size());
+		_metrics.sync_queue_depth.set(active);
+		_metrics.sync_queue_waiting.set(sync_view.size() - active);
+		_metrics.sync_queue_pending.set(pending);
+		_metrics.sync_queue_bytes.set(syncQueueMemory());
+	}
 
-		it++;
+	_metrics.tick_us.observe(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tick_start).count());
+
+	if (over_budget) {
+		_metrics.ticks_over_budget.add();
+		return 0.f; // call again soon
 	}
 
 	return min_interval;
 }
 
+void ZoxNGCHistorySync::setTickBudget(float max_ms, size_t max_ops) {
+	_tick_budget_ms = max_ms;
+	_tick_budget_ops = max_ops;
+}
+
+std::optional<ZoxNGCSyncMsg> ZoxNGCHistorySync::getSyncMsgData(const Message3Registry& reg, Message3 msg_e) {
+	if (!reg.valid(msg_e)) {
+		std::cerr << "ZOX NGCHS error: invalid message in sync send queue\n";
+		return std::nullopt;
+	}
+
+	if (!reg.all_of<Message::Components::ContactFrom>(msg_e)) {
+		std::cerr << "ZOX NGCHS error: msg without sender\n";
+		return std::nullopt;
+	}
+	const auto& msg_sender = reg.get<Message::Components::ContactFrom>(msg_e).c;
+
+	const auto& cr = _cs.registry();
+	if (!cr.all_of<Contact::Components::ToxGroupPeerPersistent>(msg_sender)) {
+		std::cerr << "ZOX NGCHS error: msg sender without persistant\n";
+		return std::nullopt;
+	}
+
+	ZoxNGCSyncMsg data;
+
+	data.message_id = reg.get<Message::Components::ToxGroupMessageID>(msg_e).id;
+	data.sender_pub_key = cr.get<Contact::Components::ToxGroupPeerPersistent>(msg_sender).peer_key.data;
+	data.timestamp = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::milliseconds{reg.get<Message::Components::Timestamp>(msg_e).ts}).count();
+
+	//if (auto peer_persist_opt = _cm.toPersistent(msg_sender); peer_persist_opt.has_value() && std::holds_alternative<ContactGroupPeerPersistent>(peer_persist_opt.value())) {
+	// get name for peer
+	// TODO: make sure there is no alias leaked
+	//const auto msg_sender_name = _cm.getContactName(msg_sender);
+	if (cr.all_of<Contact::Components::Name>(msg_sender)) {
+		data.sender_name = cr.get<Contact::Components::Name>(msg_sender).name;
+	}
+
+	data.message_text = reg.get<Message::Components::MessageText>(msg_e).text;
+
+	return data;
+}
+
+bool ZoxNGCHistorySync::sendSyncBatch(uint32_t group_number, uint32_t peer_number, const Message3Registry& reg, SyncQueueInfo& sqi) {
+	ZOX_TRACE_SCOPE("ZoxNGCHistorySync::sendSyncBatch");
+
+	std::vector<uint8_t> packet;
+	const size_t used = std::max<size_t>(1u, sqi.encoder.encode(
+		sqi.ents.size(),
+		[this, &reg, &sqi](size_t i) { return getSyncMsgData(reg, sqi.ents.at(i)); },
+		packet
+	));
+
+	if (!packet.empty() && !sendPacket(group_number, peer_number, packet)) {
+		// keep the messages, the encoder is only advanced by commit()
+		return false;
+	}
+	_sync_budget -= packet.size();
+
+	sqi.encoder.commit();
+
+	// everything up to here is done, even if it was not sendable
+	sqi.ents.erase(sqi.ents.begin(), sqi.ents.begin() + std::min(used, sqi.ents.size()));
+
+	return true;
+}
+
 bool ZoxNGCHistorySync::sendRequest(
 	uint32_t group_number, uint32_t peer_number,
 	uint8_t sync_delta
@@ -168,21 +498,30 @@ bool ZoxNGCHistorySync::sendRequest(
 
 	packet.push_back(sync_delta);
 
-	auto ret = _t.toxGroupSendCustomPrivatePacket(group_number, peer_number, true, packet);
-	// TODO: log error
-
-	return ret == TOX_ERR_GROUP_SEND_CUSTOM_PRIVATE_PACKET_OK;
+	return sendPacket(group_number, peer_number, packet);
 }
 
-bool ZoxNGCHistorySync::sendSyncMessage(
+bool ZoxNGCHistorySync::sendRequestDigest(
 	uint32_t group_number, uint32_t peer_number,
-	uint32_t message_id,
-	const std::array<uint8_t, 32>& sender_pub_key,
-	uint32_t timestamp,
-	std::string_view sender_name,
-	std::string_view message_text
+	uint8_t sync_delta
 ) {
+	const auto c = _tcm.getContactGroupPeer(group_number, peer_number);
+	const auto* reg_ptr = static_cast<const RegistryMessageModelI&>(_rmm).get(c);
+	if (reg_ptr == nullptr) {
+		// nothing to digest
+		return sendRequest(group_number, peer_number, sync_delta);
+	}
+
+	const uint8_t bucket_minutes = zox_digest_bucket_minutes(sync_delta);
+	const uint64_t now_ts = nowMS();
+	const uint32_t first_bucket = zox_digest_bucket_index(now_ts - uint64_t(sync_delta) * 60u * 1000u, bucket_minutes);
+	const uint32_t last_bucket = zox_digest_bucket_index(now_ts, bucket_minutes);
+
+	std::vector<Events::ZoxNGC_ngch_request_digest::Bucket> buckets(std::min<size_t>(last_bucket - first_bucket + 1, 0xff));
+	fillDigest(*reg_ptr, bucket_minutes, first_bucket, buckets);
+
 	std::vector<uint8_t> packet;
+	packet.reserve(6 + 2 + 1 + 1 + 4 + 1 + buckets.size()*10);
 
 	{ // magic
 		//0x667788113435
@@ -195,94 +534,83 @@ bool ZoxNGCHistorySync::sendSyncMessage(
 	}
 
 	packet.push_back(0x01); // version
-	packet.push_back(0x02); // pkt_id
-
-	// 4 bytes, message id
-	packet.push_back(0xff & (message_id >> 8*3));
-	packet.push_back(0xff & (message_id >> 8*2));
-	packet.push_back(0xff & (message_id >> 8*1));
-	packet.push_back(0xff & (message_id >> 8*0));
-
-	// 32 bytes, sender pub key
-	packet.insert(packet.end(), sender_pub_key.cbegin(), sender_pub_key.cend());
-
+	packet.push_back(0x05); // pkt_id
 
-	// 4 bytes, timestamp
-	packet.push_back(0xff & (timestamp >> 8*3));
-	packet.push_back(0xff & (timestamp >> 8*2));
-	packet.push_back(0xff & (timestamp >> 8*1));
-	packet.push_back(0xff & (timestamp >> 8*0));
-
-
-	// 25 bytes, sender name, truncated/filled with 0
-	// TODO: handle unicode properly
-	for (size_t i = 0; i < 25; i++) {
-		if (i < sender_name.size()) {
-			packet.push_back(sender_name.at(i));
-		} else {
-			packet.push_back('\0');
+	packet.push_back(sync_delta);
+	packet.push_back(bucket_minutes);
+
+	// 4 bytes, first bucket
+	packet.push_back(0xff & (first_bucket >> 8*3));
+	packet.push_back(0xff & (first_bucket >> 8*2));
+	packet.push_back(0xff & (first_bucket >> 8*1));
+	packet.push_back(0xff & (first_bucket >> 8*0));
+
+	packet.push_back(buckets.size());
+	for (const auto& b : buckets) {
+		packet.push_back(0xff & (b.count >> 8*1));
+		packet.push_back(0xff & (b.count >> 8*0));
+		for (size_t i = 0; i < 8; i++) {
+			packet.push_back(0xff & (b.hash >> 8*(7-i)));
 		}
 	}
 
-	// up to 39927 bytes, message
-#if 0
-	packet.insert(packet.end(), message_text.cbegin(), message_text.cend());
-#else
-	//const int64_t msg_max_possible_size = _t.toxGroup
-	// TODO: make pr and add functions
-	const uint64_t msg_max_possible_size = std::clamp<int64_t>(
-		TOX_GROUP_MAX_CUSTOM_LOSSLESS_PACKET_LENGTH - packet.size(),
-		0, // low
-		39927 // high
-	);
-
-	for (size_t i = 0; i < msg_max_possible_size && i < message_text.size(); i++) {
-		packet.push_back(message_text.at(i));
-	}
-#endif
-
-	auto ret = _t.toxGroupSendCustomPrivatePacket(group_number, peer_number, true, packet);
-	// TODO: log error
-
-	return ret == TOX_ERR_GROUP_SEND_CUSTOM_PRIVATE_PACKET_OK;
+	return sendPacket(group_number, peer_number, packet);
 }
 
-bool ZoxNGCHistorySync::onEvent(const Events::ZoxNGC_ngch_request& e) {
-	std::cout << "ZOX ngch_request"
-		<< " grp:" << e.group_number
-		<< " per:" << e.peer_number
-		<< " prv:" << e._private
-		<< " sdl:" << (int)e.sync_delta
-		<< "\n";
-
-	// if blacklisted / on cool down
+bool ZoxNGCHistorySync::sendCaps(uint32_t group_number, uint32_t peer_number) {
+	std::vector<uint8_t> packet;
 
-	const auto request_sender = _tcm.getContactGroupPeer(e.group_number, e.peer_number);
-	if (_sync_queue.count(request_sender)) {
-		std::cerr << "ZNGCHS waring: ngch_request but still in sync send queue\n";
-		return true;
+	{ // magic
+		//0x667788113435
+		packet.push_back(0x66);
+		packet.push_back(0x77);
+		packet.push_back(0x88);
+		packet.push_back(0x11);
+		packet.push_back(0x34);
+		packet.push_back(0x35);
 	}
 
-	// const -> dont create (this is a request for existing messages)
-	auto* reg_ptr = static_cast<const RegistryMessageModelI&>(_rmm).get(request_sender);
-	if (reg_ptr == nullptr) {
-		std::cerr << "ZNGCHS error: group without reg\n";
-		return true;
-	}
+	packet.push_back(0x01); // version
+	packet.push_back(0x04); // pkt_id
 
-	const Message3Registry& reg = *reg_ptr;
+	packet.push_back(_caps);
+
+	return sendPacket(group_number, peer_number, packet);
+}
+
+bool ZoxNGCHistorySync::sendSyncMessage(
+	uint32_t group_number, uint32_t peer_number,
+	uint32_t message_id,
+	const std::array<uint8_t, 32>& sender_pub_key,
+	uint32_t timestamp,
+	std::string_view sender_name,
+	std::string_view message_text
+) {
+	const auto packet = ZoxNGCSyncMsgPacker::syncmsgPacket(
+		{message_id, sender_pub_key, timestamp, sender_name, message_text},
+		TOX_GROUP_MAX_CUSTOM_LOSSLESS_PACKET_LENGTH
+	);
 
-	std::queue<Message3> msg_send_queue;
+	return sendPacket(group_number, peer_number, packet);
+}
 
+uint64_t ZoxNGCHistorySync::syncWindowStart(ContactHandle4 request_sender, uint8_t sync_delta) const {
 	// convert sync delta to ms
-	const int64_t sync_delta_offset_ms = int64_t(e.sync_delta) * 1000 * 60;
-	uint64_t ts_start = getTimeMS() - sync_delta_offset_ms;
+	uint64_t ts_start = nowMS() - uint64_t(sync_delta) * 1000u * 60u;
 
 	// make sure we dont sync past the peers first appearance
 	if (const auto first_seen_ptr = request_sender.try_get<Contact::Components::FirstSeen>(); first_seen_ptr != nullptr) {
 		ts_start = std::max(ts_start, first_seen_ptr->ts);
 	}
 
+	return ts_start;
+}
+
+std::vector<Message3> ZoxNGCHistorySync::selectSyncMessages(const Message3Registry& reg, uint64_t ts_start) {
+	ZOX_TRACE_SCOPE("ZoxNGCHistorySync::selectSyncMessages");
+
+	std::vector<Message3> selected;
+
 	auto view = reg.view<Message::Components::Timestamp>();
 	for (auto it = view.rbegin(), it_end = view.rend(); it != it_end; it++) {
 		const Message3 e = *it;
@@ -326,77 +654,892 @@ bool ZoxNGCHistorySync::onEvent(const Events::ZoxNGC_ngch_request& e) {
 
 		//std::cout << "---- " << ts.ts << " >= " << ts_start << " -> selected\n";
 
-		msg_send_queue.push(e);
+		selected.push_back(e);
 	}
 
-	std::cout << "ZOX ngch_request selected " << msg_send_queue.size() << " messages\n";
+	return selected;
+}
 
-	if (!msg_send_queue.empty()) {
-		_sync_queue[request_sender] = SyncQueueInfo{
-			_delay_between_syncs_min + _rng_dist(_rng)*_delay_between_syncs_add,
-			0.f,
-			std::move(msg_send_queue)
-		};
-	}
+void ZoxNGCHistorySync::fillDigest(const Message3Registry& reg, uint8_t bucket_minutes, uint32_t first_bucket, std::vector<Events::ZoxNGC_ngch_request_digest::Bucket>& buckets) {
+	ZOX_TRACE_SCOPE("ZoxNGCHistorySync::fillDigest");
 
-	return true;
-}
+	const auto& cr = _cs.registry();
 
-bool ZoxNGCHistorySync::onEvent(const Events::ZoxNGC_ngch_syncmsg& e) {
-	std::cout << "ZOX ngch_syncmsg"
-		// who sent the syncmsg
-		<< " grp:" << e.group_number
-		<< " per:" << e.peer_number
-		<< " prv:" << e._private
+	auto view = reg.view<Message::Components::ToxGroupMessageID, Message::Components::ContactFrom, Message::Components::ContactTo, Message::Components::Timestamp>();
+	for (const auto e : view) {
+		const uint32_t bucket = zox_digest_bucket_index(view.get<Message::Components::Timestamp>(e).ts, bucket_minutes);
+		if (bucket < first_bucket || bucket - first_bucket >= buckets.size()) {
+			continue;
+		}
 
-		// its contents
-		<< " mid:" << e.message_id
-		<< " spk:" << std::hex << (uint16_t)e.sender_pub_key[0] << (uint16_t)e.sender_pub_key[1] << std::dec
-		<< " ts:" << e.timestamp
-		<< " snm:" << e.sender_name
-		<< " txt:" << e.message_text
-		<< "\n";
+		// private
+		if (!cr.all_of<Contact::Components::TagBig>(view.get<Message::Components::ContactTo>(e).c)) {
+			continue;
+		}
 
-	auto sync_by_c = _tcm.getContactGroupPeer(e.group_number, e.peer_number);
+		const auto& c_f = view.get<Message::Components::ContactFrom>(e).c;
+		if (!cr.all_of<Contact::Components::ToxGroupPeerPersistent>(c_f)) {
+			continue;
+		}
 
-	assert(static_cast<bool>(sync_by_c));
+		auto& b = buckets.at(bucket - first_bucket);
+		if (b.count != 0xffff) {
+			b.count++;
+		}
+		b.hash += zox_digest_msg_hash(
+			view.get<Message::Components::ToxGroupMessageID>(e).id,
+			cr.get<Contact::Components::ToxGroupPeerPersistent>(c_f).peer_key.data
+		);
+	}
+}
 
-	auto* reg_ptr = _rmm.get(sync_by_c);
-	if (reg_ptr == nullptr) {
-		std::cerr << "ZNGCHS error: group without msg reg\n";
-		return false;
+bool ZoxNGCHistorySync::syncOrderBefore(ZoxNGCSyncOrder order, uint64_t lhs_ts, Message3 lhs_e, uint64_t rhs_ts, Message3 rhs_e) {
+	if (order == ZoxNGCSyncOrder::oldest_first) {
+		std::swap(lhs_ts, rhs_ts);
+		std::swap(lhs_e, rhs_e);
 	}
 
-	Message3Registry& reg = *reg_ptr;
+	if (lhs_ts != rhs_ts) {
+		return lhs_ts > rhs_ts;
+	}
+	// same ms, any stable order will do
+	return entt::to_integral(lhs_e) > entt::to_integral(rhs_e);
+}
 
-	const auto sync_c = _tcm.getContactGroupPeer(e.group_number, ToxKey{e.sender_pub_key.data(), e.sender_pub_key.size()});
-	assert(static_cast<bool>(sync_c)); // TODO: make conditional
+void ZoxNGCHistorySync::activateSyncSessions(void) {
+	ZOX_TRACE_SCOPE("ZoxNGCHistorySync::activateSyncSessions");
 
-	// convert to ms
-	uint64_t sync_ts = std::chrono::milliseconds(std::chrono::seconds{e.timestamp}).count(); // o.o
-	uint64_t now_ts = getTimeMS();
+	auto& cr = _cs.registry();
+	const auto group_of = [&cr](Contact4 c) -> Contact4 {
+		if (const auto* parent = cr.try_get<Contact::Components::Parent>(c); parent != nullptr) {
+			return parent->parent;
+		}
+		return entt::null;
+	};
+
+	auto view = cr.view<SyncQueueInfo>();
+
+	// one pass over the sessions, then each promotion only looks at the groups
+	size_t active = 0;
+	std::map<Contact4, size_t> active_per_group;
+	std::map<Contact4, std::vector<std::pair<uint64_t, Contact4>>> waiting_per_group; // queued_at, session
+	for (const auto& [c, sqi] : view.each()) {
+		if (sqi.active) {
+			active++;
+			active_per_group[group_of(c)]++;
+		} else {
+			waiting_per_group[group_of(c)].push_back({sqi.queued_at, c});
+		}
+	}
 
-	const uint64_t max_future_ms = 1u*60u*1000u; // accept up to 1 minute into the future
-	if (sync_ts - max_future_ms > now_ts) {
-		// message is too far into the future
-		std::cerr << "ZNGCHS error: message ts was too far into the future\n";
-		return true; // false? keep handled?
+	if (active >= _max_active_sync_sessions || waiting_per_group.empty()) {
+		return;
 	}
 
-	// find matches
-	Message3 matching_e = entt::null;
-	{
-		// TODO: use Contact::Components::MessageIsSame instead
-		auto view = reg.view<Message::Components::ToxGroupMessageID, Message::Components::ContactFrom, Message::Components::Timestamp>();
-		view.use<Message::Components::Timestamp>();
-		for (const auto ent : view) {
-			if (view.get<Message::Components::ToxGroupMessageID>(ent).id != e.message_id) {
+	for (auto& [group, waiting] : waiting_per_group) {
+		// longest waiting at the back
+		std::sort(waiting.begin(), waiting.end(), std::greater<>{});
+	}
+
+	while (active < _max_active_sync_sessions) {
+		auto best_it = waiting_per_group.end();
+		for (auto it = waiting_per_group.begin(); it != waiting_per_group.end(); it++) {
+			if (it->second.empty()) {
 				continue;
 			}
 
-			// how far apart the 2 timestamps can be, before they are considered different messages
-			if (std::abs(int64_t(view.get<Message::Components::Timestamp>(ent).ts) - int64_t(sync_ts)) > _max_age_difference_ms) {
-				std::cout << "ZOX NGCHS info: same message id, but different timestamp\n";
+			if (best_it == waiting_per_group.end()) {
+				best_it = it;
+				continue;
+			}
+
+			const size_t group_active = active_per_group[it->first];
+			const size_t best_group_active = active_per_group[best_it->first];
+			if (
+				group_active < best_group_active ||
+				(group_active == best_group_active && it->second.back().first < best_it->second.back().first)
+			) {
+				best_it = it;
+			}
+		}
+
+		if (best_it == waiting_per_group.end()) {
+			break; // nothing waiting
+		}
+
+		const Contact4 best = best_it->second.back().second;
+		best_it->second.pop_back();
+
+		auto& sqi = view.get<SyncQueueInfo>(best);
+		sqi.active = true;
+		sqi.timer = 0.f;
+		_metrics.sync_queue_wait_ms.observe(nowMS() - sqi.queued_at);
+
+		active++;
+		active_per_group[best_it->first]++;
+	}
+}
+
+size_t ZoxNGCHistorySync::syncQueueMemory(void) const {
+	size_t bytes = 0;
+	for (const auto& [c, sqi] : _cs.registry().view<SyncQueueInfo>().each()) {
+		bytes += sizeof(SyncQueueInfo);
+		bytes += sqi.ents.size() * sizeof(Message3);
+		bytes += sqi.snapshot_bytes;
+		for (const auto& packet : sqi.encoded) {
+			bytes += packet.size();
+		}
+		for (const auto& range : sqi.source_ranges) {
+			bytes += sizeof(range) + range.buckets.size() * sizeof(range.buckets.front());
+		}
+	}
+	return bytes;
+}
+
+void ZoxNGCHistorySync::queueSyncSession(Contact4 c, const Message3Registry& reg, uint64_t window_start, std::vector<Message3>&& msgs) {
+	const auto ts_of = [&reg](Message3 e) { return reg.get<Message::Components::Timestamp>(e).ts; };
+
+	auto& cr = _cs.registry();
+
+	if (auto* sqi_ptr = cr.try_get<SyncQueueInfo>(c); sqi_ptr != nullptr) {
+		auto& sqi = *sqi_ptr;
+
+		if (window_start >= sqi.window_start) {
+			std::cout << "ZOX NGCHS request already covered by the running sync session\n";
+			_metrics.requests_ignored.add();
+			return;
+		}
+
+		const auto before = [&](const Message3 lhs, const Message3 rhs) { return syncOrderBefore(sqi.order, ts_of(lhs), lhs, ts_of(rhs), rhs); };
+
+		// only the older part of the window, the pending ones stay as they are
+		// they might have been filtered (eg. a rejoin push skips what the peer is known to have)
+		msgs.erase(
+			std::remove_if(
+				msgs.begin(), msgs.end(),
+				[&](const Message3 e) { return ts_of(e) >= sqi.window_start; }
+			),
+			msgs.end()
+		);
+		std::sort(msgs.begin(), msgs.end(), before);
+
+		if (!sqi.source_ranges.empty()) {
+			// paged, the older part is another range (without the selection, it is read again)
+			ZoxNGCSyncSnapshot range = sqi.source_ranges.back();
+			range.ts_start = window_start;
+			queueSyncSession(c, std::move(range), true);
+			return;
+		}
+
+		if (!sqi.encoded.empty() || !sqi.encoded_futures.empty()) {
+			// started in worker mode, the older part has to go through the same packet queue
+			ZoxNGCSyncSnapshot snapshot;
+			snapshot.ts_start = window_start;
+			snapshot.caps = peerCaps(c);
+			snapshot.max_packet_size = TOX_GROUP_MAX_CUSTOM_LOSSLESS_PACKET_LENGTH;
+			snapshot.compressed_body_budget = _compressed_body_budget;
+			for (const Message3 e : msgs) {
+				const auto data_opt = getSyncMsgData(reg, e);
+				if (!data_opt.has_value()) {
+					continue;
+				}
+
+				auto& entry = snapshot.entries.emplace_back();
+				entry.message_id = data_opt->message_id;
+				entry.sender_pub_key = data_opt->sender_pub_key;
+				entry.ts = ts_of(e);
+				entry.sender_name = data_opt->sender_name;
+				entry.message_text = data_opt->message_text;
+				entry.serve = true;
+			}
+			queueSyncSession(c, std::move(snapshot));
+			return;
+		}
+
+		if (syncQueueMemory() + msgs.size() * sizeof(Message3) > _max_sync_queue_bytes) {
+			std::cerr << "ZNGCHS waring: sync queue full, refusing request\n";
+			_metrics.requests_refused.add();
+			return;
+		}
+
+		std::cout << "ZOX NGCHS extended running sync session by " << msgs.size() << " older messages\n";
+		_metrics.requests_merged.add();
+
+		sqi.window_start = window_start;
+		if (sqi.order == ZoxNGCSyncOrder::oldest_first) {
+			// some of the window was sent already, send the older part next, it is older than all of them
+			sqi.ents.insert(sqi.ents.begin(), msgs.cbegin(), msgs.cend());
+		} else {
+			sqi.ents.insert(sqi.ents.end(), msgs.cbegin(), msgs.cend());
+		}
+		return;
+	}
+
+	if (msgs.empty()) {
+		return;
+	}
+
+	if (syncQueueMemory() + msgs.size() * sizeof(Message3) > _max_sync_queue_bytes) {
+		std::cerr << "ZNGCHS waring: sync queue full, refusing request\n";
+		_metrics.requests_refused.add();
+		return;
+	}
+
+	std::sort(msgs.begin(), msgs.end(), [&](const Message3 lhs, const Message3 rhs) { return syncOrderBefore(_sync_order, ts_of(lhs), lhs, ts_of(rhs), rhs); });
+
+	SyncQueueInfo sqi{
+		_delay_between_syncs_min + _rng_dist(_rng)*_delay_between_syncs_add,
+		0.f,
+		std::deque<Message3>{msgs.cbegin(), msgs.cend()},
+		ZoxNGCSyncEncoder{peerCaps(c), TOX_GROUP_MAX_CUSTOM_LOSSLESS_PACKET_LENGTH, _compressed_body_budget}
+	};
+	sqi.order = _sync_order;
+	sqi.window_start = window_start;
+	sqi.window_end = nowMS();
+	sqi.queued_at = sqi.window_end;
+
+	cr.emplace_or_replace<SyncQueueInfo>(c, std::move(sqi));
+}
+
+ZoxNGCSyncSnapshot ZoxNGCHistorySync::syncSnapshotTemplate(ContactHandle4 request_sender, uint8_t sync_delta) {
+	ZoxNGCSyncSnapshot snapshot;
+
+	snapshot.ts_start = syncWindowStart(request_sender, sync_delta);
+
+	snapshot.order = _sync_order;
+	snapshot.caps = peerCaps(request_sender);
+	snapshot.max_packet_size = TOX_GROUP_MAX_CUSTOM_LOSSLESS_PACKET_LENGTH;
+	snapshot.compressed_body_budget = _compressed_body_budget;
+
+	return snapshot;
+}
+
+ZoxNGCSyncSnapshot ZoxNGCHistorySync::buildSyncSnapshot(const Message3Registry* reg_ptr, ContactHandle4 request_sender, uint8_t sync_delta, uint64_t ts_from) {
+	ZOX_TRACE_SCOPE("ZoxNGCHistorySync::buildSyncSnapshot");
+
+	auto snapshot = syncSnapshotTemplate(request_sender, sync_delta);
+	fillSyncSnapshot(snapshot, reg_ptr, request_sender, std::min(ts_from, snapshot.ts_start), ~uint64_t(0));
+
+	return snapshot;
+}
+
+void ZoxNGCHistorySync::fillSyncSnapshot(ZoxNGCSyncSnapshot& snapshot, const Message3Registry* reg_ptr, ContactHandle4 request_sender, uint64_t ts_from, uint64_t ts_to) {
+	if (reg_ptr == nullptr) {
+		addSourceRecords(snapshot, request_sender, ts_from, ts_to);
+		return;
+	}
+	const Message3Registry& reg = *reg_ptr;
+
+	const auto& cr = _cs.registry();
+
+	// only copy, filtering by time and digest happens on the worker
+	auto view = reg.view<Message::Components::Timestamp, Message::Components::ToxGroupMessageID, Message::Components::ContactFrom, Message::Components::ContactTo>();
+	for (const auto e : view) {
+		const uint64_t ts = view.get<Message::Components::Timestamp>(e).ts;
+		if (ts < ts_from || ts >= ts_to) {
+			continue;
+		}
+
+		// private
+		if (!cr.all_of<Contact::Components::TagBig>(view.get<Message::Components::ContactTo>(e).c)) {
+			continue;
+		}
+
+		const auto& msg_sender = view.get<Message::Components::ContactFrom>(e).c;
+		if (!cr.all_of<Contact::Components::ToxGroupPeerPersistent>(msg_sender)) {
+			continue;
+		}
+
+		auto& entry = snapshot.entries.emplace_back();
+		entry.message_id = view.get<Message::Components::ToxGroupMessageID>(e).id;
+		entry.sender_pub_key = cr.get<Contact::Components::ToxGroupPeerPersistent>(msg_sender).peer_key.data;
+		entry.ts = ts;
+
+		if (ts < snapshot.ts_start || !reg.all_of<Message::Components::MessageText>(e)) {
+			continue; // digest only
+		}
+
+		if (reg.all_of<Message::Components::SyncedBy>(e)) {
+			const auto& list = reg.get<Message::Components::SyncedBy>(e).ts;
+			if (
+				std::find_if(
+					list.cbegin(), list.cend(),
+					[&cr](const auto&& it) {
+						// TODO: add weak self
+						return cr.all_of<Contact::Components::TagSelfStrong>(it.first);
+					}
+				) == list.cend()
+			) {
+				// self not found, digest only
+				continue;
+			}
+		}
+
+		entry.serve = true;
+		// TODO: make sure there is no alias leaked
+		if (cr.all_of<Contact::Components::Name>(msg_sender)) {
+			entry.sender_name = cr.get<Contact::Components::Name>(msg_sender).name;
+		}
+		entry.message_text = reg.get<Message::Components::MessageText>(e).text;
+	}
+
+	addSourceRecords(snapshot, request_sender, ts_from, ts_to);
+}
+
+void ZoxNGCHistorySync::addSourceRecords(ZoxNGCSyncSnapshot& snapshot, ContactHandle4 request_sender, uint64_t ts_from, uint64_t ts_to) {
+	if (_history_source == nullptr) {
+		return;
+	}
+
+	ZOX_TRACE_SCOPE("ZoxNGCHistorySync::addSourceRecords");
+
+	const auto& cr = _cs.registry();
+
+	if (!request_sender.all_of<Contact::Components::Parent>()) {
+		return;
+	}
+	const auto group_c = request_sender.get<Contact::Components::Parent>().parent;
+	if (!cr.all_of<Contact::Components::ToxGroupPersistent>(group_c)) {
+		return;
+	}
+	const auto& chat_id = cr.get<Contact::Components::ToxGroupPersistent>(group_c).chat_id.data;
+
+	// loaded messages are also in the storage, the registry copy wins
+	// same identity as the digest uses
+	std::unordered_set<uint64_t> known;
+	known.reserve(snapshot.entries.size());
+	for (const auto& entry : snapshot.entries) {
+		known.insert(zox_digest_msg_hash(entry.message_id, entry.sender_pub_key));
+	}
+
+	size_t added = 0;
+	// the same range as the registry, clamping to ts_end would split the last digest bucket of a page
+	// serving is limited to ts_start/ts_end when encoding
+	_history_source->forEachRecord(chat_id, ts_from, ts_to, [&](const ZoxNGCHistoryRecord& r) -> bool {
+		if (!known.insert(zox_digest_msg_hash(r.message_id, r.sender_pub_key)).second) {
+			return true;
+		}
+
+		auto& entry = snapshot.entries.emplace_back();
+		entry.message_id = r.message_id;
+		entry.sender_pub_key = r.sender_pub_key;
+		entry.ts = r.ts;
+
+		added++;
+
+		if (r.ts < snapshot.ts_start || !r.first_hand || r.message_text.empty()) {
+			return true; // digest only
+		}
+
+		entry.serve = true;
+		entry.sender_name = r.sender_name;
+		entry.message_text = r.message_text;
+
+		return true;
+	});
+
+	_metrics.source_records.add(added);
+}
+
+void ZoxNGCHistorySync::queueSyncSession(Contact4 c, ZoxNGCSyncSnapshot&& snapshot, bool paged) {
+	size_t snapshot_bytes = 0;
+	for (const auto& entry : snapshot.entries) {
+		snapshot_bytes += sizeof(entry) + entry.sender_name.size() + entry.message_text.size();
+	}
+	if (paged) {
+		// only the template is kept until the pages are read
+		snapshot_bytes += sizeof(snapshot) + snapshot.buckets.size() * sizeof(snapshot.buckets.front());
+	}
+
+	if (syncQueueMemory() + snapshot_bytes > _max_sync_queue_bytes) {
+		std::cerr << "ZNGCHS waring: sync queue full, refusing request\n";
+		_metrics.requests_refused.add();
+		return;
+	}
+
+	auto& cr = _cs.registry();
+
+	if (auto* sqi_ptr = cr.try_get<SyncQueueInfo>(c); sqi_ptr != nullptr) {
+		auto& sqi = *sqi_ptr;
+
+		if (snapshot.ts_start >= sqi.window_start) {
+			std::cout << "ZOX NGCHS request already covered by the running sync session\n";
+			_metrics.requests_ignored.add();
+			return;
+		}
+
+		// only the older part, everything newer is already queued or got to the peer live
+		// it is sent after what is already encoded, even for oldest_first, so the compressed stream stays intact
+		// if the session was started on the main thread (eg. a rejoin push), after its remaining messages for newest_first
+		// and before them for oldest_first, see tick()
+		snapshot.ts_end = sqi.window_start;
+		snapshot.order = sqi.order;
+		sqi.window_start = snapshot.ts_start;
+
+		_metrics.requests_merged.add();
+
+		if (paged) {
+			std::cout << "ZOX NGCHS extending running session, paging through the older part\n";
+			sqi.source_ranges.push_back(std::move(snapshot));
+			return;
+		}
+
+		std::cout << "ZOX NGCHS snapshot of " << snapshot.entries.size() << " messages, extending running session\n";
+
+		if (_worker_pool) {
+			sqi.snapshot_bytes += snapshot_bytes;
+		}
+		encodeSyncSnapshot(sqi, std::move(snapshot));
+		return;
+	}
+
+	SyncQueueInfo sqi{
+		_delay_between_syncs_min + _rng_dist(_rng)*_delay_between_syncs_add,
+		0.f,
+		{},
+		{}
+	};
+	sqi.order = snapshot.order;
+	sqi.window_start = snapshot.ts_start;
+	sqi.window_end = nowMS();
+	sqi.queued_at = sqi.window_end;
+
+	if (paged) {
+		// newer ones got to the peer live
+		snapshot.ts_end = std::min(snapshot.ts_end, sqi.window_end + 1);
+		if (snapshot.ts_start >= snapshot.ts_end) {
+			return; // nothing to send
+		}
+		std::cout << "ZOX NGCHS paging through the window\n";
+		sqi.source_ranges.push_back(std::move(snapshot));
+		// the first page now, the rest while sending, see tick()
+		fetchSourcePage(ContactHandle4{cr, c}, cr.emplace_or_replace<SyncQueueInfo>(c, std::move(sqi)));
+		return;
+	}
+
+	std::cout << "ZOX NGCHS snapshot of " << snapshot.entries.size() << " messages\n";
+
+	if (_worker_pool) {
+		sqi.snapshot_bytes = snapshot_bytes;
+	}
+	encodeSyncSnapshot(sqi, std::move(snapshot));
+
+	if (sqi.encoded.empty() && sqi.encoded_futures.empty()) {
+		return; // nothing to send
+	}
+
+	cr.emplace_or_replace<SyncQueueInfo>(c, std::move(sqi));
+}
+
+void ZoxNGCHistorySync::fetchSourcePage(ContactHandle4 c, SyncQueueInfo& sqi) {
+	ZOX_TRACE_SCOPE("ZoxNGCHistorySync::fetchSourcePage");
+
+	auto& range = sqi.source_ranges.front();
+
+	// whole buckets, so a page never splits one
+	const uint64_t bucket_ms = uint64_t(range.bucket_minutes) * 60u * 1000u;
+	const uint64_t page_ms = std::min((_source_page_ms + bucket_ms - 1) / bucket_ms * bucket_ms, range.ts_end - range.ts_start);
+
+	// everything but the entries
+	ZoxNGCSyncSnapshot page = range;
+	if (range.order == ZoxNGCSyncOrder::oldest_first) {
+		page.ts_end = range.ts_start + page_ms;
+		range.ts_start = page.ts_end;
+	} else {
+		page.ts_start = range.ts_end - page_ms;
+		range.ts_end = page.ts_start;
+	}
+	if (range.ts_start >= range.ts_end) {
+		sqi.source_ranges.pop_front();
+	}
+
+	// the digest needs the whole buckets the page touches, the rest is digest only
+	uint64_t ts_from = page.ts_start;
+	uint64_t ts_to = page.ts_end;
+	if (!page.buckets.empty()) {
+		ts_from = ts_from / bucket_ms * bucket_ms;
+		ts_to = (ts_to + bucket_ms - 1) / bucket_ms * bucket_ms;
+	}
+
+	// const -> dont create, might not be loaded at all
+	const auto* reg_ptr = static_cast<const RegistryMessageModelI&>(_rmm).get(c);
+	fillSyncSnapshot(page, reg_ptr, c, ts_from, ts_to);
+
+	_metrics.source_pages.add();
+
+	if (_worker_pool) {
+		for (const auto& entry : page.entries) {
+			sqi.snapshot_bytes += sizeof(entry) + entry.sender_name.size() + entry.message_text.size();
+		}
+	}
+	encodeSyncSnapshot(sqi, std::move(page));
+}
+
+void ZoxNGCHistorySync::encodeSyncSnapshot(SyncQueueInfo& sqi, ZoxNGCSyncSnapshot&& snapshot) {
+	if (_worker_pool) {
+		sqi.encoded_futures.push_back(_worker_pool->submit([snapshot = std::move(snapshot)]() {
+			return zox_encode_sync_snapshot(snapshot);
+		}));
+		return;
+	}
+
+	for (auto& packet : zox_encode_sync_snapshot(snapshot)) {
+		sqi.encoded.push_back(std::move(packet));
+	}
+}
+
+void ZoxNGCHistorySync::setSyncIngestReorder(float max_delay, size_t max_buffered) {
+	_ingest_reorder_delay_ms = max_delay > 0.f ? uint64_t(max_delay * 1000.f) : 0u;
+	_ingest_reorder_max = std::max<size_t>(1u, max_buffered);
+	if (_ingest_reorder_delay_ms == 0) {
+		flushIngestBuffer();
+	}
+}
+
+void ZoxNGCHistorySync::setRejoinPush(bool enabled) {
+	_rejoin_push = enabled;
+	if (!enabled) {
+		_cs.registry().clear<PeerOfflineInfo, PeerOnlineInfo>();
+	}
+}
+
+void ZoxNGCHistorySync::setSyncOrder(ZoxNGCSyncOrder order) {
+	_sync_order = order;
+}
+
+void ZoxNGCHistorySync::setSyncTrackingLimit(size_t max_map_entries) {
+	_sync_tracking_map_limit = max_map_entries;
+}
+
+void ZoxNGCHistorySync::setHistorySource(ZoxNGCHistorySourceI* source) {
+	_history_source = source;
+}
+
+void ZoxNGCHistorySync::setWorkerThreads(size_t count) {
+	// running sessions wait on the queued jobs, move them over
+	std::deque<std::function<void(void)>> jobs;
+	if (_worker_pool) {
+		jobs = _worker_pool->stop();
+	}
+	_worker_pool.reset();
+
+	if (count > 0) {
+		_worker_pool = std::make_unique<ZoxWorkerPool>(count);
+		_worker_pool->requeue(std::move(jobs));
+	} else {
+		for (auto& job : jobs) {
+			job();
+		}
+	}
+}
+
+const ZoxClockSkewEstimator* ZoxNGCHistorySync::peerClockSkew(Contact4 c) const {
+	return _cs.registry().try_get<ZoxClockSkewEstimator>(c);
+}
+
+uint8_t ZoxNGCHistorySync::peerCaps(Contact4 c) const {
+	if (const auto* ext = _cs.registry().try_get<PeerExtInfo>(c); ext != nullptr && ext->caps_known) {
+		// only what both sides understand
+		return ext->caps & _caps;
+	}
+	return 0u;
+}
+
+bool ZoxNGCHistorySync::onEvent(const Events::ZoxNGC_ngch_request& e) {
+	std::cout << "ZOX ngch_request"
+		<< " grp:" << e.group_number
+		<< " per:" << e.peer_number
+		<< " prv:" << e._private
+		<< " sdl:" << (int)e.sync_delta
+		<< "\n";
+
+	_metrics.requests_in.add();
+
+	// if blacklisted / on cool down
+
+	const auto request_sender = _tcm.getContactGroupPeer(e.group_number, e.peer_number);
+
+	// a running session gets extended, skip the selection if there is nothing to extend
+	const uint64_t window_start = syncWindowStart(request_sender, e.sync_delta);
+	if (const auto* sqi = request_sender.try_get<SyncQueueInfo>(); sqi != nullptr && window_start >= sqi->window_start) {
+		std::cout << "ZOX NGCHS ngch_request already covered by the running sync session\n";
+		_metrics.requests_ignored.add();
+		return true;
+	}
+
+	// const -> dont create (this is a request for existing messages)
+	auto* reg_ptr = static_cast<const RegistryMessageModelI&>(_rmm).get(request_sender);
+	if (reg_ptr == nullptr && _history_source == nullptr) {
+		std::cerr << "ZNGCHS error: group without reg\n";
+		return true;
+	}
+
+	const auto select_start = std::chrono::steady_clock::now();
+
+	// the history source can only be merged with the loaded messages in a snapshot
+	// it can be large, so its read one page at a time while sending
+	// the first page is read right away, encoded on the worker or the main thread like the other modes
+	if (_history_source != nullptr) {
+		queueSyncSession(request_sender, syncSnapshotTemplate(request_sender, e.sync_delta), true);
+		_metrics.request_select_us.observe(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - select_start).count());
+		return true;
+	}
+
+	if (_worker_pool) {
+		auto snapshot = buildSyncSnapshot(reg_ptr, request_sender, e.sync_delta);
+		_metrics.request_select_us.observe(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - select_start).count());
+		queueSyncSession(request_sender, std::move(snapshot));
+		return true;
+	}
+
+	auto selected = selectSyncMessages(*reg_ptr, window_start);
+
+	_metrics.request_select_us.observe(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - select_start).count());
+	_metrics.request_selected.observe(selected.size());
+
+	std::cout << "ZOX ngch_request selected " << selected.size() << " messages\n";
+
+	queueSyncSession(request_sender, *reg_ptr, window_start, std::move(selected));
+
+	return true;
+}
+
+bool ZoxNGCHistorySync::onEvent(const Events::ZoxNGC_ngch_caps& e) {
+	std::cout << "ZOX ngch_caps"
+		<< " grp:" << e.group_number
+		<< " per:" << e.peer_number
+		<< " prv:" << e._private
+		<< " cps:" << (int)e.caps
+		<< "\n";
+
+	const auto c = _tcm.getContactGroupPeer(e.group_number, e.peer_number);
+
+	auto& ext = _cs.registry().get_or_emplace<PeerExtInfo>(c);
+	ext.caps = e.caps;
+	ext.caps_known = true;
+
+	if (!ext.caps_sent) {
+		// they asked first, answer so they can use the extensions with us too
+		ext.caps_sent = true;
+		sendCaps(e.group_number, e.peer_number);
+	}
+
+	return true;
+}
+
+bool ZoxNGCHistorySync::onEvent(const Events::ZoxNGC_ngch_request_digest& e) {
+	std::cout << "ZOX ngch_request_digest"
+		<< " grp:" << e.group_number
+		<< " per:" << e.peer_number
+		<< " prv:" << e._private
+		<< " sdl:" << (int)e.sync_delta
+		<< " bkm:" << (int)e.bucket_minutes
+		<< " bkc:" << e.buckets.size()
+		<< "\n";
+
+	_metrics.requests_in.add();
+
+	const auto request_sender = _tcm.getContactGroupPeer(e.group_number, e.peer_number);
+
+	// a running session gets extended, skip the selection if there is nothing to extend
+	const uint64_t window_start = syncWindowStart(request_sender, e.sync_delta);
+	if (const auto* sqi = request_sender.try_get<SyncQueueInfo>(); sqi != nullptr && window_start >= sqi->window_start) {
+		std::cout << "ZOX NGCHS ngch_request_digest already covered by the running sync session\n";
+		_metrics.requests_ignored.add();
+		return true;
+	}
+
+	// const -> dont create (this is a request for existing messages)
+	auto* reg_ptr = static_cast<const RegistryMessageModelI&>(_rmm).get(request_sender);
+	if (reg_ptr == nullptr && _history_source == nullptr) {
+		std::cerr << "ZNGCHS error: group without reg\n";
+		return true;
+	}
+
+	const auto select_start = std::chrono::steady_clock::now();
+
+	// the history source can only be merged with the loaded messages in a snapshot
+	// it can be large, so its read one page at a time while sending
+	// the first page is read right away, encoded on the worker or the main thread like the other modes
+	if (_history_source != nullptr) {
+		auto snapshot = syncSnapshotTemplate(request_sender, e.sync_delta);
+		snapshot.bucket_minutes = e.bucket_minutes;
+		snapshot.first_bucket = e.first_bucket;
+		snapshot.buckets = e.buckets;
+		queueSyncSession(request_sender, std::move(snapshot), true);
+		_metrics.request_select_us.observe(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - select_start).count());
+		return true;
+	}
+
+	if (_worker_pool) {
+		auto snapshot = buildSyncSnapshot(reg_ptr, request_sender, e.sync_delta, uint64_t(e.first_bucket) * e.bucket_minutes * 60u * 1000u);
+		snapshot.bucket_minutes = e.bucket_minutes;
+		snapshot.first_bucket = e.first_bucket;
+		snapshot.buckets = e.buckets;
+		_metrics.request_select_us.observe(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - select_start).count());
+		queueSyncSession(request_sender, std::move(snapshot));
+		return true;
+	}
+
+	const Message3Registry& reg = *reg_ptr;
+
+	auto selected = selectSyncMessages(reg, window_start);
+	const size_t selected_count = selected.size();
+
+	// our view of the same buckets, including messages we would not serve
+	std::vector<Events::ZoxNGC_ngch_request_digest::Bucket> own_buckets(e.buckets.size());
+	fillDigest(reg, e.bucket_minutes, e.first_bucket, own_buckets);
+
+	// drop everything in buckets the requester already has in full
+	// messages outside of the digested range are always sent
+	selected.erase(
+		std::remove_if(
+			selected.begin(), selected.end(),
+			[&](const Message3 msg_e) {
+				const uint32_t bucket = zox_digest_bucket_index(reg.get<Message::Components::Timestamp>(msg_e).ts, e.bucket_minutes);
+				if (bucket < e.first_bucket || bucket - e.first_bucket >= e.buckets.size()) {
+					return false;
+				}
+
+				const auto& theirs = e.buckets.at(bucket - e.first_bucket);
+				const auto& ours = own_buckets.at(bucket - e.first_bucket);
+				return theirs.count == ours.count && theirs.hash == ours.hash;
+			}
+		),
+		selected.end()
+	);
+
+	_metrics.request_select_us.observe(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - select_start).count());
+	_metrics.request_selected.observe(selected.size());
+
+	std::cout << "ZOX ngch_request_digest selected " << selected.size() << " of " << selected_count << " messages\n";
+
+	queueSyncSession(request_sender, reg, window_start, std::move(selected));
+
+	return true;
+}
+
+bool ZoxNGCHistorySync::onEvent(const Events::ZoxNGC_ngch_syncmsg& e) {
+	ZOX_TRACE_SCOPE("ZoxNGCHistorySync::onEvent(ngch_syncmsg)");
+
+	std::cout << "ZOX ngch_syncmsg"
+		// who sent the syncmsg
+		<< " grp:" << e.group_number
+		<< " per:" << e.peer_number
+		<< " prv:" << e._private
+
+		// its contents
+		<< " mid:" << e.message_id
+		<< " spk:" << std::hex << (uint16_t)e.sender_pub_key[0] << (uint16_t)e.sender_pub_key[1] << std::dec
+		<< " ts:" << e.timestamp
+		<< " snm:" << e.sender_name
+		<< " txt:" << e.message_text
+		<< "\n";
+
+	_metrics.syncmsgs_in.add();
+	const auto ingest_start = std::chrono::steady_clock::now();
+
+	auto sync_by_c = _tcm.getContactGroupPeer(e.group_number, e.peer_number);
+
+	assert(static_cast<bool>(sync_by_c));
+
+	auto* reg_ptr = _rmm.get(sync_by_c);
+	if (reg_ptr == nullptr) {
+		std::cerr << "ZNGCHS error: group without msg reg\n";
+		_metrics.syncmsgs_rejected.add();
+		return false;
+	}
+
+	Message3Registry& reg = *reg_ptr;
+
+	const auto sync_c = _tcm.getContactGroupPeer(e.group_number, ToxKey{e.sender_pub_key.data(), e.sender_pub_key.size()});
+	assert(static_cast<bool>(sync_c)); // TODO: make conditional
+
+	// convert to ms
+	uint64_t sync_ts = std::chrono::milliseconds(std::chrono::seconds{e.timestamp}).count(); // o.o
+	uint64_t now_ts = nowMS();
+
+	const uint64_t max_future_ms = 1u*60u*1000u; // accept up to 1 minute into the future
+	if (sync_ts - max_future_ms > now_ts) {
+		// message is too far into the future
+		std::cerr << "ZNGCHS error: message ts was too far into the future\n";
+		_metrics.syncmsgs_rejected.add();
+		return true; // false? keep handled?
+	}
+
+	if (_ingest_reorder_delay_ms != 0) {
+		// ingest later, sorted by time, so most messages end up being appended
+		_ingest_buffer.push_back({
+			sync_by_c,
+			sync_c,
+			e.message_id,
+			sync_ts,
+			now_ts,
+			std::string{e.message_text},
+		});
+		if (_ingest_buffer.size() >= _ingest_reorder_max) {
+			flushIngestBuffer();
+		}
+		_metrics.ingest_reorder_buffered.set(_ingest_buffer.size());
+	} else {
+		ingestSyncMsg(reg, sync_by_c, sync_c, e.message_id, sync_ts, e.message_text, now_ts);
+	}
+
+	_metrics.syncmsg_ingest_us.observe(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - ingest_start).count());
+
+	return true;
+}
+
+void ZoxNGCHistorySync::ingestSyncMsg(Message3Registry& reg, ContactHandle4 sync_by_c, Contact4 sync_c, uint32_t message_id, uint64_t sync_ts, std::string_view message_text, uint64_t now_ts) {
+	ZOX_TRACE_SCOPE("ZoxNGCHistorySync::ingestSyncMsg");
+
+	// find matches
+	Message3 matching_e = entt::null;
+	{
+		ZOX_TRACE_SCOPE("ZoxNGCHistorySync::ingestSyncMsg match");
+
+		// how far the syncers clock is off, learned from messages we also received directly
+		// decided with the estimate from before this syncmsg, its own sample is added after
+		auto* skew = sync_by_c.try_get<ZoxClockSkewEstimator>();
+
+		// our receive time, if we got it directly
+		const auto direct_ts = [this, &reg](Message3 ent) -> const Message::Components::TimestampProcessed* {
+			const auto* ts_p = reg.try_get<Message::Components::TimestampProcessed>(ent);
+			if (
+				ts_p == nullptr ||
+				ts_p->ts < _session_start_ms ||
+				reg.all_of<Message::Components::ZoxSyncCreated>(ent)
+			) {
+				return nullptr;
+			}
+			return ts_p;
+		};
+
+		// the narrow window only picks between candidates, missing it is not enough to make a new message
+		// our receive time can be late (slow path, clock step), or the Timestamp lowered by another syncer
+		// without a valid estimate there is nothing to pick by, the first wide match wins
+		const bool narrowable = skew != nullptr && skew->valid();
+		Message3 narrow_e = entt::null;
+		Message3 wide_e = entt::null;
+		Message3 first_direct_e = entt::null;
+		bool candidate_seen = false;
+		bool narrow_missed = false;
+
+		// TODO: use Contact::Components::MessageIsSame instead
+		auto view = reg.view<Message::Components::ToxGroupMessageID, Message::Components::ContactFrom, Message::Components::Timestamp>();
+		view.use<Message::Components::Timestamp>();
+		for (const auto ent : view) {
+			if (wide_e != entt::null) {
+				// only looking for a narrow hit among the other candidates, they are close in time
+				// the storage is usually sorted by Timestamp, so once past the wide window there are no more
+				// if it is not, this just ends the search early with the wide match
+				const uint64_t ts = view.get<Message::Components::Timestamp>(ent).ts;
+				if (std::abs(int64_t(ts) - int64_t(sync_ts)) > _max_age_difference_ms) {
+					break;
+				}
+			}
+
+			if (view.get<Message::Components::ToxGroupMessageID>(ent).id != message_id) {
 				continue;
 			}
 
@@ -405,13 +1548,76 @@ bool ZoxNGCHistorySync::onEvent(const Events::ZoxNGC_ngch_syncmsg& e) {
 				std::cout << "ZOX NGCHS info: same message id, but different sender\n";
 				continue;
 			}
+			candidate_seen = true;
 
-			matching_e = ent;
-			break; // TODO: matching list
+			const auto* ts_p = direct_ts(ent);
+			if (ts_p != nullptr && first_direct_e == entt::null) {
+				first_direct_e = ent;
+			}
+
+			if (ts_p != nullptr && narrowable) {
+				// narrow, around our receive time shifted by the syncers offset
+				if (std::abs(int64_t(ts_p->ts) + skew->offset() - int64_t(sync_ts)) <= std::min(skew->window(), _max_age_difference_ms)) {
+					narrow_e = ent;
+					break;
+				}
+				narrow_missed = true;
+			}
+
+			// how far apart the 2 timestamps can be, before they are considered different messages
+			// our receive time too, the Timestamp might have been lowered by a syncer with a wrong clock
+			if (wide_e == entt::null && (
+				std::abs(int64_t(view.get<Message::Components::Timestamp>(ent).ts) - int64_t(sync_ts)) <= _max_age_difference_ms ||
+				(ts_p != nullptr && std::abs(int64_t(ts_p->ts) - int64_t(sync_ts)) <= _max_age_difference_ms)
+			)) {
+				wide_e = ent;
+
+				if (!narrowable || ts_p == nullptr) {
+					break; // nothing better to find
+				}
+			}
+		}
+
+		if (narrow_e != entt::null) {
+			matching_e = narrow_e;
+		} else if (wide_e != entt::null) {
+			if (narrow_missed) {
+				std::cout << "ZOX NGCHS info: same message id, outside the syncers corrected window, matched by the wide window\n";
+				_metrics.syncmsgs_skew_mismatch.add();
+			}
+			matching_e = wide_e;
+		} else if (candidate_seen) {
+			std::cout << "ZOX NGCHS info: same message id, but different timestamp\n";
+		}
+
+		// id and sender match, so this is most likely the same message, even if the clocks disagree
+		// only a matched message gives a sample, or if none matched the direct candidate, so offsets past the window can be learned
+		// once per syncer and message
+		const Message3 sample_e = matching_e != entt::null ? matching_e : first_direct_e;
+		if (const auto* ts_p = sample_e != entt::null ? direct_ts(sample_e) : nullptr; ts_p != nullptr) {
+			const int64_t offset_sample = int64_t(sync_ts) - int64_t(ts_p->ts);
+			const auto* synced_by = reg.try_get<Message::Components::SyncedBy>(sample_e);
+			const auto* zox_synced_by = reg.try_get<Message::Components::ZoxSyncedBy>(sample_e);
+			if (
+				std::abs(offset_sample) <= _max_clock_offset_ms &&
+				(synced_by == nullptr || synced_by->ts.count(sync_by_c) == 0) &&
+				(zox_synced_by == nullptr || !zox_synced_by->contains(sync_by_c))
+			) {
+				if (skew == nullptr) {
+					skew = &sync_by_c.emplace<ZoxClockSkewEstimator>();
+				}
+				if (skew->addSample(offset_sample)) {
+					std::cout << "ZOX NGCHS info: syncers clock changed, relearning its offset\n";
+					_metrics.clock_skew_restarts.add();
+				}
+				_metrics.clock_skew_samples.add();
+			}
 		}
 	}
 
 	if (reg.valid(matching_e)) {
+		_metrics.syncmsgs_known.add();
+
 		// TODO: do something else, like average?, trust mods more?
 
 		const bool has_tw = reg.all_of<Message::Components::TimestampWritten>(matching_e);
@@ -428,56 +1634,243 @@ bool ZoxNGCHistorySync::onEvent(const Events::ZoxNGC_ngch_syncmsg& e) {
 			_rmm.throwEventUpdate(reg, matching_e);
 		}
 	} else {
+		_metrics.syncmsgs_new.add();
+
 		// tmp, assume message new
 		matching_e = reg.create();
 
 		reg.emplace<Message::Components::ContactFrom>(matching_e, sync_c);
 		reg.emplace<Message::Components::ContactTo>(matching_e, sync_by_c.get<Contact::Components::Parent>().parent);
 
-		reg.emplace<Message::Components::ToxGroupMessageID>(matching_e, e.message_id);
+		reg.emplace<Message::Components::ToxGroupMessageID>(matching_e, message_id);
 
-		reg.emplace<Message::Components::MessageText>(matching_e, e.message_text);
+		reg.emplace<Message::Components::MessageText>(matching_e, message_text);
 
 		reg.emplace<Message::Components::TimestampProcessed>(matching_e, now_ts);
 		reg.emplace<Message::Components::TimestampWritten>(matching_e, sync_ts);
 		reg.emplace<Message::Components::Timestamp>(matching_e, sync_ts); // reactive?
 
 		reg.emplace<Message::Components::TagUnread>(matching_e);
+		reg.emplace<Message::Components::ZoxSyncCreated>(matching_e);
 
 		_rmm.throwEventConstruct(reg, matching_e);
 	}
 
-	{ // by whom
+	// by whom, and now we also know they got the message
+	// past the limit, syncers only go into the fixed size ZoxSyncedBy
+	bool tracked_in_map = false;
+	{
 		auto& synced_by = reg.get_or_emplace<Message::Components::SyncedBy>(matching_e).ts;
-		// dont overwrite
-		synced_by.try_emplace(sync_by_c, now_ts);
+		if (_sync_tracking_map_limit == 0 || synced_by.size() < _sync_tracking_map_limit || synced_by.count(sync_by_c)) {
+			// dont overwrite
+			synced_by.try_emplace(sync_by_c, now_ts);
+			tracked_in_map = true;
+		}
 		// TODO: throw update?
 	}
 
-	{ // now we also know they got the message
+	{
 		auto& list = reg.get_or_emplace<Message::Components::ReceivedBy>(matching_e).ts;
-		// dont overwrite
-		list.try_emplace(sync_by_c, now_ts);
+		if (_sync_tracking_map_limit == 0 || list.size() < _sync_tracking_map_limit || list.count(sync_by_c)) {
+			// dont overwrite
+			list.try_emplace(sync_by_c, now_ts);
+		} else {
+			tracked_in_map = false;
+		}
 		// TODO: throw update?
 	}
 
-	return true;
+	if (!tracked_in_map) {
+		auto& zox_synced_by = reg.get_or_emplace<Message::Components::ZoxSyncedBy>(matching_e);
+		const bool known = zox_synced_by.contains(sync_by_c);
+		if (!zox_synced_by.add(sync_by_c) && !known) {
+			// full, this syncer is lost
+			_metrics.syncers_untracked.add();
+		}
+	}
+}
+
+void ZoxNGCHistorySync::flushIngestBuffer(void) {
+	if (_ingest_buffer.empty()) {
+		return;
+	}
+
+	ZOX_TRACE_SCOPE("ZoxNGCHistorySync::flushIngestBuffer");
+
+	// oldest first, so the registries mostly get appended to
+	std::stable_sort(
+		_ingest_buffer.begin(), _ingest_buffer.end(),
+		[](const BufferedSyncMsg& lhs, const BufferedSyncMsg& rhs) {
+			if (lhs.sync_ts != rhs.sync_ts) {
+				return lhs.sync_ts < rhs.sync_ts;
+			}
+			return lhs.message_id < rhs.message_id;
+		}
+	);
+
+	auto& cr = _cs.registry();
+
+	// ingest can throw events, take the buffer first
+	auto buffer = std::move(_ingest_buffer);
+	_ingest_buffer.clear();
+
+	for (const auto& msg : buffer) {
+		if (!cr.valid(msg.sync_by_c) || !cr.valid(msg.sync_c)) {
+			continue; // contact went away in the mean time
+		}
+
+		auto* reg_ptr = _rmm.get(msg.sync_by_c);
+		if (reg_ptr == nullptr) {
+			continue;
+		}
+
+		ingestSyncMsg(*reg_ptr, ContactHandle4{cr, msg.sync_by_c}, msg.sync_c, msg.message_id, msg.sync_ts, msg.message_text, msg.received_ts);
+	}
+
+	_metrics.ingest_reorder_buffered.set(_ingest_buffer.size());
 }
 
 bool ZoxNGCHistorySync::onToxEvent(const Tox_Event_Group_Peer_Join* e) {
 	const auto group_number = tox_event_group_peer_join_get_group_number(e);
 	const auto peer_number = tox_event_group_peer_join_get_peer_id(e);
 
+	onPeerJoin(group_number, peer_number);
+
+	return false;
+}
+
+bool ZoxNGCHistorySync::onToxEvent(const Tox_Event_Group_Peer_Exit* e) {
+	const auto group_number = tox_event_group_peer_exit_get_group_number(e);
+	const auto peer_number = tox_event_group_peer_exit_get_peer_id(e);
+
+	auto& cr = _cs.registry();
+
+	// the contact model might have handled the exit already, so look for the one we saw join first
+	Contact4 c = entt::null;
+	std::vector<Contact4> online;
+	for (const auto& [online_c, poi] : cr.view<PeerOnlineInfo>().each()) {
+		if (poi.group_number == group_number && poi.peer_number == peer_number) {
+			online.push_back(online_c);
+		}
+	}
+	cr.remove<PeerOnlineInfo>(online.cbegin(), online.cend());
+	if (!online.empty()) {
+		c = online.front();
+	} else if (const auto peer_c = _tcm.getContactGroupPeer(group_number, peer_number); static_cast<bool>(peer_c)) {
+		c = peer_c;
+	}
+
+	if (c != entt::null && cr.valid(c)) {
+		clearPeerState(c);
+
+		if (_rejoin_push) {
+			cr.emplace_or_replace<PeerOfflineInfo>(c, nowMS());
+		}
+	}
+
+	return false;
+}
+
+void ZoxNGCHistorySync::onPeerJoin(uint32_t group_number, uint32_t peer_number) {
 	const auto c = _tcm.getContactGroupPeer(group_number, peer_number);
 
-	if (!_request_queue.count(c)) {
-		_request_queue[c] = {
+	// they might have restarted with a different client, renegotiate
+	c.remove<PeerExtInfo>();
+
+	if (_rejoin_push) {
+		// peer numbers get reused, in case we missed an exit
+		std::vector<Contact4> stale;
+		for (const auto& [online_c, poi] : _cs.registry().view<PeerOnlineInfo>().each()) {
+			if (online_c != c && poi.group_number == group_number && poi.peer_number == peer_number) {
+				stale.push_back(online_c);
+			}
+		}
+		_cs.registry().remove<PeerOnlineInfo>(stale.cbegin(), stale.cend());
+
+		c.emplace_or_replace<PeerOnlineInfo>(group_number, peer_number);
+	}
+
+	if (const auto* offline = c.try_get<PeerOfflineInfo>(); offline != nullptr) {
+		const uint64_t offline_since = offline->since;
+		c.remove<PeerOfflineInfo>();
+		if (_rejoin_push) {
+			pushMissed(c, offline_since);
+		}
+	}
+
+	if (!c.all_of<RequestQueueInfo>()) {
+		c.emplace<RequestQueueInfo>(
 			_delay_before_first_request_min + _rng_dist(_rng)*_delay_before_first_request_add,
 			0.f,
-			130u // TODO: magic number
-		};
+			_max_sync_delta
+		);
 	}
+}
 
-	return false;
+void ZoxNGCHistorySync::pushMissed(ContactHandle4 c, uint64_t offline_since) {
+	const uint64_t now_ts = nowMS();
+	if (now_ts - offline_since > _rejoin_push_max_offline_ms) {
+		return; // too long, leave it to their request
+	}
+
+	if (c.all_of<SyncQueueInfo>()) {
+		return; // already being served
+	}
+
+	// const -> dont create
+	const auto* reg_ptr = static_cast<const RegistryMessageModelI&>(_rmm).get(c);
+	if (reg_ptr == nullptr) {
+		return;
+	}
+	const Message3Registry& reg = *reg_ptr;
+
+	// sent while they were leaving might not have reached them either
+	// never more than they could request
+	const uint64_t window_start = std::max(
+		offline_since - std::min(offline_since, _rejoin_push_slack_ms),
+		syncWindowStart(c, _max_sync_delta)
+	);
+
+	auto selected = selectSyncMessages(reg, window_start);
+
+	// skip what we know they have
+	selected.erase(
+		std::remove_if(
+			selected.begin(), selected.end(),
+			[&reg, c](const Message3 e) {
+				if (reg.get<Message::Components::ContactFrom>(e).c == c) {
+					return true;
+				}
+				if (const auto* rb = reg.try_get<Message::Components::ReceivedBy>(e); rb != nullptr && rb->ts.count(c)) {
+					return true;
+				}
+				if (const auto* zsb = reg.try_get<Message::Components::ZoxSyncedBy>(e); zsb != nullptr && zsb->contains(c)) {
+					return true;
+				}
+				return false;
+			}
+		),
+		selected.end()
+	);
+
+	if (selected.empty()) {
+		return;
+	}
+
+	std::cout << "ZOX NGCHS pushing " << selected.size() << " missed messages to rejoined peer\n";
+	_metrics.rejoin_pushes.add();
+
+	queueSyncSession(c, reg, window_start, std::move(selected));
+}
+
+void ZoxNGCHistorySync::clearPeerState(Contact4 c) {
+	auto& cr = _cs.registry();
+	if (cr.valid(c)) {
+		cr.remove<RequestQueueInfo, SyncQueueInfo, PeerExtInfo>(c);
+	}
+}
+
+void ZoxNGCHistorySync::onPeerEphemeralDestroy(ContactRegistry4&, Contact4 c) {
+	clearPeerState(c);
 }
 
@@ -1,17 +1,31 @@
 #pragma once
 
 #include "./ngc.hpp"
+#include "./ngc_hs_packer.hpp"
+#include "./ngc_hs_snapshot.hpp"
+#include "./clock_skew.hpp"
+#include "./metrics.hpp"
 
 #include <solanaceae/contact/fwd.hpp>
 #include <solanaceae/message3/registry_message_model.hpp>
 
 #include <array>
-#include <queue>
+#include <deque>
 #include <map>
+#include <optional>
 #include <random>
+#include <memory>
+#include <future>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
 
 // fwd
 struct ToxI;
+class ZoxWorkerPool;
+struct ZoxNGCHistorySourceI;
 struct ContactModelI;
 class ToxContactModel2;
 
@@ -19,6 +33,50 @@ class ToxContactModel2;
 // https://github.com/zoff99/c-toxcore/blob/zoff99/zoxcore_local_fork/docs/ngc_group_history_sync.md
 // (old) https://gist.github.com/zoff99/81917ddb2e55b2ce602cac4772a7b68c
 
+// updated on the main thread, safe to read from anywhere
+struct ZoxNGCHistorySyncMetrics {
+	// requests we serve, including digest requests
+	ZoxMetricCounter requests_in;
+	ZoxMetricCounter requests_ignored; // already covered by the peers running session
+	ZoxMetricCounter requests_merged; // extended the peers running session
+	ZoxMetricHistogram request_selected; // messages queued per session, main thread mode only
+	ZoxMetricHistogram request_select_us; // selection, or building the snapshot in worker mode, or reading the first page with a history source
+	ZoxMetricCounter source_records; // read from the ZoxNGCHistorySourceI, not already loaded
+	ZoxMetricCounter source_pages; // snapshots of one page of a window, see ZoxNGCHistorySync::setHistorySource()
+	ZoxMetricCounter sync_jobs_lost; // worker encode jobs that never finished, their packets are not sent
+	ZoxMetricCounter rejoin_pushes; // sessions started without a request, see setRejoinPush()
+
+	// syncmsgs we receive
+	ZoxMetricCounter syncmsgs_in;
+	ZoxMetricCounter syncmsgs_known; // dedup hit
+	ZoxMetricCounter syncmsgs_new; // dedup miss
+	ZoxMetricCounter syncmsgs_rejected;
+	ZoxMetricHistogram syncmsg_ingest_us;
+	ZoxMetricCounter syncers_untracked; // past the limit and ZoxSyncedBy is full, repeats of known syncers dont count
+	ZoxMetricGauge ingest_reorder_buffered; // syncmsgs waiting in the reorder buffer
+	ZoxMetricCounter clock_skew_samples; // syncmsgs of messages we received directly
+	ZoxMetricCounter clock_skew_restarts; // a syncers clock changed, see ZoxClockSkewEstimator
+	ZoxMetricCounter syncmsgs_skew_mismatch; // same id and sender, outside the syncers narrow window, but matched by the wide one
+
+	ZoxMetricGauge request_queue_depth;
+	ZoxMetricCounter requests_refused; // over the queue memory cap
+	ZoxMetricGauge sync_queue_depth; // active sessions
+	ZoxMetricGauge sync_queue_waiting; // sessions waiting for a slot
+	ZoxMetricGauge sync_queue_pending; // messages and encoded packets not sent yet
+	ZoxMetricGauge sync_queue_bytes; // see syncQueueMemory()
+	ZoxMetricHistogram sync_queue_wait_ms; // from request to the session becoming active
+
+	ZoxMetricCounter packets_out;
+	ZoxMetricCounter bytes_out;
+	ZoxMetricCounter send_failures;
+	ZoxMetricCounter sync_sessions_dropped; // too many failed sends in a row
+
+	ZoxMetricHistogram tick_us;
+	ZoxMetricCounter ticks_over_budget; // left due work for the next tick
+
+	void writeText(std::ostream& out) const;
+};
+
 class ZoxNGCHistorySync : public ToxEventI, public ZoxNGCEventI {
 	ToxEventProviderI::SubscriptionReference _tep_sr;
 	ZoxNGCEventProviderI::SubscriptionReference _zngcepi_sr;
@@ -28,12 +86,18 @@ class ZoxNGCHistorySync : public ToxEventI, public ZoxNGCEventI {
 	RegistryMessageModelI& _rmm;
 
 	// how far apart the 2 timestamps can be, before they are considered different messages
-	const int64_t _max_age_difference_ms {130*60*1000}; // TODO: make this larger?
+	// used without a clock skew estimate for the syncer, and as the fallback if its narrow window misses, see ZoxClockSkewEstimator
+	const int64_t _max_age_difference_ms {130*60*1000};
+	// clock skew samples further off than this are ignored
+	const int64_t _max_clock_offset_ms {24*60*60*1000};
 
 	// 5s-11s
 	const float _delay_before_first_request_min {5.f};
 	const float _delay_before_first_request_add {6.f};
 
+	// minutes, the largest window a request can ask for, ZoxNGCEventProvider clamps incoming ones to it
+	const uint8_t _max_sync_delta {130u};
+
 	// 30m-64m
 	const float _delay_next_request_min {30.f*60.f};
 	const float _delay_next_request_add {34.f*60.f};
@@ -42,31 +106,205 @@ class ZoxNGCHistorySync : public ToxEventI, public ZoxNGCEventI {
 	const float _delay_between_syncs_min {0.3f};
 	const float _delay_between_syncs_add {0.3f};
 
+	// a failed send is retried after this times the number of consecutive failures
+	const float _delay_sync_retry {1.f};
+	// give up on a session after this many consecutive failed sends
+	const size_t _max_sync_send_failures {5u};
+
+	// serving limits over all groups and peers
+	// excess requests wait as inactive SyncQueueInfo until a session finishes
+	const size_t _max_active_sync_sessions {8u};
+	const size_t _max_sync_bytes_per_second {48u*1024u};
+	// approximation of queued entities, snapshots and encoded packets, requests over it are refused
+	const size_t _max_sync_queue_bytes {8u*1024u*1024u};
+
+	// rejoin push, only for peers that were gone for at most this long
+	const uint64_t _rejoin_push_max_offline_ms {30u*60u*1000u};
+	// also consider messages from shortly before they left
+	const uint64_t _rejoin_push_slack_ms {10u*1000u};
+
+	// 1s-2s, time the peer has to answer our ngch_caps before we fall back to a plain request
+	const float _delay_caps_reply_min {1.f};
+	const float _delay_caps_reply_add {1.f};
+
+	// how much uncompressed data we try to fit into one ngch_syncmsg_compressed packet
+	// halved until the compressed result fits
+	const size_t _compressed_body_budget {4*TOX_GROUP_MAX_CUSTOM_LOSSLESS_PACKET_LENGTH};
+
+	// extensions we announce to other peers
+	const uint8_t _caps {ZoxNGCCaps::request_digest | ZoxNGCCaps::syncmsg_packed | ZoxNGCCaps::syncmsg_compressed};
+
 	std::uniform_real_distribution<float> _rng_dist {0.0f, 1.0f};
 	std::minstd_rand _rng;
 
+	// unix time in ms, getTimeMS() if empty
+	std::function<uint64_t(void)> _time_source;
+
+	// work per tick(), 0 is unlimited (default), see setTickBudget()
+	float _tick_budget_ms {0.f};
+	size_t _tick_budget_ops {0u};
+	// tick time the sync sessions did not see yet, because the budget ran out before them
+	float _sync_delta_carry {0.f};
+
+	// all per peer state lives as components on the peers contact entity
+	// so it goes away with the contact, and is dropped on peer exit
+
+	// request queue
 	struct RequestQueueInfo {
 		float delay; // const
 		float timer;
 		uint8_t sync_delta;
 	};
-	// request queue
-	// c -> delay, timer
-	std::map<Contact4, RequestQueueInfo> _request_queue;
 
 	struct SyncQueueInfo {
 		float delay; // const
 		float timer;
-		std::queue<Message3> ents;
+		std::deque<Message3> ents; // in order, see syncOrderBefore()
 		//std::reference_wrapper<Message1Registry> reg;
+
+		ZoxNGCSyncEncoder encoder;
+
+		ZoxNGCSyncOrder order {ZoxNGCSyncOrder::newest_first};
+
+		// the requested window, ms
+		// later requests only extend window_start, newer messages reached the peer live
+		uint64_t window_start {0u};
+		uint64_t window_end {0u};
+
+		// consecutive failed sends, the session is kept and retried with backoff
+		size_t failures {0u};
+		float backoff {0.f};
+
+		// waiting sessions only hold their selection, see activateSyncSessions()
+		bool active {false};
+		uint64_t queued_at {0u}; // ms
+
+		// worker mode, approximate size of the snapshots not encoded yet
+		size_t snapshot_bytes {0u};
+
+		// worker mode, ents stays empty
+		// one job per request (or page), in order
+		std::deque<std::future<std::vector<std::vector<uint8_t>>>> encoded_futures;
+		std::deque<std::vector<uint8_t>> encoded;
+
+		// with a history source, the parts of the window not snapshotted yet, sent front to back
+		// no entries, ts_start/ts_end shrink as pages are taken, see fetchSourcePage()
+		std::deque<ZoxNGCSyncSnapshot> source_ranges;
+	};
+
+	// bytes we can still send, refilled every tick, can go negative by one packet
+	float _sync_budget {0.f};
+	// round robin position, sessions are served in entity order
+	Contact4 _sync_rr_last {entt::null};
+
+	// extension negotiation state, reset on rejoin
+	struct PeerExtInfo {
+		uint8_t caps {0u}; // only valid if caps_known
+		bool caps_known {false};
+		bool caps_sent {false};
 	};
-	std::map<Contact4, SyncQueueInfo> _sync_queue;
+
+	// kept while the peer is offline, only with rejoin push
+	struct PeerOfflineInfo {
+		uint64_t since {0u}; // ms
+	};
+	// kept while the peer is online, only with rejoin push
+	// on exit the peer number might not resolve to the contact anymore
+	struct PeerOnlineInfo {
+		uint32_t group_number {0u};
+		uint32_t peer_number {0u};
+	};
+	bool _rejoin_push {false};
+
+	// messages with a TimestampProcessed from before this are not known to be received directly
+	// (synced ones loaded from storage lose their Message::Components::ZoxSyncCreated)
+	// so they dont give clock skew samples
+	uint64_t _session_start_ms {0u};
+
+	// if set, sync sessions are selected and encoded on here from a snapshot
+	std::unique_ptr<ZoxWorkerPool> _worker_pool;
+
+	// for new sessions, see setSyncOrder()
+	ZoxNGCSyncOrder _sync_order {ZoxNGCSyncOrder::newest_first};
+
+	// receiver side reorder buffer, see setSyncIngestReorder()
+	// syncmsgs arrive newest first from most peers, ingesting them sorted turns most inserts into appends
+	struct BufferedSyncMsg {
+		Contact4 sync_by_c;
+		Contact4 sync_c;
+		uint32_t message_id;
+		uint64_t sync_ts; // ms
+		uint64_t received_ts; // ms
+		std::string message_text;
+	};
+	std::vector<BufferedSyncMsg> _ingest_buffer;
+	uint64_t _ingest_reorder_delay_ms {0u}; // 0 is off
+	size_t _ingest_reorder_max {256u};
+
+	// how many entries a syncmsg may add to SyncedBy and ReceivedBy of a message, 0 is unlimited
+	// see setSyncTrackingLimit()
+	size_t _sync_tracking_map_limit {0u};
+
+	// optional, if set requests are always served from snapshots, which include what is not loaded
+	ZoxNGCHistorySourceI* _history_source {nullptr};
+	// with a history source the window is snapshotted one page at a time, just before it is needed
+	// rounded up to whole digest buckets
+	const uint64_t _source_page_ms {10u*60u*1000u};
+
+	ZoxNGCHistorySyncMetrics _metrics;
 
 	public:
 		ZoxNGCHistorySync(ToxEventProviderI& tep, ZoxNGCEventProviderI& zngcepi, ToxI& t, ContactStore4I& cs, ToxContactModel2& tcm, RegistryMessageModelI& rmm);
 
+		~ZoxNGCHistorySync(void);
+
+		// returns 0 if work was left over because of the tick budget
 		float tick(float delta);
 
+		// bounds the work done by one tick(), due work that does not fit waits for the next call
+		// ops are sends (requests, caps, sync batches), 0 means unlimited, both are unlimited by default
+		// session activation and ordering also wait once it runs out
+		// only an ops budget keeps simulations deterministic
+		void setTickBudget(float max_ms, size_t max_ops);
+
+		// 0 (default) does everything on the main thread
+		void setWorkerThreads(size_t count);
+
+		// when a peer comes back after a short absence, start a session right away
+		// with the messages since they left that they are not known to have (ReceivedBy, ZoxSyncedBy)
+		// saves waiting for their request, off by default
+		void setRejoinPush(bool enabled);
+
+		// order of new sync sessions we serve, running sessions keep theirs
+		void setSyncOrder(ZoxNGCSyncOrder order);
+
+		// hold received syncmsgs for up to max_delay seconds (or max_buffered messages)
+		// and ingest them oldest first, 0 ingests right away (default)
+		void setSyncIngestReorder(float max_delay, size_t max_buffered = 256u);
+
+		// in large groups every message gets synced by many peers, with a limit only the first max_map_entries syncers
+		// go into the SyncedBy/ReceivedBy maps, further ones into the fixed size Message::Components::ZoxSyncedBy
+		// 0 tracks everyone in the maps (unbounded, default)
+		void setSyncTrackingLimit(size_t max_map_entries);
+
+		// serve history from persistent storage too, not only what is loaded, nullptr to unset
+		// the window is read and encoded in pages (on the worker pool if there is one), not all at once
+		// has to outlive us
+		void setHistorySource(ZoxNGCHistorySourceI* source);
+
+		// for deterministic simulations
+		void setRNGSeed(uint32_t seed);
+		void setTimeSource(std::function<uint64_t(void)>&& fn);
+
+		// same as a Tox_Event_Group_Peer_Join, queues a request to the peer (and the rejoin push)
+		void onPeerJoin(uint32_t group_number, uint32_t peer_number);
+
+		// how far the peers clock is off, from their syncmsgs, nullptr if there were no samples yet
+		// kept while they are offline
+		const ZoxClockSkewEstimator* peerClockSkew(Contact4 c) const;
+
+		ZoxNGCHistorySyncMetrics& metrics(void) { return _metrics; }
+
 	public:
 		// always private
 		bool sendRequest(
@@ -74,6 +312,17 @@ class ZoxNGCHistorySync : public ToxEventI, public ZoxNGCEventI {
 			uint8_t sync_delta = 130u
 		);
 
+		// always private
+		// extension, only send to peers that announced ZoxNGCCaps::request_digest
+		bool sendRequestDigest(
+			uint32_t group_number, uint32_t peer_number,
+			uint8_t sync_delta = 130u
+		);
+
+		// always private
+		// extension
+		bool sendCaps(uint32_t group_number, uint32_t peer_number);
+
 		// always private
 		bool sendSyncMessage(
 			uint32_t group_number, uint32_t peer_number,
@@ -84,13 +333,86 @@ class ZoxNGCHistorySync : public ToxEventI, public ZoxNGCEventI {
 			std::string_view message_text
 		);
 
+	protected:
+		uint64_t nowMS(void) const;
+
+		// every packet we send goes through here, for the metrics
+		bool sendPacket(uint32_t group_number, uint32_t peer_number, const std::vector<uint8_t>& packet);
+
+		// views are only valid until the registries change
+		std::optional<ZoxNGCSyncMsg> getSyncMsgData(const Message3Registry& reg, Message3 msg_e);
+
+		// oldest message we would serve to request_sender, ms
+		uint64_t syncWindowStart(ContactHandle4 request_sender, uint8_t sync_delta) const;
+
+		// messages we would serve from ts_start on (see syncWindowStart()), unordered
+		std::vector<Message3> selectSyncMessages(const Message3Registry& reg, uint64_t ts_start);
+
+		// fills buckets.size() digest buckets starting at first_bucket with all public messages in reg
+		void fillDigest(const Message3Registry& reg, uint8_t bucket_minutes, uint32_t first_bucket, std::vector<Events::ZoxNGC_ngch_request_digest::Bucket>& buckets);
+
+		// the order sessions send in
+		static bool syncOrderBefore(ZoxNGCSyncOrder order, uint64_t lhs_ts, Message3 lhs_e, uint64_t rhs_ts, Message3 rhs_e);
+
+		// starts a session, or merges into the running one without resending what was already delivered
+		void queueSyncSession(Contact4 c, const Message3Registry& reg, uint64_t window_start, std::vector<Message3>&& msgs);
+
+		// promotes waiting sessions while below _max_active_sync_sessions
+		// picks from the group with the fewest active sessions, then the longest waiting
+		void activateSyncSessions(void);
+
+		// rejoin push, queues what c missed since offline_since
+		void pushMissed(ContactHandle4 c, uint64_t offline_since);
+
+		// drops all state we keep for the peer
+		void clearPeerState(Contact4 c);
+
+		// registry signal, the peer went offline (or the contact is going away)
+		void onPeerEphemeralDestroy(ContactRegistry4& cr, Contact4 c);
+
+		// approximation, for _max_sync_queue_bytes
+		size_t syncQueueMemory(void) const;
+
+		// adds or updates the message, and who synced it
+		void ingestSyncMsg(Message3Registry& reg, ContactHandle4 sync_by_c, Contact4 sync_c, uint32_t message_id, uint64_t sync_ts, std::string_view message_text, uint64_t now_ts);
+		// ingests everything in the reorder buffer, sorted
+		void flushIngestBuffer(void);
+
+		// everything but the entries, the window and how to encode it
+		ZoxNGCSyncSnapshot syncSnapshotTemplate(ContactHandle4 request_sender, uint8_t sync_delta);
+		// worker mode, the whole window
+		// ts_from allows including older messages, for the digest
+		// reg can be null if nothing is loaded for the group
+		ZoxNGCSyncSnapshot buildSyncSnapshot(const Message3Registry* reg, ContactHandle4 request_sender, uint8_t sync_delta, uint64_t ts_from = ~uint64_t(0));
+		// adds the messages with ts_from <= ts < ts_to, loaded ones and from the history source
+		void fillSyncSnapshot(ZoxNGCSyncSnapshot& snapshot, const Message3Registry* reg, ContactHandle4 request_sender, uint64_t ts_from, uint64_t ts_to);
+		// adds the records of the history source not already in snapshot
+		void addSourceRecords(ZoxNGCSyncSnapshot& snapshot, ContactHandle4 request_sender, uint64_t ts_from, uint64_t ts_to);
+		// like above, a running session only gets the part of the window it does not cover yet
+		// paged takes a template (see syncSnapshotTemplate()), its entries are read page by page while sending
+		void queueSyncSession(Contact4 c, ZoxNGCSyncSnapshot&& snapshot, bool paged = false);
+		// snapshots and encodes the next page of the sessions first source range
+		void fetchSourcePage(ContactHandle4 c, SyncQueueInfo& sqi);
+		// encodes on the worker pool, or right away without one
+		void encodeSyncSnapshot(SyncQueueInfo& sqi, ZoxNGCSyncSnapshot&& snapshot);
+
+		// ZoxNGCCaps of the peer, 0 if unknown
+		uint8_t peerCaps(Contact4 c) const;
+
+		// sends the next packet of the session, using the best format the peer supports
+		// pops the sent (or unsendable) messages
+		// on failure the session is left as is, so it can be retried
+		bool sendSyncBatch(uint32_t group_number, uint32_t peer_number, const Message3Registry& reg, SyncQueueInfo& sqi);
+
 	protected:
 		bool onEvent(const Events::ZoxNGC_ngch_request& e) override;
 		bool onEvent(const Events::ZoxNGC_ngch_syncmsg& e) override;
+		bool onEvent(const Events::ZoxNGC_ngch_caps& e) override;
+		bool onEvent(const Events::ZoxNGC_ngch_request_digest& e) override;
 
 	protected:
 		bool onToxEvent(const Tox_Event_Group_Peer_Join* e) override;
-		//bool onToxEvent(const Tox_Event_Group_Peer_Exit* e) override;
+		bool onToxEvent(const Tox_Event_Group_Peer_Exit* e) override;
 		//bool onToxEvent(const Tox_Event_Group_Custom_Packet* e) override;
 		//bool onToxEvent(const Tox_Event_Group_Custom_Private_Packet* e) override;
 };
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <solanaceae/contact/fwd.hpp>
+
+#include <cstdint>
+#include <array>
+#include <algorithm>
+
+namespace Message::Components {
+
+	// peers that sent us the message through history sync, fixed size, no allocations
+	// with a tracking limit (see ZoxNGCHistorySync::setSyncTrackingLimit()) SyncedBy and ReceivedBy
+	// only get the first syncers, the rest is kept here, up to max_peers
+	struct ZoxSyncedBy {
+		static constexpr size_t max_peers = 6;
+		std::array<Contact4, max_peers> peers {}; // first count are valid
+		uint8_t count {0u};
+
+		// all syncmsgs for the message, saturating, including peers not tracked
+		uint16_t total {0u};
+
+		bool contains(Contact4 c) const {
+			return std::find(peers.cbegin(), peers.cbegin() + count, c) != peers.cbegin() + count;
+		}
+
+		// returns false if c was not tracked (known or full)
+		bool add(Contact4 c) {
+			if (total != 0xffff) {
+				total++;
+			}
+			if (count >= max_peers || contains(c)) {
+				return false;
+			}
+			peers[count++] = c;
+			return true;
+		}
+	};
+
+	// the message was created from a syncmsg, not received directly
+	// not persisted, see ZoxNGCHistorySync::_session_start_ms
+	struct ZoxSyncCreated {};
+
+} // Message::Components
+
@@ -0,0 +1,335 @@
+#include "./ngc_hs_packer.hpp"
+
+#include "./ngc.hpp"
+#include "./lz.hpp"
+#include "./utf8.hpp"
+
+#include <algorithm>
+
+// sender idx + msg id + timestamp + text length
+static constexpr size_t record_header_size = 1 + 4 + 4 + 2;
+
+ZoxNGCSyncMsgPacker::ZoxNGCSyncMsgPacker(size_t max_packet_size) : _max_packet_size(max_packet_size) {
+}
+
+bool ZoxNGCSyncMsgPacker::add(
+	uint32_t message_id,
+	const std::array<uint8_t, 32>& sender_pub_key,
+	uint32_t timestamp,
+	std::string_view sender_name,
+	std::string_view message_text
+) {
+	sender_name = zox_utf8_truncate(sender_name, max_name_size);
+	message_text = zox_utf8_truncate(message_text, 0xffff);
+
+	size_t sender_idx = _senders.size();
+	for (size_t i = 0; i < _senders.size(); i++) {
+		if (_senders[i].pub_key == sender_pub_key && _senders[i].name == sender_name) {
+			sender_idx = i;
+			break;
+		}
+	}
+
+	const bool new_sender = sender_idx == _senders.size();
+	if (new_sender && _senders.size() >= 0xff) {
+		return false;
+	}
+
+	const size_t sender_cost = new_sender ? 32 + 1 + sender_name.size() : 0;
+	const size_t current_size = size();
+
+	if (current_size + sender_cost + record_header_size + message_text.size() > _max_packet_size) {
+		if (!empty()) {
+			return false;
+		}
+
+		// first message, truncate instead
+		if (current_size + sender_cost + record_header_size >= _max_packet_size) {
+			return false; // should never happen
+		}
+		message_text = zox_utf8_truncate(message_text, _max_packet_size - (current_size + sender_cost + record_header_size));
+	}
+
+	if (new_sender) {
+		_senders.push_back({sender_pub_key, std::string{sender_name}});
+		_senders_size += sender_cost;
+	}
+
+	// 1 byte, sender idx
+	_records.push_back(sender_idx);
+
+	// 4 bytes, message id
+	_records.push_back(0xff & (message_id >> 8*3));
+	_records.push_back(0xff & (message_id >> 8*2));
+	_records.push_back(0xff & (message_id >> 8*1));
+	_records.push_back(0xff & (message_id >> 8*0));
+
+	// 4 bytes, timestamp
+	_records.push_back(0xff & (timestamp >> 8*3));
+	_records.push_back(0xff & (timestamp >> 8*2));
+	_records.push_back(0xff & (timestamp >> 8*1));
+	_records.push_back(0xff & (timestamp >> 8*0));
+
+	// 2 bytes, text length
+	_records.push_back(0xff & (message_text.size() >> 8*1));
+	_records.push_back(0xff & (message_text.size() >> 8*0));
+
+	_records.insert(_records.end(), message_text.cbegin(), message_text.cend());
+
+	_record_count++;
+
+	return true;
+}
+
+size_t ZoxNGCSyncMsgPacker::size(void) const {
+	return header_size + 1 + _senders_size + _records.size();
+}
+
+std::vector<uint8_t> ZoxNGCSyncMsgPacker::body(void) const {
+	std::vector<uint8_t> data;
+	data.reserve(size() - header_size);
+
+	data.push_back(_senders.size());
+	for (const auto& sender : _senders) {
+		data.insert(data.end(), sender.pub_key.cbegin(), sender.pub_key.cend());
+		data.push_back(sender.name.size());
+		data.insert(data.end(), sender.name.cbegin(), sender.name.cend());
+	}
+
+	data.insert(data.end(), _records.cbegin(), _records.cend());
+
+	return data;
+}
+
+std::vector<uint8_t> ZoxNGCSyncMsgPacker::packet(void) const {
+	std::vector<uint8_t> packet;
+	packet.reserve(size());
+
+	{ // magic
+		//0x667788113435
+		packet.push_back(0x66);
+		packet.push_back(0x77);
+		packet.push_back(0x88);
+		packet.push_back(0x11);
+		packet.push_back(0x34);
+		packet.push_back(0x35);
+	}
+
+	packet.push_back(0x01); // version
+	packet.push_back(0x06); // pkt_id
+
+	const auto data = body();
+	packet.insert(packet.end(), data.cbegin(), data.cend());
+
+	return packet;
+}
+
+void ZoxNGCSyncMsgPacker::clear(void) {
+	_senders.clear();
+	_senders_size = 0;
+	_records.clear();
+	_record_count = 0;
+}
+
+std::vector<uint8_t> ZoxNGCSyncMsgPacker::syncmsgPacket(const ZoxNGCSyncMsg& msg, size_t max_packet_size) {
+	std::vector<uint8_t> packet;
+
+	{ // magic
+		//0x667788113435
+		packet.push_back(0x66);
+		packet.push_back(0x77);
+		packet.push_back(0x88);
+		packet.push_back(0x11);
+		packet.push_back(0x34);
+		packet.push_back(0x35);
+	}
+
+	packet.push_back(0x01); // version
+	packet.push_back(0x02); // pkt_id
+
+	// 4 bytes, message id
+	packet.push_back(0xff & (msg.message_id >> 8*3));
+	packet.push_back(0xff & (msg.message_id >> 8*2));
+	packet.push_back(0xff & (msg.message_id >> 8*1));
+	packet.push_back(0xff & (msg.message_id >> 8*0));
+
+	// 32 bytes, sender pub key
+	packet.insert(packet.end(), msg.sender_pub_key.cbegin(), msg.sender_pub_key.cend());
+
+
+	// 4 bytes, timestamp
+	packet.push_back(0xff & (msg.timestamp >> 8*3));
+	packet.push_back(0xff & (msg.timestamp >> 8*2));
+	packet.push_back(0xff & (msg.timestamp >> 8*1));
+	packet.push_back(0xff & (msg.timestamp >> 8*0));
+
+
+	// 25 bytes, sender name, truncated/filled with 0
+	const auto sender_name = zox_utf8_truncate(msg.sender_name, 25);
+	packet.insert(packet.end(), sender_name.cbegin(), sender_name.cend());
+	packet.resize(packet.size() + (25 - sender_name.size()), '\0');
+
+	// up to 39927 bytes, message
+	//const int64_t msg_max_possible_size = _t.toxGroup
+	// TODO: make pr and add functions
+	const uint64_t msg_max_possible_size = std::clamp<int64_t>(
+		int64_t(max_packet_size) - int64_t(packet.size()),
+		0, // low
+		39927 // high
+	);
+
+	const auto message_text = zox_utf8_truncate(msg.message_text, msg_max_possible_size);
+	packet.insert(packet.end(), message_text.cbegin(), message_text.cend());
+
+	return packet;
+}
+
+// things that show up in most groups
+// NOTE: changing this breaks compatibility with other peers
+static constexpr std::string_view dictionary_primer {
+	"https://www.youtube.com/watch?v=https://youtu.be/https://github.com/"
+	"https://http://.com/.org/.net/.html.png.jpg.gif.mp4 "
+	"toxid tox group message history sync audio video file "
+	"what when where why how yes no thanks thank you please sorry "
+	"hello hi hey good morning evening night bye "
+	"I think that this is the and for with not you have but are was just like "
+	":) :D :( ;) xD lol ...\n"
+};
+
+void ZoxNGCSyncMsgPacker::buildDictionary(const std::vector<uint8_t>& prev_body, std::vector<uint8_t>& dict) {
+	dict.clear();
+	dict.reserve(dictionary_primer.size() + prev_body.size());
+	dict.insert(dict.end(), dictionary_primer.cbegin(), dictionary_primer.cend());
+	// last, so recent data has the shortest offsets
+	dict.insert(dict.end(), prev_body.cbegin(), prev_body.cend());
+}
+
+bool ZoxNGCSyncMsgPacker::compressedPacket(
+	const std::vector<uint8_t>& body,
+	const std::vector<uint8_t>& prev_body,
+	uint16_t seq,
+	size_t max_packet_size,
+	std::vector<uint8_t>& packet
+) {
+	if (body.size() > 0xffff || max_packet_size <= compressed_header_size) {
+		return false;
+	}
+
+	std::vector<uint8_t> dict;
+	buildDictionary(prev_body, dict);
+
+	std::vector<uint8_t> compressed;
+	if (!ZoxLZ::compress(dict.data(), dict.size(), body.data(), body.size(), compressed, max_packet_size - compressed_header_size)) {
+		return false;
+	}
+
+	packet.clear();
+	packet.reserve(compressed_header_size + compressed.size());
+
+	{ // magic
+		//0x667788113435
+		packet.push_back(0x66);
+		packet.push_back(0x77);
+		packet.push_back(0x88);
+		packet.push_back(0x11);
+		packet.push_back(0x34);
+		packet.push_back(0x35);
+	}
+
+	packet.push_back(0x01); // version
+	packet.push_back(0x07); // pkt_id
+
+	// 1 byte, flags
+	packet.push_back(prev_body.empty() ? 0x00 : 0x01);
+
+	// 2 bytes, seq
+	packet.push_back(0xff & (seq >> 8*1));
+	packet.push_back(0xff & (seq >> 8*0));
+
+	// 2 bytes, uncompressed size
+	packet.push_back(0xff & (body.size() >> 8*1));
+	packet.push_back(0xff & (body.size() >> 8*0));
+
+	packet.insert(packet.end(), compressed.cbegin(), compressed.cend());
+
+	return true;
+}
+
+ZoxNGCSyncEncoder::ZoxNGCSyncEncoder(uint8_t caps, size_t max_packet_size, size_t compressed_body_budget)
+	: _caps(caps), _max_packet_size(max_packet_size), _compressed_body_budget(compressed_body_budget)
+{
+}
+
+size_t ZoxNGCSyncEncoder::encode(size_t count, const GetFn& get, std::vector<uint8_t>& packet) {
+	packet.clear();
+	_compressed_pending_body.clear();
+
+	if ((_caps & ZoxNGCCaps::syncmsg_packed) == 0) {
+		// one per packet
+		for (size_t i = 0; i < count; i++) {
+			if (const auto msg_opt = get(i); msg_opt.has_value()) {
+				packet = ZoxNGCSyncMsgPacker::syncmsgPacket(*msg_opt, _max_packet_size);
+				return i + 1;
+			}
+		}
+		return count;
+	}
+
+	// fills the packer from the front, returns how many messages were used
+	const auto fill_packer = [count, &get](ZoxNGCSyncMsgPacker& packer) {
+		size_t used = 0;
+		for (; used < count; used++) {
+			const auto msg_opt = get(used);
+			if (msg_opt.has_value() && !packer.add(
+				msg_opt->message_id,
+				msg_opt->sender_pub_key,
+				msg_opt->timestamp,
+				msg_opt->sender_name,
+				msg_opt->message_text
+			)) {
+				break; // full
+			}
+		}
+		return used;
+	};
+
+	if ((_caps & ZoxNGCCaps::syncmsg_compressed) != 0) {
+		static const std::vector<uint8_t> no_body;
+		const bool chained = _compressed_chain < compressed_chain_max;
+
+		for (size_t budget = _compressed_body_budget; budget >= _max_packet_size; budget /= 2) {
+			ZoxNGCSyncMsgPacker packer{budget};
+			const size_t used = fill_packer(packer);
+			if (packer.empty()) {
+				return used;
+			}
+
+			auto body = packer.body();
+			if (!ZoxNGCSyncMsgPacker::compressedPacket(body, chained ? _compressed_prev_body : no_body, _compressed_seq + 1u, _max_packet_size, packet)) {
+				continue; // too big, try less
+			}
+
+			_compressed_pending_body = std::move(body);
+			_compressed_pending_chained = chained && !_compressed_prev_body.empty();
+			return used;
+		}
+		// did not compress well, fall back to plain packed
+	}
+
+	ZoxNGCSyncMsgPacker packer{_max_packet_size};
+	const size_t used = fill_packer(packer);
+	if (!packer.empty()) {
+		packet = packer.packet();
+	}
+	return used;
+}
+
+void ZoxNGCSyncEncoder::commit(void) {
+	if (!_compressed_pending_body.empty()) {
+		_compressed_seq++;
+		_compressed_chain = _compressed_pending_chained ? _compressed_chain + 1 : 0;
+		_compressed_prev_body = std::move(_compressed_pending_body);
+		_compressed_pending_body.clear();
+	}
+}
+
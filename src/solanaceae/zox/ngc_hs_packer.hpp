@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <optional>
+#include <functional>
+
+// the order a sync session sends its messages in
+// newest_first gets the recent history to the peer first,
+// oldest_first lets the receiver append instead of inserting in the middle
+enum class ZoxNGCSyncOrder : uint8_t {
+	newest_first,
+	oldest_first,
+};
+
+// the contents of a syncmsg
+// views need to outlive the packer/encoder call
+struct ZoxNGCSyncMsg {
+	uint32_t message_id {0u};
+	std::array<uint8_t, 32> sender_pub_key {};
+	uint32_t timestamp {0u};
+	std::string_view sender_name;
+	std::string_view message_text;
+};
+
+// builds ngch_syncmsg_packed packets (extension)
+// packs as many syncmsgs into one packet as fit, sender key and name are only included once per packet
+// see ZoxNGCEventProvider::parse_ngch_syncmsg_packed() for the format
+class ZoxNGCSyncMsgPacker {
+	const size_t _max_packet_size;
+
+	struct Sender {
+		std::array<uint8_t, 32> pub_key;
+		std::string name;
+	};
+	std::vector<Sender> _senders;
+	size_t _senders_size {0u}; // serialized
+
+	std::vector<uint8_t> _records;
+	size_t _record_count {0u};
+
+	public:
+		static constexpr size_t header_size = 6 + 1 + 1;
+		static constexpr size_t max_name_size = 128;
+
+		explicit ZoxNGCSyncMsgPacker(size_t max_packet_size);
+
+		// returns false if the message does not fit anymore
+		// the first message is always accepted, its text truncated to fit
+		// name and text are cut at the first invalid utf-8 sequence, truncation keeps characters whole
+		bool add(
+			uint32_t message_id,
+			const std::array<uint8_t, 32>& sender_pub_key,
+			uint32_t timestamp,
+			std::string_view sender_name,
+			std::string_view message_text
+		);
+
+		bool empty(void) const { return _record_count == 0; }
+		size_t count(void) const { return _record_count; }
+
+		// size of the finished packet, including magic and header
+		size_t size(void) const;
+
+		// everything after the header
+		std::vector<uint8_t> body(void) const;
+
+		// full packet, ready to send
+		std::vector<uint8_t> packet(void) const;
+
+		void clear(void);
+
+	public: // ngch_syncmsg
+		// a plain one message per packet ngch_syncmsg, name and text are cut to fit (as valid utf-8)
+		static std::vector<uint8_t> syncmsgPacket(const ZoxNGCSyncMsg& msg, size_t max_packet_size);
+
+	public: // ngch_syncmsg_compressed (extension)
+		static constexpr size_t compressed_header_size = header_size + 1 + 2 + 2;
+
+		// the dictionary for a compressed packet, a fixed primer followed by the body of the previous packet
+		// prev_body can be empty, for the first packet
+		static void buildDictionary(const std::vector<uint8_t>& prev_body, std::vector<uint8_t>& dict);
+
+		// compresses body() into a ngch_syncmsg_compressed packet
+		// returns false if the result does not fit into max_packet_size
+		static bool compressedPacket(
+			const std::vector<uint8_t>& body,
+			const std::vector<uint8_t>& prev_body, // empty if this is the first packet
+			uint16_t seq,
+			size_t max_packet_size,
+			std::vector<uint8_t>& packet
+		);
+};
+
+// encodes a sync session into packets, using the best format the peer supports (ZoxNGCCaps)
+// keeps the ngch_syncmsg_compressed stream state
+// does not touch any registry, so it can be used off the main thread
+class ZoxNGCSyncEncoder {
+	uint8_t _caps {0u};
+	size_t _max_packet_size {0u};
+	size_t _compressed_body_budget {0u};
+
+	uint16_t _compressed_seq {0u};
+	std::vector<uint8_t> _compressed_prev_body;
+	std::vector<uint8_t> _compressed_pending_body; // until commit()
+	size_t _compressed_chain {0u}; // packets in a row that used the previous body
+	bool _compressed_pending_chained {false};
+
+	public:
+		// at most this many packets in a row use the previous one as dictionary, then one does not,
+		// so a receiver that lost or could not decode one catches up again
+		static constexpr size_t compressed_chain_max = 8;
+
+		// get(i) returns nullopt for messages that can not be sent
+		using GetFn = std::function<std::optional<ZoxNGCSyncMsg>(size_t)>;
+
+		ZoxNGCSyncEncoder(void) = default;
+		ZoxNGCSyncEncoder(uint8_t caps, size_t max_packet_size, size_t compressed_body_budget);
+
+		// encodes the next packet from the first count messages
+		// returns how many messages were used up (including ones that can not be sent)
+		// packet is empty if there was nothing to send
+		size_t encode(size_t count, const GetFn& get, std::vector<uint8_t>& packet);
+
+		// call once the last encoded packet was sent
+		void commit(void);
+};
+
@@ -0,0 +1,119 @@
+#include "./ngc_hs_snapshot.hpp"
+
+#include "./ngc_hs_packer.hpp"
+#include "./trace.hpp"
+
+#include <algorithm>
+
+// fnv-1a over the bigendian message id and the sender key, with a final mix
+uint64_t zox_digest_msg_hash(uint32_t message_id, const std::array<uint8_t, 32>& sender_pub_key) {
+	uint64_t h = 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < 4; i++) {
+		h ^= 0xff & (message_id >> 8*(3-i));
+		h *= 0x100000001b3ull;
+	}
+	for (const uint8_t b : sender_pub_key) {
+		h ^= b;
+		h *= 0x100000001b3ull;
+	}
+
+	// splitmix64 finalizer, so the sum over a bucket is not dominated by the low bits
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ull;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebull;
+	h ^= h >> 31;
+
+	return h;
+}
+
+uint8_t zox_digest_bucket_minutes(uint8_t sync_delta) {
+	return std::max<uint8_t>(1u, (sync_delta + 119u) / 120u);
+}
+
+uint32_t zox_digest_bucket_index(uint64_t ts_ms, uint8_t bucket_minutes) {
+	return (ts_ms / 1000u) / (uint64_t(bucket_minutes) * 60u);
+}
+
+std::vector<std::vector<uint8_t>> zox_encode_sync_snapshot(const ZoxNGCSyncSnapshot& snapshot) {
+	ZOX_TRACE_SCOPE("zox_encode_sync_snapshot");
+
+	std::vector<Events::ZoxNGC_ngch_request_digest::Bucket> own_buckets(snapshot.buckets.size());
+	for (const auto& entry : snapshot.entries) {
+		const uint32_t bucket = zox_digest_bucket_index(entry.ts, snapshot.bucket_minutes);
+		if (bucket < snapshot.first_bucket || bucket - snapshot.first_bucket >= own_buckets.size()) {
+			continue;
+		}
+
+		auto& b = own_buckets.at(bucket - snapshot.first_bucket);
+		if (b.count != 0xffff) {
+			b.count++;
+		}
+		b.hash += zox_digest_msg_hash(entry.message_id, entry.sender_pub_key);
+	}
+
+	std::vector<const ZoxNGCSyncSnapshot::Entry*> selected;
+	for (const auto& entry : snapshot.entries) {
+		if (!entry.serve || entry.ts < snapshot.ts_start || entry.ts >= snapshot.ts_end) {
+			continue;
+		}
+
+		const uint32_t bucket = zox_digest_bucket_index(entry.ts, snapshot.bucket_minutes);
+		if (bucket >= snapshot.first_bucket && bucket - snapshot.first_bucket < own_buckets.size()) {
+			const auto& theirs = snapshot.buckets.at(bucket - snapshot.first_bucket);
+			const auto& ours = own_buckets.at(bucket - snapshot.first_bucket);
+			if (theirs.count == ours.count && theirs.hash == ours.hash) {
+				continue; // they have the whole bucket
+			}
+		}
+
+		selected.push_back(&entry);
+	}
+
+	// like the main thread selection
+	if (snapshot.order == ZoxNGCSyncOrder::oldest_first) {
+		std::stable_sort(
+			selected.begin(), selected.end(),
+			[](const auto* lhs, const auto* rhs) { return lhs->ts < rhs->ts; }
+		);
+	} else {
+		std::stable_sort(
+			selected.begin(), selected.end(),
+			[](const auto* lhs, const auto* rhs) { return lhs->ts > rhs->ts; }
+		);
+	}
+
+	std::vector<std::vector<uint8_t>> packets;
+
+	ZoxNGCSyncEncoder encoder{snapshot.caps, snapshot.max_packet_size, snapshot.compressed_body_budget};
+	for (size_t pos = 0; pos < selected.size();) {
+		std::vector<uint8_t> packet;
+		const size_t used = encoder.encode(
+			selected.size() - pos,
+			[&selected, pos](size_t i) -> std::optional<ZoxNGCSyncMsg> {
+				const auto& entry = *selected.at(pos + i);
+				return ZoxNGCSyncMsg{
+					entry.message_id,
+					entry.sender_pub_key,
+					uint32_t(entry.ts / 1000u),
+					entry.sender_name,
+					entry.message_text,
+				};
+			},
+			packet
+		);
+
+		if (used == 0) {
+			break; // should not happen
+		}
+		pos += used;
+
+		if (!packet.empty()) {
+			packets.push_back(std::move(packet));
+			encoder.commit();
+		}
+	}
+
+	return packets;
+}
+
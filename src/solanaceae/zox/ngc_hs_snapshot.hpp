@@ -0,0 +1,57 @@
+#pragma once
+
+#include "./ngc.hpp"
+#include "./ngc_hs_packer.hpp"
+
+#include <cstdint>
+#include <array>
+#include <vector>
+#include <string>
+
+// ngch_request_digest helpers, need to be the same on all peers
+
+// hash identifying a message
+uint64_t zox_digest_msg_hash(uint32_t message_id, const std::array<uint8_t, 32>& sender_pub_key);
+
+// bucket width, so the digest for the largest sync delta fits into one packet
+uint8_t zox_digest_bucket_minutes(uint8_t sync_delta);
+
+uint32_t zox_digest_bucket_index(uint64_t ts_ms, uint8_t bucket_minutes);
+
+// read-only copy of everything a sync session needs
+// made on the main thread, so selection and encoding can run on a worker without touching any registry
+struct ZoxNGCSyncSnapshot {
+	struct Entry {
+		uint32_t message_id {0u};
+		std::array<uint8_t, 32> sender_pub_key {};
+		uint64_t ts {0u}; // ms
+		std::string sender_name;
+		std::string message_text;
+
+		// false for messages we dont serve, only kept for the digest
+		bool serve {false};
+	};
+	std::vector<Entry> entries;
+
+	// messages to serve, ms, ts_end exclusive
+	// ts_end is set when extending a running session, which covers the rest
+	uint64_t ts_start {0u};
+	uint64_t ts_end {~uint64_t(0)};
+
+	// the requesters ngch_request_digest, no buckets for plain requests
+	uint8_t bucket_minutes {1u};
+	uint32_t first_bucket {0u};
+	std::vector<Events::ZoxNGC_ngch_request_digest::Bucket> buckets;
+
+	ZoxNGCSyncOrder order {ZoxNGCSyncOrder::newest_first};
+
+	// ZoxNGCCaps both sides support
+	uint8_t caps {0u};
+	size_t max_packet_size {0u};
+	size_t compressed_body_budget {0u};
+};
+
+// selects, orders (snapshot.order) and encodes all packets of a session
+// thread safe
+std::vector<std::vector<uint8_t>> zox_encode_sync_snapshot(const ZoxNGCSyncSnapshot& snapshot);
+
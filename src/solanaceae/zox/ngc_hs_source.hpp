@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <string_view>
+#include <functional>
+
+// one stored group message, only what a ngch_syncmsg needs
+struct ZoxNGCHistoryRecord {
+	uint32_t message_id {0u};
+	std::array<uint8_t, 32> sender_pub_key {};
+	uint64_t ts {0u}; // ms
+	std::string_view sender_name;
+	std::string_view message_text;
+
+	// false if we only got it through history sync ourselves, those are not served again
+	bool first_hand {true};
+};
+
+// persistent message storage (eg. an archive), queried on demand when serving history
+// lets ZoxNGCHistorySync serve windows that are not (or no longer) loaded into the RegistryMessageModelI
+struct ZoxNGCHistorySourceI {
+	virtual ~ZoxNGCHistorySourceI(void) {}
+
+	// calls fn for every public message in the group with ts_from <= ts < ts_to (ms), in any order
+	// views are only valid during the call, return false to stop early
+	// called on the main thread
+	virtual void forEachRecord(
+		const std::array<uint8_t, 32>& chat_id,
+		uint64_t ts_from, uint64_t ts_to,
+		const std::function<bool(const ZoxNGCHistoryRecord&)>& fn
+	) = 0;
+};
+
@@ -0,0 +1,288 @@
+#include "./ngca_recorder.hpp"
+
+#include "./ogg_opus.hpp"
+
+#include <solanaceae/util/time.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <vector>
+
+static uint64_t steady_ms(void) {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static size_t round_up_pow2(size_t v) {
+	size_t p = 1;
+	while (p < v) {
+		p <<= 1;
+	}
+	return p;
+}
+
+namespace {
+	// writer thread only
+	struct RecorderStream {
+		std::ofstream file;
+		ZoxOggOpusMuxer mux;
+		std::vector<uint8_t> out; // pages not written yet
+
+		uint8_t audio_channels {1u};
+		uint8_t last_toc {0u};
+
+		uint64_t first_ts {0u};
+		uint64_t last_ts {0u};
+		uint64_t last_write_ts {0u};
+
+		explicit RecorderStream(uint32_t serial) : mux(serial) {}
+	};
+} // namespace
+
+void ZoxNGCARecorderMetrics::writeText(std::ostream& out) const {
+	zox_metric_write(out, "zox_ngca_rec_frames_in_total", frames_in);
+	zox_metric_write(out, "zox_ngca_rec_bytes_in_total", bytes_in);
+	zox_metric_write(out, "zox_ngca_rec_frames_dropped_total", frames_dropped);
+	zox_metric_write(out, "zox_ngca_rec_bytes_dropped_total", bytes_dropped);
+	zox_metric_write(out, "zox_ngca_rec_frames_invalid_total", frames_invalid);
+	zox_metric_write(out, "zox_ngca_rec_queue_depth", queue_depth);
+
+	zox_metric_write(out, "zox_ngca_rec_frames_written_total", frames_written);
+	zox_metric_write(out, "zox_ngca_rec_gap_frames_total", gap_frames);
+	zox_metric_write(out, "zox_ngca_rec_bytes_written_total", bytes_written);
+	zox_metric_write(out, "zox_ngca_rec_write_errors_total", write_errors);
+	zox_metric_write(out, "zox_ngca_rec_write_us", write_us);
+
+	zox_metric_write(out, "zox_ngca_rec_streams_opened_total", streams_opened);
+	zox_metric_write(out, "zox_ngca_rec_streams_active", streams_active);
+}
+
+ZoxNGCARecorder::ZoxNGCARecorder(ZoxNGCEventProviderI& zngcepi, const std::string& dir, size_t ring_frames)
+	: _zngcepi_sr(zngcepi.newSubRef(this)), _dir(dir), _capacity(round_up_pow2(ring_frames))
+{
+	_frames = std::make_unique<Frame[]>(_capacity);
+
+	std::error_code ec;
+	std::filesystem::create_directories(_dir, ec);
+	if (ec) {
+		std::cerr << "ZOX ngca recorder error: failed to create '" << _dir << "': " << ec.message() << "\n";
+	}
+
+	_writer = std::thread([this]() { writerLoop(); });
+
+	_zngcepi_sr
+		.subscribe(ZoxNGC_Event::ngca)
+	;
+}
+
+ZoxNGCARecorder::~ZoxNGCARecorder(void) {
+	{
+		std::lock_guard lg{_mutex};
+		_quit = true;
+	}
+	_cv.notify_all();
+
+	// writes out whatever is still queued
+	_writer.join();
+}
+
+bool ZoxNGCARecorder::onEvent(const Events::ZoxNGC_ngca& e) {
+	if (
+		(e.audio_channels != 1 && e.audio_channels != 2) ||
+		e.sampling_freq == 0 ||
+		e.data.empty() || e.data.size() > max_frame_size ||
+		ZoxOggOpusMuxer::packetSamples(e.data.data(), e.data.size()) == 0
+	) {
+		_metrics.frames_invalid.add();
+		return false;
+	}
+
+	const size_t head = _head.load(std::memory_order_relaxed);
+	const size_t used = head - _tail.load(std::memory_order_acquire);
+	if (used >= _capacity) {
+		_metrics.frames_dropped.add();
+		_metrics.bytes_dropped.add(e.data.size());
+		return false;
+	}
+
+	Frame& frame = _frames[head & (_capacity - 1)];
+	frame.ts = steady_ms();
+	frame.group_number = e.group_number;
+	frame.peer_number = e.peer_number;
+	frame.audio_channels = e.audio_channels;
+	frame.sampling_freq = e.sampling_freq;
+	frame.size = e.data.size();
+	std::copy(e.data.cbegin(), e.data.cend(), frame.data.begin());
+
+	_head.store(head + 1, std::memory_order_release);
+
+	_metrics.frames_in.add();
+	_metrics.bytes_in.add(e.data.size());
+	_metrics.queue_depth.set(used + 1);
+
+	// dont wait for the drain interval
+	if (used + 1 == _capacity / 2) {
+		{
+			std::lock_guard lg{_mutex};
+			_wake = true;
+		}
+		_cv.notify_one();
+	}
+
+	return false; // not consumed, others might want the audio too
+}
+
+void ZoxNGCARecorder::writerLoop(void) {
+	std::map<std::pair<uint32_t, uint32_t>, std::unique_ptr<RecorderStream>> streams;
+	std::minstd_rand rng{std::random_device{}()};
+
+	const auto write_out = [this](RecorderStream& s) {
+		if (s.out.empty()) {
+			return;
+		}
+
+		if (s.file.is_open()) {
+			const auto start = std::chrono::steady_clock::now();
+
+			s.file.write(reinterpret_cast<const char*>(s.out.data()), s.out.size());
+			s.file.flush();
+			if (!s.file) {
+				std::cerr << "ZOX ngca recorder error: write failed, stopping the stream\n";
+				_metrics.write_errors.add();
+				s.file.close();
+			} else {
+				_metrics.bytes_written.add(s.out.size());
+			}
+
+			_metrics.write_us.observe(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+		}
+
+		s.out.clear();
+	};
+
+	const auto end_stream = [&write_out](RecorderStream& s) {
+		s.mux.end(s.out);
+		write_out(s);
+	};
+
+	const auto open_stream = [this, &rng](const Frame& frame) {
+		auto s = std::make_unique<RecorderStream>(uint32_t(rng()));
+		s->audio_channels = frame.audio_channels;
+		s->first_ts = frame.ts;
+		s->last_ts = frame.ts;
+		s->last_write_ts = frame.ts;
+
+		const uint64_t start_ms = getTimeMS();
+		const std::string path = _dir
+			+ "/ngca_" + std::to_string(frame.group_number)
+			+ "_" + std::to_string(frame.peer_number)
+			+ "_" + std::to_string(start_ms)
+			+ ".opus"
+		;
+		s->file.open(path, std::ios::binary | std::ios::out | std::ios::trunc);
+		if (!s->file.is_open()) {
+			std::cerr << "ZOX ngca recorder error: failed to open '" << path << "'\n";
+			_metrics.write_errors.add();
+		}
+
+		s->mux.begin(
+			frame.audio_channels,
+			uint32_t(frame.sampling_freq) * 1000u,
+			{
+				"ZOX_GROUP_NUMBER=" + std::to_string(frame.group_number),
+				"ZOX_PEER_NUMBER=" + std::to_string(frame.peer_number),
+				"ZOX_START_MS=" + std::to_string(start_ms),
+			},
+			s->out
+		);
+
+		_metrics.streams_opened.add();
+
+		return s;
+	};
+
+	bool quit = false;
+	while (!quit) {
+		{
+			std::unique_lock lk{_mutex};
+			_cv.wait_for(lk, std::chrono::milliseconds(_drain_interval_ms), [this]() { return _quit || _wake; });
+			_wake = false;
+			quit = _quit;
+		}
+
+		const size_t head = _head.load(std::memory_order_acquire);
+		for (size_t tail = _tail.load(std::memory_order_relaxed); tail != head; tail++) {
+			const Frame& frame = _frames[tail & (_capacity - 1)];
+			const auto key = std::make_pair(frame.group_number, frame.peer_number);
+
+			auto it = streams.find(key);
+			if (it != streams.end() && (
+				it->second->audio_channels != frame.audio_channels ||
+				frame.ts >= it->second->last_ts + _stream_idle_ms
+			)) {
+				end_stream(*it->second);
+				streams.erase(it);
+				it = streams.end();
+			}
+
+			if (it == streams.end()) {
+				it = streams.emplace(key, open_stream(frame)).first;
+			}
+			auto& s = *it->second;
+
+			// where the stream timeline ends, by the samples muxed so far
+			const uint64_t timeline_ts = s.first_ts + s.mux.granule() / 48;
+			if (frame.ts > timeline_ts + _gap_fill_threshold_ms) {
+				// same mode and frame size as the last frame, one frame (code 0), 0 bytes
+				const uint8_t gap_toc = s.last_toc & 0xfc;
+				const uint32_t gap_samples = ZoxOggOpusMuxer::packetSamples(&gap_toc, 1);
+				for (uint64_t i = (frame.ts - timeline_ts) * 48 / gap_samples; i > 0; i--) {
+					s.mux.addPacket(&gap_toc, 1, s.out);
+					_metrics.frames_written.add();
+					_metrics.gap_frames.add();
+				}
+			}
+
+			if (s.mux.addPacket(frame.data.data(), frame.size, s.out)) {
+				_metrics.frames_written.add();
+				s.last_toc = frame.data[0];
+			}
+			s.last_ts = std::max(s.last_ts, frame.ts);
+
+			// free the slot right away, the producer might be waiting for room
+			_tail.store(tail + 1, std::memory_order_release);
+		}
+		_metrics.queue_depth.set(_head.load(std::memory_order_relaxed) - head);
+
+		const uint64_t now = steady_ms();
+		for (auto it = streams.begin(); it != streams.end();) {
+			auto& s = *it->second;
+
+			if (now >= s.last_ts + _stream_idle_ms) {
+				end_stream(s);
+				it = streams.erase(it);
+				continue;
+			}
+
+			if (s.out.size() >= _write_batch_size || now >= s.last_write_ts + _write_interval_ms) {
+				s.mux.flush(s.out);
+				write_out(s);
+				s.last_write_ts = now;
+			}
+
+			it++;
+		}
+
+		_metrics.streams_active.set(streams.size());
+	}
+
+	for (auto& [key, s] : streams) {
+		end_stream(*s);
+	}
+	_metrics.streams_active.set(0);
+}
+
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "./ngc.hpp"
+#include "./metrics.hpp"
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <ostream>
+#include <string>
+
+// updated from the tox thread and the writer thread, safe to read from anywhere
+struct ZoxNGCARecorderMetrics {
+	ZoxMetricCounter frames_in; // queued for the writer
+	ZoxMetricCounter bytes_in;
+	ZoxMetricCounter frames_dropped; // queue full, the writer did not keep up
+	ZoxMetricCounter bytes_dropped;
+	ZoxMetricCounter frames_invalid; // bad channels, sampling freq or toc
+	ZoxMetricGauge queue_depth;
+
+	ZoxMetricCounter frames_written; // muxed, including gap_frames
+	ZoxMetricCounter gap_frames; // empty frames for silence, see ZoxNGCARecorder
+	ZoxMetricCounter bytes_written; // ogg, to disk
+	ZoxMetricCounter write_errors; // could not open or write a file
+	ZoxMetricHistogram write_us; // one batch
+
+	ZoxMetricCounter streams_opened;
+	ZoxMetricGauge streams_active;
+
+	void writeText(std::ostream& out) const;
+};
+
+// records incoming ngca audio, one ogg/opus file per (group, peer), without re-encoding
+// files are "<dir>/ngca_<group>_<peer>_<unix ms>.opus", a new file starts after the peer was silent for a while
+//
+// frames get copied into a fixed ring of preallocated slots on the tox thread
+// and muxed and written in batches by a background thread
+// if the ring is full the frame is dropped (and counted), the tox thread never waits on the disk
+//
+// silence the sender did not transmit is filled with empty (0 byte) frames,
+// which decoders turn into concealment/silence, so the file keeps the real timing
+//
+// NOTE: there is no per group file, mixing the peers needs decoding and encoding again
+class ZoxNGCARecorder : public ZoxNGCEventI {
+	ZoxNGCEventProviderI::SubscriptionReference _zngcepi_sr;
+
+	const std::string _dir;
+
+	public:
+		static constexpr size_t max_frame_size = 1362;
+
+	private:
+		struct Frame {
+			uint64_t ts {0u}; // ms, steady clock, on arrival
+			uint32_t group_number {0u};
+			uint32_t peer_number {0u};
+			uint8_t audio_channels {1u};
+			uint8_t sampling_freq {48u};
+			uint16_t size {0u};
+			std::array<uint8_t, max_frame_size> data;
+		};
+
+		// single producer (tox thread), single consumer (writer thread)
+		// indices only ever grow, slot is index & (capacity - 1)
+		const size_t _capacity;
+		std::unique_ptr<Frame[]> _frames;
+		std::atomic<size_t> _head {0u}; // next to write
+		std::atomic<size_t> _tail {0u}; // next to read
+
+		// how often the writer wakes up on its own, it is also woken once the ring is half full
+		const uint64_t _drain_interval_ms {50u};
+
+		// how long muxed pages may sit in memory before they are written out
+		const uint64_t _write_interval_ms {1000u};
+		// or written earlier once a stream has this much
+		const size_t _write_batch_size {64u*1024u};
+
+		// a stream ends (and the next frame starts a new file) after this much silence
+		const uint64_t _stream_idle_ms {60u*1000u};
+
+		// frames arriving later than this (ms) after the stream timeline are preceded by empty frames
+		const uint64_t _gap_fill_threshold_ms {250u};
+
+		std::thread _writer;
+		std::mutex _mutex;
+		std::condition_variable _cv;
+		bool _wake {false};
+		bool _quit {false};
+
+		ZoxNGCARecorderMetrics _metrics;
+
+		void writerLoop(void);
+
+	public:
+		// ring_frames is rounded up to a power of 2, all slots are allocated up front
+		ZoxNGCARecorder(ZoxNGCEventProviderI& zngcepi, const std::string& dir, size_t ring_frames = 1024u);
+		~ZoxNGCARecorder(void);
+
+		ZoxNGCARecorderMetrics& metrics(void) { return _metrics; }
+
+	protected:
+		bool onEvent(const Events::ZoxNGC_ngca& e) override;
+};
+
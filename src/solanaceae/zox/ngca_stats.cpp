@@ -0,0 +1,188 @@
+#include "./ngca_stats.hpp"
+
+#include "./ogg_opus.hpp"
+
+#include <string>
+#include <vector>
+
+void ZoxNGCAPeerStats::reset(void) {
+	last_us.store(0u, std::memory_order_relaxed);
+
+	frames.reset();
+	bytes.reset();
+	malformed.reset();
+	invalid_channels.reset();
+	invalid_freq.reset();
+
+	frame_size.reset();
+	arrival_deviation_us.reset();
+	jitter_us.reset();
+
+	gaps.reset();
+	lost_est.reset();
+	spurt_lost_est.reset();
+
+	prev_us = 0u;
+	prev_frame_us = 0u;
+	spurt_start_us = 0u;
+	spurt_samples = 0u;
+	jitter = 0.;
+}
+
+const ZoxNGCAPeerStats* ZoxNGCAStats::find(uint32_t group_number, uint32_t peer_number) const {
+	for (const auto& s : peers) {
+		if (
+			s.active.load(std::memory_order_acquire) &&
+			s.group_number.load(std::memory_order_relaxed) == group_number &&
+			s.peer_number.load(std::memory_order_relaxed) == peer_number
+		) {
+			return &s;
+		}
+	}
+	return nullptr;
+}
+
+void ZoxNGCAStats::forEach(const std::function<void(const ZoxNGCAPeerStats&)>& fn) const {
+	for (const auto& s : peers) {
+		if (s.active.load(std::memory_order_acquire)) {
+			fn(s);
+		}
+	}
+}
+
+void ZoxNGCAStats::writeText(std::ostream& out) const {
+	zox_metric_write(out, "zox_ngca_stats_evictions_total", evictions);
+
+	std::vector<std::pair<std::string, const ZoxNGCAPeerStats*>> active;
+	forEach([&active](const ZoxNGCAPeerStats& s) {
+		active.emplace_back(
+			"group=\"" + std::to_string(s.group_number.load(std::memory_order_relaxed))
+			+ "\",peer=\"" + std::to_string(s.peer_number.load(std::memory_order_relaxed)) + "\"",
+			&s
+		);
+	});
+
+	// all series of a metric together
+	const auto write_all = [&out, &active](std::string_view name, const auto member) {
+		for (const auto& [labels, s] : active) {
+			zox_metric_write(out, name, labels, s->*member);
+		}
+	};
+
+	write_all("zox_ngca_frames_total", &ZoxNGCAPeerStats::frames);
+	write_all("zox_ngca_bytes_total", &ZoxNGCAPeerStats::bytes);
+	write_all("zox_ngca_malformed_total", &ZoxNGCAPeerStats::malformed);
+	write_all("zox_ngca_invalid_channels_total", &ZoxNGCAPeerStats::invalid_channels);
+	write_all("zox_ngca_invalid_freq_total", &ZoxNGCAPeerStats::invalid_freq);
+	write_all("zox_ngca_frame_size_bytes", &ZoxNGCAPeerStats::frame_size);
+	write_all("zox_ngca_arrival_deviation_us", &ZoxNGCAPeerStats::arrival_deviation_us);
+	write_all("zox_ngca_jitter_us", &ZoxNGCAPeerStats::jitter_us);
+	write_all("zox_ngca_gaps_total", &ZoxNGCAPeerStats::gaps);
+	write_all("zox_ngca_lost_est_total", &ZoxNGCAPeerStats::lost_est);
+	write_all("zox_ngca_spurt_lost_est", &ZoxNGCAPeerStats::spurt_lost_est);
+}
+
+ZoxNGCAPeerStats& ZoxNGCAStats::slot(uint32_t group_number, uint32_t peer_number, uint64_t now_us) {
+	ZoxNGCAPeerStats* free_slot = nullptr;
+	ZoxNGCAPeerStats* oldest = nullptr;
+	for (auto& s : peers) {
+		if (!s.active.load(std::memory_order_relaxed)) {
+			if (free_slot == nullptr) {
+				free_slot = &s;
+			}
+			continue;
+		}
+
+		if (s.group_number.load(std::memory_order_relaxed) == group_number && s.peer_number.load(std::memory_order_relaxed) == peer_number) {
+			return s;
+		}
+
+		if (oldest == nullptr || s.last_us.load(std::memory_order_relaxed) < oldest->last_us.load(std::memory_order_relaxed)) {
+			oldest = &s;
+		}
+	}
+
+	ZoxNGCAPeerStats* s = free_slot;
+	if (s == nullptr) {
+		s = oldest;
+		evictions.add();
+	}
+
+	s->active.store(false, std::memory_order_release);
+	s->reset();
+	s->group_number.store(group_number, std::memory_order_relaxed);
+	s->peer_number.store(peer_number, std::memory_order_relaxed);
+	s->last_us.store(now_us, std::memory_order_relaxed);
+	s->active.store(true, std::memory_order_release);
+
+	return *s;
+}
+
+void ZoxNGCAStats::observe(
+	uint32_t group_number, uint32_t peer_number,
+	uint64_t now_us,
+	uint8_t audio_channels, uint8_t sampling_freq,
+	const uint8_t* data, size_t data_size
+) {
+	auto& s = slot(group_number, peer_number, now_us);
+	s.last_us.store(now_us, std::memory_order_relaxed);
+
+	s.frames.add();
+	s.bytes.add(data_size);
+	s.frame_size.observe(data_size);
+
+	if (audio_channels != 1 && audio_channels != 2) {
+		s.invalid_channels.add();
+	}
+
+	switch (sampling_freq) {
+		case 8: case 12: case 16: case 24: case 48: break;
+		default: s.invalid_freq.add();
+	}
+
+	const uint32_t samples = ZoxOggOpusMuxer::packetSamples(data, data_size);
+	if (samples == 0) {
+		s.malformed.add();
+		return;
+	}
+	const uint32_t frame_us = samples * 1000u / 48u;
+
+	if (s.prev_us == 0 || now_us - s.prev_us > gap_us) {
+		if (s.prev_us != 0) {
+			s.gaps.add();
+		}
+
+		// new spurt
+		s.lost_est.add(s.spurt_lost_est.get());
+		s.spurt_lost_est.set(0);
+		s.spurt_start_us = now_us;
+		s.spurt_samples = 0;
+	} else {
+		const uint64_t delta_us = now_us - s.prev_us;
+		const uint64_t deviation_us = delta_us > s.prev_frame_us ? delta_us - s.prev_frame_us : s.prev_frame_us - delta_us;
+		s.arrival_deviation_us.observe(deviation_us);
+
+		s.jitter += (double(deviation_us) - s.jitter) / 16.;
+		s.jitter_us.set(int64_t(s.jitter));
+
+		// frames that should have arrived by now, but did not, beyond what jitter explains
+		const uint64_t timeline_us = s.spurt_start_us + s.spurt_samples * 1000u / 48u;
+		const uint64_t tolerance_us = uint64_t(2. * s.jitter);
+		if (now_us > timeline_us + tolerance_us) {
+			s.spurt_lost_est.set((now_us - timeline_us - tolerance_us) / frame_us);
+		} else {
+			s.spurt_lost_est.set(0);
+		}
+	}
+
+	s.prev_us = now_us;
+	s.prev_frame_us = frame_us;
+	s.spurt_samples += samples;
+}
+
+void ZoxNGCAStats::observeMalformed(uint32_t group_number, uint32_t peer_number, uint64_t now_us) {
+	auto& s = slot(group_number, peer_number, now_us);
+	s.last_us.store(now_us, std::memory_order_relaxed);
+	s.malformed.add();
+}
+
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "./metrics.hpp"
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <ostream>
+
+// receive side quality of one peers ngca stream
+// the metrics can be read from any thread, the rest is tox thread only
+struct ZoxNGCAPeerStats {
+	std::atomic<bool> active {false};
+	std::atomic<uint32_t> group_number {0u};
+	std::atomic<uint32_t> peer_number {0u};
+	std::atomic<uint64_t> last_us {0u}; // steady clock, last frame (any)
+
+	ZoxMetricCounter frames; // valid size, includes invalid channels/freq/toc
+	ZoxMetricCounter bytes;
+	ZoxMetricCounter malformed; // size out of range (not in frames), or not an opus packet
+	ZoxMetricCounter invalid_channels; // not 1 or 2
+	ZoxMetricCounter invalid_freq; // not one of the opus rates
+
+	ZoxMetricHistogram frame_size; // bytes
+	// |inter-arrival - duration of the previous frame|, inside a talk spurt
+	ZoxMetricHistogram arrival_deviation_us;
+	ZoxMetricGauge jitter_us; // smoothed deviation, like RFC 3550
+
+	// there are no sequence numbers, so loss is estimated from timing
+	// a talk spurt ends with a gap longer than ZoxNGCAStats::gap_us
+	ZoxMetricCounter gaps;
+	ZoxMetricCounter lost_est; // frames, of finished spurts
+	ZoxMetricGauge spurt_lost_est; // frames, the running spurt so far
+
+	// tox thread only
+	uint64_t prev_us {0u};
+	uint32_t prev_frame_us {0u};
+	uint64_t spurt_start_us {0u};
+	uint64_t spurt_samples {0u}; // 48kHz
+	double jitter {0.};
+
+	void reset(void);
+};
+
+// per (group, peer) ngca stats, fixed size and lock free
+// updated by the tox thread, see ZoxNGCEventProvider::ngcaStats()
+// when all slots are used the least recently heard peer is replaced,
+// a reader looking at that slot right then can see it half reset
+struct ZoxNGCAStats {
+	static constexpr size_t max_peers = 64;
+
+	// longer than this between 2 frames is silence, not jitter or loss
+	static constexpr uint64_t gap_us = 400u*1000u;
+
+	std::array<ZoxNGCAPeerStats, max_peers> peers;
+	ZoxMetricCounter evictions;
+
+	// nullptr if not tracked (anymore)
+	const ZoxNGCAPeerStats* find(uint32_t group_number, uint32_t peer_number) const;
+
+	void forEach(const std::function<void(const ZoxNGCAPeerStats&)>& fn) const;
+
+	void writeText(std::ostream& out) const;
+
+	public: // tox thread
+		void observe(
+			uint32_t group_number, uint32_t peer_number,
+			uint64_t now_us,
+			uint8_t audio_channels, uint8_t sampling_freq,
+			const uint8_t* data, size_t data_size
+		);
+
+		void observeMalformed(uint32_t group_number, uint32_t peer_number, uint64_t now_us);
+
+	private:
+		ZoxNGCAPeerStats& slot(uint32_t group_number, uint32_t peer_number, uint64_t now_us);
+};
+
@@ -0,0 +1,238 @@
+#include "./ogg_opus.hpp"
+
+#include <array>
+#include <string_view>
+
+// header type flags
+static constexpr uint8_t ogg_flag_bos = 0x02;
+static constexpr uint8_t ogg_flag_eos = 0x04;
+
+static constexpr size_t ogg_max_segments = 255;
+
+// crc32, polynomial 0x04c11db7, not reflected, init 0, no final xor
+static constexpr std::array<uint32_t, 256> ogg_crc_table = []() {
+	std::array<uint32_t, 256> table {};
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t r = i << 24;
+		for (size_t j = 0; j < 8; j++) {
+			r = (r & 0x80000000u) ? (r << 1) ^ 0x04c11db7u : (r << 1);
+		}
+		table[i] = r;
+	}
+	return table;
+}();
+
+static uint32_t ogg_crc(const uint8_t* data, size_t size) {
+	uint32_t crc = 0;
+	for (size_t i = 0; i < size; i++) {
+		crc = (crc << 8) ^ ogg_crc_table[((crc >> 24) ^ data[i]) & 0xff];
+	}
+	return crc;
+}
+
+static void push_le(std::vector<uint8_t>& out, uint64_t v, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		out.push_back(0xff & (v >> 8*i));
+	}
+}
+
+// a packet of size n takes n/255 segments of 255, and one with the rest (can be 0)
+static size_t lacing_size(size_t packet_size) {
+	return packet_size / 255 + 1;
+}
+
+static void push_lacing(std::vector<uint8_t>& lacing, size_t packet_size) {
+	lacing.insert(lacing.end(), packet_size / 255, 255);
+	lacing.push_back(packet_size % 255);
+}
+
+static void append_page(
+	std::vector<uint8_t>& out,
+	uint8_t flags,
+	uint64_t granule,
+	uint32_t serial,
+	uint32_t seq,
+	const std::vector<uint8_t>& lacing,
+	const uint8_t* data, size_t data_size
+) {
+	const size_t page_start = out.size();
+
+	out.push_back('O');
+	out.push_back('g');
+	out.push_back('g');
+	out.push_back('S');
+	out.push_back(0x00); // version
+	out.push_back(flags);
+	push_le(out, granule, 8);
+	push_le(out, serial, 4);
+	push_le(out, seq, 4);
+	push_le(out, 0, 4); // crc, filled in below
+	out.push_back(lacing.size());
+	out.insert(out.end(), lacing.cbegin(), lacing.cend());
+	out.insert(out.end(), data, data + data_size);
+
+	const uint32_t crc = ogg_crc(out.data() + page_start, out.size() - page_start);
+	for (size_t i = 0; i < 4; i++) {
+		out[page_start + 22 + i] = 0xff & (crc >> 8*i);
+	}
+}
+
+ZoxOggOpusMuxer::ZoxOggOpusMuxer(uint32_t serial) : _serial(serial) {
+}
+
+void ZoxOggOpusMuxer::begin(
+	uint8_t channels,
+	uint32_t input_sample_rate,
+	const std::vector<std::string>& comments,
+	std::vector<uint8_t>& out
+) {
+	if (_header_written) {
+		return;
+	}
+
+	std::vector<uint8_t> lacing;
+
+	{ // OpusHead
+		std::vector<uint8_t> head;
+		for (const char c : std::string_view{"OpusHead"}) {
+			head.push_back(c);
+		}
+		head.push_back(0x01); // version
+		head.push_back(channels);
+		push_le(head, pre_skip, 2);
+		push_le(head, input_sample_rate, 4);
+		push_le(head, 0, 2); // output gain
+		head.push_back(0x00); // mapping family 0, mono or stereo
+
+		push_lacing(lacing, head.size());
+		append_page(out, ogg_flag_bos, 0, _serial, _page_seq++, lacing, head.data(), head.size());
+	}
+
+	{ // OpusTags
+		constexpr std::string_view vendor {"solanaceae_zox"};
+
+		std::vector<uint8_t> tags;
+		for (const char c : std::string_view{"OpusTags"}) {
+			tags.push_back(c);
+		}
+		push_le(tags, vendor.size(), 4);
+		tags.insert(tags.end(), vendor.cbegin(), vendor.cend());
+		push_le(tags, comments.size(), 4);
+		for (const auto& comment : comments) {
+			push_le(tags, comment.size(), 4);
+			tags.insert(tags.end(), comment.cbegin(), comment.cend());
+		}
+
+		// keep it on one page, the comments are short
+		lacing.clear();
+		push_lacing(lacing, tags.size());
+		append_page(out, 0x00, 0, _serial, _page_seq++, lacing, tags.data(), tags.size());
+	}
+
+	_header_written = true;
+}
+
+bool ZoxOggOpusMuxer::addPacket(const uint8_t* data, size_t size, std::vector<uint8_t>& out) {
+	const uint32_t samples = packetSamples(data, size);
+	if (samples == 0) {
+		return false;
+	}
+
+	if (
+		!_page_packets.empty() && (
+			_page_segments + lacing_size(size) > ogg_max_segments ||
+			_page_samples + samples > max_page_samples
+		)
+	) {
+		writePage(out, _page_packets.size(), 0x00);
+	}
+
+	_page_packets.push_back({size, samples});
+	_page_data.insert(_page_data.end(), data, data + size);
+	_page_segments += lacing_size(size);
+	_page_samples += samples;
+	_granule += samples;
+
+	return true;
+}
+
+void ZoxOggOpusMuxer::flush(std::vector<uint8_t>& out) {
+	if (_page_packets.size() > 1) {
+		writePage(out, _page_packets.size() - 1, 0x00);
+	}
+}
+
+void ZoxOggOpusMuxer::end(std::vector<uint8_t>& out) {
+	if (!_header_written) {
+		return;
+	}
+
+	// empty if nothing was ever added
+	writePage(out, _page_packets.size(), ogg_flag_eos);
+}
+
+void ZoxOggOpusMuxer::writePage(std::vector<uint8_t>& out, size_t packet_count, uint8_t flags) {
+	std::vector<uint8_t> lacing;
+	size_t data_size = 0;
+	uint64_t samples = 0;
+	for (size_t i = 0; i < packet_count; i++) {
+		push_lacing(lacing, _page_packets[i].size);
+		data_size += _page_packets[i].size;
+		samples += _page_packets[i].samples;
+	}
+
+	// granule position of the last packet finished on this page
+	const uint64_t page_granule = _granule - (_page_samples - samples);
+
+	append_page(out, flags, page_granule, _serial, _page_seq++, lacing, _page_data.data(), data_size);
+
+	_page_packets.erase(_page_packets.begin(), _page_packets.begin() + packet_count);
+	_page_data.erase(_page_data.begin(), _page_data.begin() + data_size);
+	_page_segments -= lacing.size();
+	_page_samples -= samples;
+}
+
+uint32_t ZoxOggOpusMuxer::packetSamples(const uint8_t* data, size_t size) {
+	if (size < 1) {
+		return 0;
+	}
+
+	// RFC 6716 3.1, frame size by the config in the upper 5 bits of the toc
+	const uint8_t config = data[0] >> 3;
+	uint32_t frame_samples = 0;
+	if (config < 12) { // silk: 10, 20, 40, 60ms
+		constexpr std::array<uint32_t, 4> silk {480, 960, 1920, 2880};
+		frame_samples = silk[config % 4];
+	} else if (config < 16) { // hybrid: 10, 20ms
+		frame_samples = (config % 2) ? 960 : 480;
+	} else { // celt: 2.5, 5, 10, 20ms
+		constexpr std::array<uint32_t, 4> celt {120, 240, 480, 960};
+		frame_samples = celt[config % 4];
+	}
+
+	uint32_t frame_count = 0;
+	switch (data[0] & 0x03) {
+		case 0: frame_count = 1; break;
+		case 1: // 2 frames, same size
+			if ((size - 1) % 2 != 0) {
+				return 0;
+			}
+			frame_count = 2;
+			break;
+		case 2: frame_count = 2; break;
+		case 3: // frame count byte
+			if (size < 2) {
+				return 0;
+			}
+			frame_count = data[1] & 0x3f;
+			break;
+	}
+
+	const uint32_t samples = frame_samples * frame_count;
+	if (samples > 5760) { // 120ms
+		return 0;
+	}
+
+	return samples;
+}
+
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// muxes already encoded opus packets into an ogg/opus stream (RFC 3533, RFC 7845), no re-encoding
+// pages are appended to an output buffer, writing it anywhere is up to the caller
+class ZoxOggOpusMuxer {
+	const uint32_t _serial;
+	uint32_t _page_seq {0u};
+
+	// samples (at 48kHz) of all packets, including ones still in the page
+	uint64_t _granule {0u};
+
+	// the current page, packets are kept whole
+	struct Packet {
+		size_t size {0u};
+		uint32_t samples {0u};
+	};
+	std::vector<Packet> _page_packets;
+	std::vector<uint8_t> _page_data;
+	size_t _page_segments {0u};
+	uint64_t _page_samples {0u};
+
+	bool _header_written {false};
+
+	void writePage(std::vector<uint8_t>& out, size_t packet_count, uint8_t flags);
+
+	public:
+		// the encoder is unknown, use the libopus default lookahead
+		static constexpr uint16_t pre_skip = 312;
+
+		// RFC 7845 recommends pages of at most 1 second, for seeking
+		static constexpr uint64_t max_page_samples = 48000;
+
+		explicit ZoxOggOpusMuxer(uint32_t serial);
+
+		// OpusHead and OpusTags, each on their own page
+		// channels 1 or 2 (mapping family 0), input_sample_rate is informational
+		// comments are "KEY=value"
+		void begin(
+			uint8_t channels,
+			uint32_t input_sample_rate,
+			const std::vector<std::string>& comments,
+			std::vector<uint8_t>& out
+		);
+
+		// returns false if this is not a valid opus packet (by its toc), nothing is added then
+		// can write a full page to out
+		bool addPacket(const uint8_t* data, size_t size, std::vector<uint8_t>& out);
+
+		// writes every packet in the page except the last one,
+		// so there is always something left for the end of stream page
+		void flush(std::vector<uint8_t>& out);
+
+		// writes the remaining packets, marked as end of stream
+		void end(std::vector<uint8_t>& out);
+
+		uint64_t granule(void) const { return _granule; }
+
+		// samples (at 48kHz) of a packet, from the toc byte and frame count
+		// 0 if the packet is invalid or longer than 120ms
+		static uint32_t packetSamples(const uint8_t* data, size_t size);
+};
+
@@ -0,0 +1,245 @@
+#include "./trace.hpp"
+
+#include <atomic>
+#include <fstream>
+
+#if SOLANACEAE_ZOX_TRACE
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+static constexpr size_t zox_trace_ring_size = 16*1024;
+
+namespace {
+
+// fields are atomic so a dump can read while the owning thread keeps writing
+struct Span {
+	std::atomic<const char*> name {nullptr};
+	std::atomic<uint64_t> start_ns {0u};
+	std::atomic<uint64_t> dur_ns {0u};
+};
+
+// one writer (the thread that leased it), no locks
+// like a seqlock, a reader drops the slots that began getting overwritten while it read them
+struct Ring {
+	uint32_t tid;
+
+	std::array<Span, zox_trace_ring_size> spans;
+	std::atomic<uint64_t> begun {0u}; // slot writes started
+	std::atomic<uint64_t> written {0u}; // slot writes done
+	std::atomic<uint64_t> cleared {0u}; // dumps start here, see ZoxTrace::clear()
+
+	bool leased {false}; // ZoxTrace::Impl::mutex
+};
+
+} // namespace
+
+// rings outlive their threads, so spans of finished workers still show up
+// a new thread reuses a ring of a finished one, so there are only as many as threads running at once
+struct ZoxTrace::Impl {
+	// times are relative to this, the same for all plugins sharing the instance
+	const std::chrono::steady_clock::time_point epoch {std::chrono::steady_clock::now()};
+
+	std::mutex mutex;
+	std::vector<std::unique_ptr<Ring>> rings;
+
+	Ring* lease(void) {
+		std::lock_guard lg{mutex};
+		Ring* ring = nullptr;
+		for (auto& free_ring : rings) {
+			if (!free_ring->leased) {
+				ring = free_ring.get();
+				break;
+			}
+		}
+		if (ring == nullptr) {
+			ring = rings.emplace_back(std::make_unique<Ring>()).get();
+			ring->tid = rings.size();
+		}
+		ring->leased = true;
+		return ring;
+	}
+
+	void release(Ring* ring) {
+		std::lock_guard lg{mutex};
+		ring->leased = false;
+	}
+};
+
+static uint64_t steady_ns(std::chrono::steady_clock::time_point tp) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(tp.time_since_epoch()).count();
+}
+
+ZoxTraceScope::ZoxTraceScope(const char* name) : _name(name), _start_ns(steady_ns(std::chrono::steady_clock::now())) {
+}
+
+ZoxTraceScope::~ZoxTraceScope(void) {
+	ZoxTrace::record(_name, _start_ns, steady_ns(std::chrono::steady_clock::now()));
+}
+
+void ZoxTrace::record(const char* name, uint64_t start_ns, uint64_t end_ns) {
+	// per thread and copy of the library
+	// switches over when a different ZoxTrace gets used
+	struct RingLease {
+		Impl* impl {nullptr};
+		Ring* ring {nullptr};
+
+		Ring& get(Impl& active) {
+			if (impl != &active) {
+				if (impl != nullptr) {
+					impl->release(ring);
+				}
+				impl = &active;
+				ring = impl->lease();
+			}
+			return *ring;
+		}
+
+		~RingLease(void) {
+			if (impl != nullptr) {
+				impl->release(ring);
+			}
+		}
+	};
+	thread_local RingLease lease;
+
+	auto& impl = *active()._impl;
+	auto& ring = lease.get(impl);
+
+	// relative to the epoch, keeps the numbers small
+	const uint64_t epoch_ns = steady_ns(impl.epoch);
+	start_ns -= std::min(start_ns, epoch_ns);
+	end_ns -= std::min(end_ns, epoch_ns);
+
+	const uint64_t i = ring.written.load(std::memory_order_relaxed);
+
+	ring.begun.store(i + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	auto& span = ring.spans[i % zox_trace_ring_size];
+	span.name.store(name, std::memory_order_relaxed);
+	span.start_ns.store(start_ns, std::memory_order_relaxed);
+	span.dur_ns.store(end_ns - std::min(end_ns, start_ns), std::memory_order_relaxed);
+
+	ring.written.store(i + 1, std::memory_order_release);
+}
+
+ZoxTrace::ZoxTrace(void) : _impl(new Impl) {
+}
+
+bool ZoxTrace::dump(std::ostream& out) {
+	out << "{\"traceEvents\":[\n";
+
+	bool first = true;
+
+	std::vector<std::array<uint64_t, 2>> copied; // start, dur
+	std::vector<const char*> copied_names;
+
+	std::lock_guard lg_impl{_impl->mutex};
+	for (const auto& ring : _impl->rings) {
+		const uint64_t end = ring->written.load(std::memory_order_acquire);
+		const uint64_t begin = std::max(ring->cleared.load(std::memory_order_relaxed), end - std::min<uint64_t>(end, zox_trace_ring_size));
+
+		copied.clear();
+		copied_names.clear();
+		for (uint64_t i = begin; i < end; i++) {
+			const auto& span = ring->spans[i % zox_trace_ring_size];
+			copied.push_back({span.start_ns.load(std::memory_order_relaxed), span.dur_ns.load(std::memory_order_relaxed)});
+			copied_names.push_back(span.name.load(std::memory_order_relaxed));
+		}
+
+		// slots the writer started on since, might be torn
+		std::atomic_thread_fence(std::memory_order_acquire);
+		const uint64_t begun = ring->begun.load(std::memory_order_relaxed);
+		const uint64_t valid_from = std::max(begin, begun - std::min<uint64_t>(begun, zox_trace_ring_size));
+
+		for (uint64_t i = valid_from; i < end; i++) {
+			const auto& span = copied.at(i - begin);
+
+			if (!first) {
+				out << ",\n";
+			}
+			first = false;
+
+			// complete events, times in us
+			out << "{\"name\":\"" << copied_names.at(i - begin)
+				<< "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring->tid
+				<< ",\"ts\":" << span[0] / 1000 << "." << (span[0] % 1000) / 100
+				<< ",\"dur\":" << span[1] / 1000 << "." << (span[1] % 1000) / 100
+				<< "}"
+			;
+		}
+	}
+
+	out << "\n]}\n";
+
+	return true;
+}
+
+void ZoxTrace::clear(void) {
+	std::lock_guard lg_impl{_impl->mutex};
+	for (const auto& ring : _impl->rings) {
+		ring->cleared.store(ring->written.load(std::memory_order_acquire), std::memory_order_relaxed);
+	}
+}
+
+#else
+
+struct ZoxTrace::Impl {
+};
+
+ZoxTrace::ZoxTrace(void) : _impl(nullptr) {
+}
+
+bool ZoxTrace::dump(std::ostream& out) {
+	out << "{\"traceEvents\":[]}\n";
+	return false;
+}
+
+void ZoxTrace::clear(void) {
+}
+
+#endif
+
+// per copy of the library, nullptr is local()
+static std::atomic<ZoxTrace*> g_active_trace {nullptr};
+
+ZoxTrace& ZoxTrace::local(void) {
+	// never destroyed, other plugins might still point at it
+	static ZoxTrace& trace = *new ZoxTrace;
+	return trace;
+}
+
+void ZoxTrace::use(ZoxTrace* trace) {
+	g_active_trace.store(trace, std::memory_order_release);
+}
+
+ZoxTrace& ZoxTrace::active(void) {
+	if (auto* trace = g_active_trace.load(std::memory_order_acquire); trace != nullptr) {
+		return *trace;
+	}
+	return local();
+}
+
+bool ZoxTrace::dumpToFile(const std::string& path) {
+	std::ofstream file{path};
+	if (!file.is_open()) {
+		return false;
+	}
+	const bool ret = dump(file);
+	file.flush();
+	return ret && file.good();
+}
+
+bool zox_trace_dump(std::ostream& out) {
+	return ZoxTrace::active().dump(out);
+}
+
+void zox_trace_clear(void) {
+	ZoxTrace::active().clear();
+}
+
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// scoped trace spans, recorded per thread into a lock free ring buffer
+// rings of finished threads are reused by new ones
+// dump as chrome trace event json (chrome://tracing or ui.perfetto.dev)
+// only recorded if built with SOLANACEAE_ZOX_TRACE, otherwise ZOX_TRACE_SCOPE() compiles to nothing
+
+#if SOLANACEAE_ZOX_TRACE
+
+struct ZoxTraceScope {
+	const char* _name; // needs to outlive the dump, use literals
+	uint64_t _start_ns;
+
+	explicit ZoxTraceScope(const char* name);
+	~ZoxTraceScope(void);
+
+	ZoxTraceScope(const ZoxTraceScope&) = delete;
+	ZoxTraceScope& operator=(const ZoxTraceScope&) = delete;
+};
+
+#define ZOX_TRACE_CONCAT_(a, b) a##b
+#define ZOX_TRACE_CONCAT(a, b) ZOX_TRACE_CONCAT_(a, b)
+#define ZOX_TRACE_SCOPE(name) ZoxTraceScope ZOX_TRACE_CONCAT(_zox_trace_scope_, __LINE__){name}
+
+#else
+
+#define ZOX_TRACE_SCOPE(name) do {} while (false)
+
+#endif
+
+// spans of all threads, one instance per copy of this library (eg. each plugin links its own)
+// share one through the plugin api, so a single dump has everything (see plugin_zox_ngc.cpp)
+// instances are never destroyed, rings of other plugins stay valid after those are unloaded
+// but span names point into the recording plugin, dump before unloading it
+class ZoxTrace {
+	struct Impl;
+	Impl* _impl;
+
+	ZoxTrace(void);
+
+	// into the calling threads ring of active()
+	friend struct ZoxTraceScope;
+	static void record(const char* name, uint64_t start_ns, uint64_t end_ns);
+
+	public:
+		ZoxTrace(const ZoxTrace&) = delete;
+		ZoxTrace& operator=(const ZoxTrace&) = delete;
+
+		// the instance of this copy of the library
+		static ZoxTrace& local(void);
+
+		// record into and dump from trace instead, nullptr for local() again
+		// threads switch over with their next span
+		static void use(ZoxTrace* trace);
+
+		// the one in use
+		static ZoxTrace& active(void);
+
+		// writes the spans of all threads that recorded any, oldest are overwritten once a thread recorded zox_trace_ring_size
+		// can be called any time, recording threads are not blocked
+		// returns false if tracing is compiled out (and writes an empty trace)
+		bool dump(std::ostream& out);
+
+		// like above, false also if the file could not be written
+		bool dumpToFile(const std::string& path);
+
+		// forget all recorded spans
+		void clear(void);
+};
+
+// ZoxTrace::active().dump()
+bool zox_trace_dump(std::ostream& out);
+
+// ZoxTrace::active().clear()
+void zox_trace_clear(void);
+
@@ -0,0 +1,314 @@
+#include "./utf8.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define ZOX_UTF8_SSE2 1
+	#if defined(__GNUC__) || defined(__clang__)
+		// full validation, built for ssse3 independent of the compile flags, picked at runtime
+		#include <tmmintrin.h>
+		#define ZOX_UTF8_SSSE3 1
+	#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+	#include <arm_neon.h>
+	#define ZOX_UTF8_NEON 1
+#endif
+
+// number of leading bytes of data that match a sequence (at most its size)
+// sets len to the size of the sequence the lead byte data[0] starts, 0 if it is not a lead byte
+static size_t utf8_sequence_match(const uint8_t* data, size_t size, size_t& len) {
+	const uint8_t b0 = data[0];
+	if (b0 < 0x80) {
+		len = 1;
+		return 1;
+	}
+
+	len = 0;
+	// allowed range of the second byte, excludes overlongs, surrogates and > U+10FFFF
+	uint8_t lo = 0x80;
+	uint8_t hi = 0xbf;
+	if (b0 >= 0xc2 && b0 <= 0xdf) {
+		len = 2;
+	} else if (b0 == 0xe0) {
+		len = 3;
+		lo = 0xa0;
+	} else if (b0 == 0xed) {
+		len = 3;
+		hi = 0x9f;
+	} else if (b0 >= 0xe1 && b0 <= 0xef) {
+		len = 3;
+	} else if (b0 == 0xf0) {
+		len = 4;
+		lo = 0x90;
+	} else if (b0 >= 0xf1 && b0 <= 0xf3) {
+		len = 4;
+	} else if (b0 == 0xf4) {
+		len = 4;
+		hi = 0x8f;
+	} else {
+		return 0; // continuation byte, 0xc0, 0xc1 or >= 0xf5
+	}
+
+	if (size < 2 || data[1] < lo || data[1] > hi) {
+		return 1;
+	}
+
+	size_t i = 2;
+	for (; i < len && i < size; i++) {
+		if ((data[i] & 0xc0) != 0x80) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+// size of the valid sequence starting at data[0], 0 if invalid or incomplete
+static size_t utf8_sequence_size(const uint8_t* data, size_t size) {
+	size_t len = 0;
+	const size_t matched = utf8_sequence_match(data, size, len);
+	return matched == len ? len : 0;
+}
+
+// all 16 bytes < 0x80
+static bool ascii_16(const uint8_t* data) {
+#if ZOX_UTF8_SSE2
+	return _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data))) == 0;
+#elif ZOX_UTF8_NEON
+	return vmaxvq_u8(vld1q_u8(data)) < 0x80;
+#else
+	uint64_t a, b;
+	std::memcpy(&a, data, 8);
+	std::memcpy(&b, data + 8, 8);
+	return ((a | b) & 0x8080808080808080ull) == 0;
+#endif
+}
+
+#if ZOX_UTF8_SSSE3
+// vectorized validation with 3 nibble lookup tables
+// Keiser, Lemire: Validating UTF-8 In Less Than One Instruction Per Byte (2020)
+
+// error bits, set in all 3 tables if the byte pair (prev1, input) is that error
+static constexpr uint8_t utf8_too_short = 1<<0; // lead not followed by a continuation
+static constexpr uint8_t utf8_too_long = 1<<1; // ascii followed by a continuation
+static constexpr uint8_t utf8_overlong_3 = 1<<2;
+static constexpr uint8_t utf8_too_large = 1<<3;
+static constexpr uint8_t utf8_surrogate = 1<<4;
+static constexpr uint8_t utf8_overlong_2 = 1<<5;
+static constexpr uint8_t utf8_too_large_1000 = 1<<6;
+static constexpr uint8_t utf8_overlong_4 = 1<<6;
+static constexpr uint8_t utf8_two_conts = 1<<7; // fine only if a 3 or 4 byte lead came before
+static constexpr uint8_t utf8_carry = utf8_too_short | utf8_too_long | utf8_two_conts;
+
+__attribute__((target("ssse3")))
+static __m128i utf8_block_errors(__m128i input, __m128i prev_input) {
+	const __m128i nibble_mask = _mm_set1_epi8(0x0f);
+
+	const __m128i prev1 = _mm_alignr_epi8(input, prev_input, 16-1);
+
+	const __m128i byte_1_high = _mm_shuffle_epi8(
+		_mm_setr_epi8(
+			// 0_______ ascii
+			char(utf8_too_long), char(utf8_too_long), char(utf8_too_long), char(utf8_too_long),
+			char(utf8_too_long), char(utf8_too_long), char(utf8_too_long), char(utf8_too_long),
+			// 10______ continuation
+			char(utf8_two_conts), char(utf8_two_conts), char(utf8_two_conts), char(utf8_two_conts),
+			// 1100____ 2 byte lead
+			char(utf8_too_short | utf8_overlong_2),
+			// 1101____ 2 byte lead
+			char(utf8_too_short),
+			// 1110____ 3 byte lead
+			char(utf8_too_short | utf8_overlong_3 | utf8_surrogate),
+			// 1111____ 4 byte lead
+			char(utf8_too_short | utf8_too_large | utf8_too_large_1000 | utf8_overlong_4)
+		),
+		_mm_and_si128(_mm_srli_epi16(prev1, 4), nibble_mask)
+	);
+
+	const __m128i byte_1_low = _mm_shuffle_epi8(
+		_mm_setr_epi8(
+			// ____0000
+			char(utf8_carry | utf8_overlong_3 | utf8_overlong_2 | utf8_overlong_4),
+			// ____0001
+			char(utf8_carry | utf8_overlong_2),
+			// ____001_
+			char(utf8_carry),
+			char(utf8_carry),
+			// ____0100
+			char(utf8_carry | utf8_too_large),
+			// ____0101 - ____1100
+			char(utf8_carry | utf8_too_large | utf8_too_large_1000),
+			char(utf8_carry | utf8_too_large | utf8_too_large_1000),
+			char(utf8_carry | utf8_too_large | utf8_too_large_1000),
+			char(utf8_carry | utf8_too_large | utf8_too_large_1000),
+			char(utf8_carry | utf8_too_large | utf8_too_large_1000),
+			char(utf8_carry | utf8_too_large | utf8_too_large_1000),
+			char(utf8_carry | utf8_too_large | utf8_too_large_1000),
+			char(utf8_carry | utf8_too_large | utf8_too_large_1000),
+			// ____1101
+			char(utf8_carry | utf8_too_large | utf8_too_large_1000 | utf8_surrogate),
+			// ____111_
+			char(utf8_carry | utf8_too_large | utf8_too_large_1000),
+			char(utf8_carry | utf8_too_large | utf8_too_large_1000)
+		),
+		_mm_and_si128(prev1, nibble_mask)
+	);
+
+	const __m128i byte_2_high = _mm_shuffle_epi8(
+		_mm_setr_epi8(
+			// 0_______ ascii
+			char(utf8_too_short), char(utf8_too_short), char(utf8_too_short), char(utf8_too_short),
+			char(utf8_too_short), char(utf8_too_short), char(utf8_too_short), char(utf8_too_short),
+			// 1000____
+			char(utf8_too_long | utf8_overlong_2 | utf8_two_conts | utf8_overlong_3 | utf8_too_large_1000 | utf8_overlong_4),
+			// 1001____
+			char(utf8_too_long | utf8_overlong_2 | utf8_two_conts | utf8_overlong_3 | utf8_too_large),
+			// 101_____
+			char(utf8_too_long | utf8_overlong_2 | utf8_two_conts | utf8_surrogate | utf8_too_large),
+			char(utf8_too_long | utf8_overlong_2 | utf8_two_conts | utf8_surrogate | utf8_too_large),
+			// 11______ lead
+			char(utf8_too_short), char(utf8_too_short), char(utf8_too_short), char(utf8_too_short)
+		),
+		_mm_and_si128(_mm_srli_epi16(input, 4), nibble_mask)
+	);
+
+	const __m128i special_cases = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+	// the 2nd and 3rd continuation, after a 3 or 4 byte lead
+	const __m128i prev2 = _mm_alignr_epi8(input, prev_input, 16-2);
+	const __m128i prev3 = _mm_alignr_epi8(input, prev_input, 16-3);
+	const __m128i is_third_byte = _mm_subs_epu8(prev2, _mm_set1_epi8(char(0xe0-1)));
+	const __m128i is_fourth_byte = _mm_subs_epu8(prev3, _mm_set1_epi8(char(0xf0-1)));
+	const __m128i must_be_23_cont = _mm_and_si128(
+		_mm_cmpgt_epi8(_mm_or_si128(is_third_byte, is_fourth_byte), _mm_setzero_si128()),
+		_mm_set1_epi8(char(0x80))
+	);
+
+	return _mm_xor_si128(must_be_23_cont, special_cases);
+}
+
+// stops at the first block with an error, or with a sequence cut off at the end
+// the scalar version finds the exact position from there
+__attribute__((target("ssse3")))
+static size_t utf8_valid_blocks_ssse3(const uint8_t* data, size_t size) {
+	// non 0 in the last 3 bytes if a sequence did not end in the block
+	const __m128i max_complete = _mm_setr_epi8(
+		char(0xff), char(0xff), char(0xff), char(0xff), char(0xff), char(0xff), char(0xff), char(0xff),
+		char(0xff), char(0xff), char(0xff), char(0xff), char(0xff), char(0xf0-1), char(0xe0-1), char(0xc0-1)
+	);
+
+	__m128i prev_input = _mm_setzero_si128();
+	__m128i prev_incomplete = _mm_setzero_si128();
+
+	size_t pos = 0;
+	for (; size - pos >= 16; pos += 16) {
+		const __m128i input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+
+		__m128i errors;
+		if (_mm_movemask_epi8(input) == 0) {
+			// ascii, only an error if a sequence was left open
+			errors = prev_incomplete;
+		} else {
+			errors = utf8_block_errors(input, prev_input);
+		}
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(errors, _mm_setzero_si128())) != 0xffff) {
+			break;
+		}
+
+		prev_incomplete = _mm_subs_epu8(input, max_complete);
+		prev_input = input;
+	}
+
+	return pos;
+}
+
+static bool has_ssse3(void) {
+	static const bool supported = __builtin_cpu_supports("ssse3");
+	return supported;
+}
+#endif
+
+size_t zox_utf8_valid_prefix(const uint8_t* data, size_t size) {
+#if ZOX_UTF8_SSSE3
+	if (has_ssse3()) {
+		size_t pos = utf8_valid_blocks_ssse3(data, size);
+
+		// everything before pos is valid, except for a sequence running into pos
+		for (size_t back = 1; back <= 3 && back <= pos; back++) {
+			if ((data[pos - back] & 0xc0) != 0x80) {
+				if (data[pos - back] >= 0xc0) {
+					pos -= back; // lead byte
+				}
+				break;
+			}
+		}
+
+		return pos + zox_utf8_valid_prefix_scalar(data + pos, size - pos);
+	}
+#endif
+
+	size_t pos = 0;
+	while (pos < size) {
+		if (size - pos >= 16 && ascii_16(data + pos)) {
+			pos += 16;
+			continue;
+		}
+
+		// not (all) ascii, decode to the end of the block before trying the fast path again
+		const size_t block_end = std::min(size, pos + 16);
+		while (pos < block_end) {
+			const size_t seq_size = utf8_sequence_size(data + pos, size - pos);
+			if (seq_size == 0) {
+				return pos;
+			}
+			pos += seq_size;
+		}
+	}
+
+	return pos;
+}
+
+size_t zox_utf8_valid_prefix_scalar(const uint8_t* data, size_t size) {
+	size_t pos = 0;
+	while (pos < size) {
+		const size_t seq_size = utf8_sequence_size(data + pos, size - pos);
+		if (seq_size == 0) {
+			return pos;
+		}
+		pos += seq_size;
+	}
+
+	return pos;
+}
+
+std::string_view zox_utf8_sanitize(std::string_view str, std::string& out) {
+	const uint8_t* data = reinterpret_cast<const uint8_t*>(str.data());
+	const size_t size = str.size();
+
+	size_t pos = zox_utf8_valid_prefix(data, size);
+	if (pos == size) {
+		return str;
+	}
+
+	out.assign(str.data(), pos);
+	while (pos < size) {
+		size_t len = 0;
+		const size_t matched = utf8_sequence_match(data + pos, size - pos, len);
+		if (pos + matched == size && matched > 0) {
+			break; // cut off, not broken
+		}
+
+		out += "\xef\xbf\xbd"; // U+FFFD
+		pos += std::max<size_t>(1u, matched);
+
+		const size_t valid = zox_utf8_valid_prefix(data + pos, size - pos);
+		out.append(str.data() + pos, valid);
+		pos += valid;
+	}
+
+	return out;
+}
+
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// utf-8 checks for text from the network, strict (rfc 3629, no overlongs, no surrogates)
+
+// length of the longest valid utf-8 prefix
+// fully validates 16 bytes at a time with ssse3 (picked at runtime),
+// otherwise has a sse2/neon fast path for ascii runs
+size_t zox_utf8_valid_prefix(const uint8_t* data, size_t size);
+
+// same as above, one byte at a time, for comparison
+size_t zox_utf8_valid_prefix_scalar(const uint8_t* data, size_t size);
+
+inline bool zox_utf8_valid(std::string_view str) {
+	return zox_utf8_valid_prefix(reinterpret_cast<const uint8_t*>(str.data()), str.size()) == str.size();
+}
+
+// cuts str to at most max_size bytes, at a character boundary
+// also cuts at the first invalid sequence, so the result is always valid utf-8
+// NOTE: everything after the first invalid sequence is lost, meant for our own text, see zox_utf8_sanitize() for text from the network
+inline std::string_view zox_utf8_truncate(std::string_view str, size_t max_size = ~size_t(0)) {
+	str = str.substr(0, max_size);
+	// a character cut in half at the end is an invalid sequence too
+	return str.substr(0, zox_utf8_valid_prefix(reinterpret_cast<const uint8_t*>(str.data()), str.size()));
+}
+
+// replaces each invalid sequence (maximal subpart, like the unicode standard recommends) with U+FFFD
+// a sequence cut off at the very end is dropped instead, some clients cut names to a fixed size
+// returns str if it already was valid, otherwise a view into out
+std::string_view zox_utf8_sanitize(std::string_view str, std::string& out);
+
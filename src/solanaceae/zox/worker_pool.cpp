@@ -0,0 +1,63 @@
+#include "./worker_pool.hpp"
+
+ZoxWorkerPool::ZoxWorkerPool(size_t thread_count) {
+	_threads.reserve(thread_count);
+	for (size_t i = 0; i < thread_count; i++) {
+		_threads.emplace_back([this]() { worker(); });
+	}
+}
+
+ZoxWorkerPool::~ZoxWorkerPool(void) {
+	stop();
+}
+
+std::deque<std::function<void(void)>> ZoxWorkerPool::stop(void) {
+	std::deque<std::function<void(void)>> jobs;
+	{
+		std::lock_guard lg{_mutex};
+		_quit = true;
+		jobs.swap(_jobs);
+	}
+	_cv.notify_all();
+
+	for (auto& t : _threads) {
+		t.join();
+	}
+	_threads.clear();
+
+	return jobs;
+}
+
+void ZoxWorkerPool::requeue(std::deque<std::function<void(void)>>&& jobs) {
+	if (jobs.empty()) {
+		return;
+	}
+
+	{
+		std::lock_guard lg{_mutex};
+		for (auto& job : jobs) {
+			_jobs.push_back(std::move(job));
+		}
+	}
+	_cv.notify_all();
+}
+
+void ZoxWorkerPool::worker(void) {
+	while (true) {
+		std::function<void(void)> job;
+
+		{
+			std::unique_lock lk{_mutex};
+			_cv.wait(lk, [this]() { return _quit || !_jobs.empty(); });
+			if (_quit) {
+				return;
+			}
+
+			job = std::move(_jobs.front());
+			_jobs.pop_front();
+		}
+
+		job();
+	}
+}
+
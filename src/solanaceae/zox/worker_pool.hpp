@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <type_traits>
+
+// minimal fixed size thread pool
+// jobs still queued on destruction are dropped, their futures become broken
+class ZoxWorkerPool {
+	std::vector<std::thread> _threads;
+
+	std::mutex _mutex;
+	std::condition_variable _cv;
+	std::deque<std::function<void(void)>> _jobs;
+	bool _quit {false};
+
+	void worker(void);
+
+	public:
+		explicit ZoxWorkerPool(size_t thread_count);
+		~ZoxWorkerPool(void);
+
+		size_t threadCount(void) const { return _threads.size(); }
+
+		// waits for the running jobs, the queued ones are returned instead of dropped
+		// their futures stay valid, run them or requeue() them on another pool
+		std::deque<std::function<void(void)>> stop(void);
+
+		// jobs returned by stop()
+		void requeue(std::deque<std::function<void(void)>>&& jobs);
+
+		template<typename Fn>
+		std::future<std::invoke_result_t<Fn>> submit(Fn&& fn) {
+			using R = std::invoke_result_t<Fn>;
+
+			// std::function needs to be copyable
+			auto task = std::make_shared<std::packaged_task<R(void)>>(std::forward<Fn>(fn));
+			auto future = task->get_future();
+
+			{
+				std::lock_guard lg{_mutex};
+				_jobs.emplace_back([task]() { (*task)(); });
+			}
+			_cv.notify_one();
+
+			return future;
+		}
+};
+
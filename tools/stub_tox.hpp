@@ -0,0 +1,80 @@
+#pragma once
+
+#include <solanaceae/toxcore/tox_default_impl.hpp>
+#include <solanaceae/toxcore/tox_event_interface.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// offline stand-in for toxcore, for the tools
+// groups and peers exist as soon as they are asked about, keys are derived from the numbers
+// everything not overridden here goes to ToxDefaultImpl without a tox instance, so dont use it
+struct StubTox : public ToxDefaultImpl {
+	// set to see what gets sent, return false to simulate a send failure
+	std::function<bool(uint32_t group_number, uint32_t peer_number, bool lossless, const std::vector<uint8_t>& data)> on_send_private;
+	std::function<bool(uint32_t group_number, bool lossless, const std::vector<uint8_t>& data)> on_send_public;
+
+	uint32_t self_peer_number {0xfffffffe};
+
+	size_t sent_packets {0u};
+	size_t sent_bytes {0u};
+
+	static ToxKey makeKey(uint32_t a, uint32_t b, uint8_t tag) {
+		ToxKey k{};
+		k.data[0] = tag;
+		for (size_t i = 0; i < 4; i++) {
+			k.data[1+i] = 0xff & (a >> 8*i);
+			k.data[5+i] = 0xff & (b >> 8*i);
+		}
+		return k;
+	}
+
+	std::optional<ToxKey> toxGroupGetChatId(uint32_t group_number) override {
+		return makeKey(group_number, 0, 'G');
+	}
+
+	std::optional<ToxKey> toxGroupSelfGetPublicKey(uint32_t group_number) override {
+		return makeKey(group_number, self_peer_number, 'P');
+	}
+
+	std::tuple<std::optional<ToxKey>, Tox_Err_Group_Peer_Query> toxGroupPeerGetPublicKey(uint32_t group_number, uint32_t peer_id) override {
+		return {makeKey(group_number, peer_id, 'P'), TOX_ERR_GROUP_PEER_QUERY_OK};
+	}
+
+	std::tuple<std::optional<std::string>, Tox_Err_Group_Peer_Query> toxGroupPeerGetName(uint32_t group_number, uint32_t peer_id) override {
+		return {"peer" + std::to_string(group_number) + "_" + std::to_string(peer_id), TOX_ERR_GROUP_PEER_QUERY_OK};
+	}
+
+	std::tuple<std::optional<Tox_Connection>, Tox_Err_Group_Peer_Query> toxGroupPeerGetConnectionStatus(uint32_t, uint32_t) override {
+		return {TOX_CONNECTION_UDP, TOX_ERR_GROUP_PEER_QUERY_OK};
+	}
+
+	Tox_Err_Group_Send_Custom_Packet toxGroupSendCustomPacket(uint32_t group_number, bool lossless, const std::vector<uint8_t>& data) override {
+		if (on_send_public && !on_send_public(group_number, lossless, data)) {
+			return TOX_ERR_GROUP_SEND_CUSTOM_PACKET_FAIL_SEND;
+		}
+
+		sent_packets++;
+		sent_bytes += data.size();
+		return TOX_ERR_GROUP_SEND_CUSTOM_PACKET_OK;
+	}
+
+	Tox_Err_Group_Send_Custom_Private_Packet toxGroupSendCustomPrivatePacket(uint32_t group_number, uint32_t peer_id, bool lossless, const std::vector<uint8_t>& data) override {
+		if (on_send_private && !on_send_private(group_number, peer_id, lossless, data)) {
+			return TOX_ERR_GROUP_SEND_CUSTOM_PRIVATE_PACKET_FAIL_SEND;
+		}
+
+		sent_packets++;
+		sent_bytes += data.size();
+		return TOX_ERR_GROUP_SEND_CUSTOM_PRIVATE_PACKET_OK;
+	}
+};
+
+// tools feed packets directly, so this never dispatches anything
+struct StubToxEventProvider : public ToxEventProviderI {
+};
+
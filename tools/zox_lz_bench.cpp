@@ -0,0 +1,168 @@
+// measures ZoxLZ on ngch_syncmsg_packed bodies, like ngch_syncmsg_compressed uses it
+// ratio and speed, with only the primer as dictionary and with the previous body added
+
+#include <solanaceae/zox/lz.hpp>
+#include <solanaceae/zox/ngc_hs_packer.hpp>
+
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+static void print_usage(const char* self) {
+	std::cerr << "usage: " << self << " [--iterations <n>] [--seed <n>]\n";
+}
+
+// bodies of consecutive packets, filled up to body_size like the encoder does
+static std::vector<std::vector<uint8_t>> make_bodies(const std::vector<std::string>& texts, size_t body_size, size_t count, uint32_t seed) {
+	std::minstd_rand rng{seed};
+
+	const std::vector<std::string> names {"alice", "bob", "Tox User", "zoff", "some longer nickname"};
+
+	std::vector<std::vector<uint8_t>> bodies;
+	uint32_t message_id = rng();
+	uint32_t timestamp = 1700000000u;
+	while (bodies.size() < count) {
+		ZoxNGCSyncMsgPacker packer{body_size};
+		while (true) {
+			const size_t sender = rng() % names.size();
+			std::array<uint8_t, 32> pub_key {};
+			pub_key.fill(uint8_t(sender * 37));
+
+			if (!packer.add(message_id, pub_key, timestamp, names.at(sender), texts.at(rng() % texts.size()))) {
+				break;
+			}
+			message_id = rng();
+			timestamp += rng() % 120;
+		}
+		bodies.push_back(packer.body());
+	}
+
+	return bodies;
+}
+
+int main(int argc, char** argv) {
+	size_t iterations = 200;
+	uint32_t seed = 1337;
+
+	for (int i = 1; i < argc; i++) {
+		if (std::strcmp(argv[i], "--iterations") == 0 && i+1 < argc) {
+			iterations = std::stoul(argv[++i]);
+		} else if (std::strcmp(argv[i], "--seed") == 0 && i+1 < argc) {
+			seed = std::stoul(argv[++i]);
+		} else {
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	// the largest lossless custom packet, and the body budget ZoxNGCHistorySync uses by default
+	constexpr size_t max_packet_size = 1373;
+	constexpr size_t body_size = 4 * max_packet_size;
+	constexpr size_t bodies_per_case = 64;
+
+	struct Case {
+		const char* name;
+		std::vector<std::string> texts;
+	};
+	std::vector<Case> cases;
+	cases.push_back({"chat", {
+		"hi", "lol", "ok", "yes", "no idea", "brb", "good morning everyone",
+		"did anyone try the new build yet?", "works for me", "can you paste the log?",
+		"the quick brown fox jumps over the lazy dog",
+	}});
+	cases.push_back({"links", {
+		"https://github.com/zoff99/c-toxcore/blob/zoff99/zoxcore_local_fork/docs/ngc_group_history_sync.md",
+		"look at https://www.youtube.com/watch?v=dQw4w9WgXcQ",
+		"https://github.com/Green-Sky/tomato/issues/42#issuecomment-1234567",
+		"see https://toktok.ltd/spec.html",
+	}});
+	cases.push_back({"mixed-scripts", {
+		"Grüße aus Köln", "съешь же ещё этих мягких французских булок", "敏捷的棕色狐狸跳过了懒狗。",
+		"ok 👍 lol 😂", "ünïcödé everywhere",
+	}});
+	{ // incompressible, the encoder falls back to plain packed
+		std::minstd_rand rng{seed};
+		std::vector<std::string> texts;
+		for (size_t i = 0; i < 4096; i++) {
+			std::string text(200, ' ');
+			for (auto& c : text) {
+				c = char(0x21 + rng() % 94);
+			}
+			texts.push_back(std::move(text));
+		}
+		cases.push_back({"random", std::move(texts)});
+	}
+
+	bool mismatch = false;
+	for (const auto& c : cases) {
+		const auto bodies = make_bodies(c.texts, body_size, bodies_per_case, seed);
+
+		for (const bool use_prev : {false, true}) {
+			// dictionaries, like both sides build them
+			std::vector<std::vector<uint8_t>> dicts(bodies.size());
+			for (size_t i = 0; i < bodies.size(); i++) {
+				static const std::vector<uint8_t> no_body;
+				ZoxNGCSyncMsgPacker::buildDictionary(use_prev && i > 0 ? bodies.at(i-1) : no_body, dicts.at(i));
+			}
+
+			size_t raw_bytes = 0;
+			size_t compressed_bytes = 0;
+			size_t fits = 0; // in one packet
+			std::vector<std::vector<uint8_t>> compressed(bodies.size());
+
+			const auto compress_start = std::chrono::steady_clock::now();
+			for (size_t it = 0; it < iterations; it++) {
+				for (size_t i = 0; i < bodies.size(); i++) {
+					const auto& dict = dicts.at(i);
+					const auto& body = bodies.at(i);
+					compressed.at(i).clear();
+					if (!ZoxLZ::compress(dict.data(), dict.size(), body.data(), body.size(), compressed.at(i), body.size() * 2)) {
+						std::cerr << "error: " << c.name << " compress failed\n";
+						return 2;
+					}
+				}
+			}
+			const double compress_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - compress_start).count();
+
+			for (size_t i = 0; i < bodies.size(); i++) {
+				raw_bytes += bodies.at(i).size();
+				compressed_bytes += compressed.at(i).size();
+				if (compressed.at(i).size() + ZoxNGCSyncMsgPacker::compressed_header_size <= max_packet_size) {
+					fits++;
+				}
+			}
+
+			std::vector<uint8_t> out;
+			const auto decompress_start = std::chrono::steady_clock::now();
+			for (size_t it = 0; it < iterations; it++) {
+				for (size_t i = 0; i < bodies.size(); i++) {
+					const auto& dict = dicts.at(i);
+					out.clear();
+					if (!ZoxLZ::decompress(dict.data(), dict.size(), compressed.at(i).data(), compressed.at(i).size(), out, bodies.at(i).size()) || out != bodies.at(i)) {
+						std::cerr << "error: " << c.name << " roundtrip mismatch\n";
+						mismatch = true;
+						break;
+					}
+				}
+			}
+			const double decompress_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - decompress_start).count();
+
+			const double mb = double(raw_bytes) * iterations / (1024.*1024.);
+			std::cout << c.name
+				<< (use_prev ? " prev" : " primer")
+				<< " bodies:" << bodies.size()
+				<< " ratio:" << double(compressed_bytes) / double(raw_bytes)
+				<< " fit:" << fits << "/" << bodies.size()
+				<< " compress:" << mb / compress_s << "MiB/s"
+				<< " decompress:" << mb / decompress_s << "MiB/s"
+				<< "\n";
+		}
+	}
+
+	return mismatch ? 2 : 0;
+}
+
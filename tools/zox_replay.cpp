@@ -0,0 +1,174 @@
+// replays a capture made with ZoxNGCEventProvider::startCapture() (or SOLANACEAE_ZOX_CAPTURE with the plugin)
+// through ZoxNGCEventProvider and ZoxNGCHistorySync, against stubbed tox and fresh registries
+// reports throughput and per packet latency
+
+#include "./stub_tox.hpp"
+
+#include <solanaceae/zox/ngc.hpp>
+#include <solanaceae/zox/ngc_hs.hpp>
+#include <solanaceae/zox/ngc_capture.hpp>
+#include <solanaceae/zox/trace.hpp>
+
+#include <solanaceae/contact/contact_store_impl.hpp>
+#include <solanaceae/tox_contacts/tox_contact_model2.hpp>
+#include <solanaceae/message3/registry_message_model.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+static void print_usage(const char* self) {
+	std::cerr << "usage: " << self << " <capture> [--max-speed] [--no-hs] [--workers <n>] [--metrics] [--trace <file>] [--verbose]\n";
+}
+
+int main(int argc, char** argv) {
+	std::string capture_path;
+	bool max_speed = false;
+	bool with_hs = true;
+	bool verbose = false;
+	bool print_metrics = false;
+	std::string trace_path;
+	size_t workers = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (std::strcmp(argv[i], "--max-speed") == 0) {
+			max_speed = true;
+		} else if (std::strcmp(argv[i], "--no-hs") == 0) {
+			with_hs = false;
+		} else if (std::strcmp(argv[i], "--verbose") == 0) {
+			verbose = true;
+		} else if (std::strcmp(argv[i], "--metrics") == 0) {
+			print_metrics = true;
+		} else if (std::strcmp(argv[i], "--trace") == 0 && i+1 < argc) {
+			trace_path = argv[++i];
+		} else if (std::strcmp(argv[i], "--workers") == 0 && i+1 < argc) {
+			workers = std::stoul(argv[++i]);
+		} else if (capture_path.empty() && argv[i][0] != '-') {
+			capture_path = argv[i];
+		} else {
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (capture_path.empty()) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	std::vector<ZoxNGCCaptureRecord> records;
+	size_t total_bytes = 0;
+	{
+		ZoxNGCCaptureReader reader{capture_path};
+		if (!reader.isValid()) {
+			std::cerr << "error: '" << capture_path << "' is not a zox capture\n";
+			return 2;
+		}
+
+		ZoxNGCCaptureRecord record;
+		while (reader.next(record)) {
+			total_bytes += record.data.size();
+			records.push_back(std::move(record));
+		}
+	}
+
+	if (records.empty()) {
+		std::cerr << "error: empty capture\n";
+		return 2;
+	}
+
+	std::cout << "loaded " << records.size() << " packets, " << total_bytes << " bytes, spanning "
+		<< (records.back().ts - records.front().ts) / 1000.0 << "s\n";
+
+	StubTox t;
+	StubToxEventProvider tep;
+	ContactStore4Impl cs;
+	ToxContactModel2 tcm{cs, t, tep};
+	RegistryMessageModelImpl rmm{cs};
+
+	ZoxNGCEventProvider zngc{tep};
+	std::unique_ptr<ZoxNGCHistorySync> hs;
+	if (with_hs) {
+		hs = std::make_unique<ZoxNGCHistorySync>(tep, zngc, t, cs, tcm, rmm);
+		hs->setWorkerThreads(workers);
+	}
+
+	// the components log every packet
+	std::ostringstream discard;
+	auto* cout_buf = std::cout.rdbuf();
+	auto* cerr_buf = std::cerr.rdbuf();
+	if (!verbose) {
+		std::cout.rdbuf(discard.rdbuf());
+		std::cerr.rdbuf(discard.rdbuf());
+	}
+
+	using clock = std::chrono::steady_clock;
+
+	std::vector<double> latencies_us;
+	latencies_us.reserve(records.size());
+
+	size_t handled = 0;
+	const auto start = clock::now();
+	auto last_tick = start;
+	for (const auto& record : records) {
+		auto scheduled = clock::now();
+		if (!max_speed) {
+			scheduled = start + std::chrono::milliseconds{record.ts - records.front().ts};
+			std::this_thread::sleep_until(scheduled);
+		}
+
+		if (zngc.onGroupCustomPacket(record.group_number, record.peer_number, record.data.data(), record.data.size(), record._private)) {
+			handled++;
+		}
+
+		const auto done = clock::now();
+		// in real time mode this includes falling behind schedule
+		latencies_us.push_back(std::chrono::duration<double, std::micro>(done - scheduled).count());
+
+		if (hs) {
+			hs->tick(std::chrono::duration<float>(done - last_tick).count());
+			last_tick = done;
+		}
+	}
+	const double duration_s = std::chrono::duration<double>(clock::now() - start).count();
+
+	std::cout.rdbuf(cout_buf);
+	std::cerr.rdbuf(cerr_buf);
+
+	std::sort(latencies_us.begin(), latencies_us.end());
+	const auto percentile = [&latencies_us](double p) {
+		return latencies_us.at(std::min<size_t>(latencies_us.size() - 1, p * latencies_us.size()));
+	};
+
+	std::cout
+		<< "replayed " << records.size() << " packets (" << handled << " handled) in " << duration_s << "s"
+		<< (max_speed ? " at max speed" : " in real time") << "\n"
+		<< "throughput: " << records.size() / duration_s << " packets/s, " << total_bytes / duration_s / 1024.0 << " KiB/s\n"
+		<< "latency us: p50 " << percentile(0.5) << " p90 " << percentile(0.9) << " p99 " << percentile(0.99) << " max " << latencies_us.back() << "\n"
+		<< "responses: " << t.sent_packets << " packets, " << t.sent_bytes << " bytes\n"
+	;
+
+	if (print_metrics) {
+		zngc.metrics().writeText(std::cout);
+		zngc.ngcaStats().writeText(std::cout);
+		if (hs) {
+			hs->metrics().writeText(std::cout);
+		}
+	}
+
+	if (!trace_path.empty()) {
+		std::ofstream trace_file{trace_path};
+		if (!zox_trace_dump(trace_file)) {
+			std::cerr << "warning: built without SOLANACEAE_ZOX_TRACE, trace is empty\n";
+		}
+	}
+
+	return 0;
+}
+
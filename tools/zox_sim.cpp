@@ -0,0 +1,491 @@
+// deterministic multi peer history sync simulation
+// runs N ZoxNGCHistorySync instances in one group, connected by a fake network with loss, latency and bandwidth
+// all randomness is seeded and time is virtual, so runs are reproducible
+// reports time to convergence, duplicate syncmsgs and bytes per peer
+//
+// with live messages, peers also receive messages directly during the run, with skewed clocks and late deliveries,
+// those get synced back later and have to match the directly received copy (see ZoxClockSkewEstimator)
+// "dup msgs" counts messages that ended up twice in a registry
+//
+// with --source, the older half of the initial history is not loaded, only in a ZoxNGCHistorySourceI (like an archive)
+// and has to be served from there
+
+#include "./stub_tox.hpp"
+
+#include <solanaceae/zox/ngc.hpp>
+#include <solanaceae/zox/ngc_hs.hpp>
+#include <solanaceae/zox/ngc_hs_source.hpp>
+
+#include <solanaceae/util/time.hpp>
+#include <solanaceae/contact/contact_store_impl.hpp>
+#include <solanaceae/contact/components.hpp>
+#include <solanaceae/tox_contacts/tox_contact_model2.hpp>
+#include <solanaceae/tox_contacts/components.hpp>
+#include <solanaceae/message3/registry_message_model.hpp>
+#include <solanaceae/message3/components.hpp>
+#include <solanaceae/tox_messages/msg_components.hpp>
+
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <memory>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+struct SimConfig {
+	uint32_t seed {1337u};
+	float loss {0.01f}; // per transmission, lossless packets get resent
+	uint64_t latency_ms {80u};
+	uint64_t jitter_ms {40u};
+	uint64_t resend_ms {500u};
+	uint64_t bandwidth_bps {64u*1024u}; // per peer uplink, bytes per second
+	size_t messages {200u}; // in the group, over the last hour
+	float have_ratio {0.6f}; // chance a peer has a message before the sync
+	uint64_t step_ms {50u};
+	uint64_t max_ms {60u*60u*1000u};
+	size_t workers {0u}; // >0 makes runs timing dependent
+	ZoxNGCSyncOrder order {ZoxNGCSyncOrder::newest_first};
+	float reorder_s {0.f}; // receiver side reorder buffer, 0 is off
+
+	size_t live_messages {0u}; // sent directly during the run, the run does not end before max_ms
+	uint64_t live_interval_ms {20u*1000u};
+	uint64_t live_late_ms {0u}; // extra delay for 1 in 4 direct deliveries, past the narrow window
+	int64_t clock_skew_ms {0}; // clocks of odd peers are this far ahead
+	int64_t clock_step_ms {0}; // peer 1s clock jumps by this, halfway through the live messages
+
+	bool source {false}; // the older half of the initial history is only in the history source
+};
+
+struct SimResult {
+	bool converged {false};
+	uint64_t convergence_ms {0u};
+	size_t syncmsgs {0u};
+	size_t duplicates {0u};
+	size_t duplicate_messages {0u};
+	size_t bytes_total {0u};
+};
+
+// in memory archive, one group
+struct SimHistorySource : public ZoxNGCHistorySourceI {
+	struct Record {
+		uint32_t message_id {0u};
+		std::array<uint8_t, 32> sender_pub_key {};
+		uint64_t ts {0u};
+		std::string sender_name;
+		std::string message_text;
+	};
+	std::vector<Record> records;
+
+	void forEachRecord(
+		const std::array<uint8_t, 32>&,
+		uint64_t ts_from, uint64_t ts_to,
+		const std::function<bool(const ZoxNGCHistoryRecord&)>& fn
+	) override {
+		for (const auto& r : records) {
+			if (r.ts < ts_from || r.ts >= ts_to) {
+				continue;
+			}
+
+			ZoxNGCHistoryRecord hr;
+			hr.message_id = r.message_id;
+			hr.sender_pub_key = r.sender_pub_key;
+			hr.ts = r.ts;
+			hr.sender_name = r.sender_name;
+			hr.message_text = r.message_text;
+			if (!fn(hr)) {
+				return;
+			}
+		}
+	}
+};
+
+// counts syncmsgs before ZoxNGCHistorySync sees them
+struct SyncMsgCounter : public ZoxNGCEventI {
+	ZoxNGCEventProviderI::SubscriptionReference _sr;
+	size_t count {0u};
+
+	SyncMsgCounter(ZoxNGCEventProviderI& zngcepi) : _sr(zngcepi.newSubRef(this)) {
+		_sr.subscribe(ZoxNGC_Event::ngch_syncmsg);
+	}
+
+	bool onEvent(const Events::ZoxNGC_ngch_syncmsg&) override {
+		count++;
+		return false; // pass on
+	}
+};
+
+struct SimNode {
+	StubTox t;
+	StubToxEventProvider tep;
+	ContactStore4Impl cs;
+	ToxContactModel2 tcm{cs, t, tep};
+	RegistryMessageModelImpl rmm{cs};
+	ZoxNGCEventProvider zngc{tep};
+	SyncMsgCounter counter{zngc};
+	SimHistorySource source; // outlives hs
+	ZoxNGCHistorySync hs{tep, zngc, t, cs, tcm, rmm};
+
+	int64_t clock_offset_ms {0};
+	size_t initial_messages {0u};
+	size_t direct_messages {0u}; // live messages received directly
+};
+
+// a live message on its direct way to one peer
+struct InFlightDirect {
+	uint64_t deliver_ms;
+	uint64_t seq;
+	uint32_t author;
+	uint32_t to;
+	uint32_t message_id;
+	std::string text;
+
+	bool operator<(const InFlightDirect& rhs) const {
+		return std::tie(deliver_ms, seq) < std::tie(rhs.deliver_ms, rhs.seq);
+	}
+};
+
+struct InFlight {
+	uint64_t deliver_ms;
+	uint64_t seq; // tie breaker, keeps it deterministic
+	uint32_t from;
+	uint32_t to;
+	std::vector<uint8_t> data;
+
+	bool operator<(const InFlight& rhs) const {
+		return std::tie(deliver_ms, seq) < std::tie(rhs.deliver_ms, rhs.seq);
+	}
+};
+
+static size_t count_messages(SimNode& node, uint32_t group_number, uint32_t some_peer) {
+	const auto c = node.tcm.getContactGroupPeer(group_number, some_peer);
+	auto* reg_ptr = node.rmm.get(c);
+	if (reg_ptr == nullptr) {
+		return 0;
+	}
+	return reg_ptr->view<Message::Components::ToxGroupMessageID>().size();
+}
+
+// ids are random, a collision is unlikely enough
+// with_source also counts what is only in the history source
+static size_t count_distinct_messages(SimNode& node, uint32_t group_number, uint32_t some_peer, bool with_source = false) {
+	std::set<uint32_t> ids;
+	if (with_source) {
+		for (const auto& r : node.source.records) {
+			ids.insert(r.message_id);
+		}
+	}
+
+	const auto c = node.tcm.getContactGroupPeer(group_number, some_peer);
+	if (auto* reg_ptr = node.rmm.get(c); reg_ptr != nullptr) {
+		for (const auto& [e, id] : reg_ptr->view<Message::Components::ToxGroupMessageID>().each()) {
+			ids.insert(id.id);
+		}
+	}
+	return ids.size();
+}
+
+// archived, not loaded
+static void add_source_record(SimNode& node, uint32_t group_number, uint32_t author, uint32_t message_id, const std::string& text, uint64_t ts) {
+	const auto from_c = node.tcm.getContactGroupPeer(group_number, author);
+
+	auto& r = node.source.records.emplace_back();
+	r.message_id = message_id;
+	r.sender_pub_key = from_c.get<Contact::Components::ToxGroupPeerPersistent>().peer_key.data;
+	r.ts = ts;
+	if (const auto* name = from_c.try_get<Contact::Components::Name>(); name != nullptr) {
+		r.sender_name = name->name;
+	}
+	r.message_text = text;
+}
+
+// like the tox message handling would, ts is the local clock of node
+static void add_message(SimNode& node, uint32_t group_number, uint32_t author, uint32_t message_id, const std::string& text, uint64_t ts) {
+	const auto from_c = node.tcm.getContactGroupPeer(group_number, author);
+	auto& reg = *node.rmm.get(from_c);
+
+	const auto e = reg.create();
+	reg.emplace<Message::Components::ContactFrom>(e, from_c);
+	reg.emplace<Message::Components::ContactTo>(e, from_c.get<Contact::Components::Parent>().parent);
+	reg.emplace<Message::Components::ToxGroupMessageID>(e, message_id);
+	reg.emplace<Message::Components::MessageText>(e, text);
+	reg.emplace<Message::Components::TimestampProcessed>(e, ts);
+	reg.emplace<Message::Components::TimestampWritten>(e, ts);
+	reg.emplace<Message::Components::Timestamp>(e, ts);
+}
+
+static SimResult run(size_t peer_count, const SimConfig& conf) {
+	constexpr uint32_t group_number = 0u;
+
+	std::minstd_rand rng{conf.seed};
+	std::uniform_real_distribution<float> dist{0.f, 1.f};
+
+	const uint64_t epoch_ms = getTimeMS();
+	uint64_t now_ms = epoch_ms;
+
+	std::vector<std::unique_ptr<SimNode>> nodes;
+	for (size_t i = 0; i < peer_count; i++) {
+		auto& node = *nodes.emplace_back(std::make_unique<SimNode>());
+		node.t.self_peer_number = i;
+		node.clock_offset_ms = (i % 2 == 1) ? conf.clock_skew_ms : 0;
+		node.hs.setRNGSeed(conf.seed + i);
+		node.hs.setTimeSource([&now_ms, &node]() { return uint64_t(int64_t(now_ms) + node.clock_offset_ms); });
+		node.hs.setTickBudget(0.f, 64u); // a time budget would depend on the host
+		node.hs.setWorkerThreads(conf.workers);
+		node.hs.setSyncOrder(conf.order);
+		node.hs.setSyncIngestReorder(conf.reorder_s);
+		if (conf.source) {
+			node.hs.setHistorySource(&node.source);
+		}
+
+		// known peers, seen long enough ago to be allowed all history
+		for (size_t j = 0; j < peer_count; j++) {
+			const auto c = node.tcm.getContactGroupPeer(group_number, j);
+			node.cs.registry().emplace_or_replace<Contact::Components::FirstSeen>(c, epoch_ms - 24u*60u*60u*1000u);
+		}
+	}
+
+	// the group history, each peer has a random part of it
+	for (size_t m = 0; m < conf.messages; m++) {
+		const uint32_t author = rng() % peer_count;
+		const uint32_t message_id = rng();
+		const uint64_t ts = epoch_ms - 60u*60u*1000u + (m * 60u*60u*1000u) / conf.messages;
+		const std::string text = "simulated message " + std::to_string(m);
+
+		for (size_t i = 0; i < peer_count; i++) {
+			if (i != author && dist(rng) > conf.have_ratio) {
+				continue;
+			}
+
+			if (conf.source && m < conf.messages / 2) {
+				add_source_record(*nodes.at(i), group_number, author, message_id, text, ts);
+			} else {
+				add_message(*nodes.at(i), group_number, author, message_id, text, ts);
+			}
+		}
+	}
+
+	for (auto& node : nodes) {
+		node->initial_messages = count_messages(*node, group_number, 0);
+	}
+
+	// the fake network
+	std::multiset<InFlight> in_flight;
+	std::vector<uint64_t> uplink_free_ms(peer_count, now_ms);
+	uint64_t seq = 0;
+	for (size_t i = 0; i < peer_count; i++) {
+		nodes.at(i)->t.on_send_private = [&, i](uint32_t, uint32_t peer_number, bool, const std::vector<uint8_t>& data) {
+			if (peer_number >= peer_count) {
+				return false;
+			}
+
+			// serialize on the uplink
+			uplink_free_ms.at(i) = std::max(uplink_free_ms.at(i), now_ms) + (data.size() * 1000u) / conf.bandwidth_bps;
+			uint64_t deliver_ms = uplink_free_ms.at(i) + conf.latency_ms + uint64_t(dist(rng) * conf.jitter_ms);
+
+			// lossless, so every loss costs a resend
+			while (dist(rng) < conf.loss) {
+				deliver_ms += conf.resend_ms;
+			}
+
+			in_flight.insert(InFlight{deliver_ms, seq++, uint32_t(i), peer_number, data});
+			return true;
+		};
+	}
+
+	// everyone comes online at once
+	for (size_t i = 0; i < peer_count; i++) {
+		for (size_t j = 0; j < peer_count; j++) {
+			if (i != j) {
+				nodes.at(i)->hs.onPeerJoin(group_number, j);
+			}
+		}
+	}
+
+	const size_t total_messages = conf.messages + conf.live_messages;
+	std::multiset<InFlightDirect> direct_in_flight;
+	size_t live_sent = 0;
+	bool clock_stepped = false;
+
+	SimResult res;
+
+	while (now_ms - epoch_ms < conf.max_ms) {
+		now_ms += conf.step_ms;
+
+		if (conf.clock_step_ms != 0 && !clock_stepped && live_sent >= conf.live_messages / 2) {
+			// like ntp correcting it
+			nodes.at(1)->clock_offset_ms += conf.clock_step_ms;
+			clock_stepped = true;
+		}
+
+		if (live_sent < conf.live_messages && now_ms - epoch_ms >= (live_sent + 1) * conf.live_interval_ms) {
+			const uint32_t author = rng() % peer_count;
+			const uint32_t message_id = rng();
+			const std::string text = "simulated live message " + std::to_string(live_sent);
+			live_sent++;
+
+			auto& author_node = *nodes.at(author);
+			add_message(author_node, group_number, author, message_id, text, uint64_t(int64_t(now_ms) + author_node.clock_offset_ms));
+
+			for (size_t i = 0; i < peer_count; i++) {
+				if (i == author) {
+					continue;
+				}
+
+				uint64_t deliver_ms = now_ms + conf.latency_ms + uint64_t(dist(rng) * conf.jitter_ms);
+				if (dist(rng) < 0.25f) {
+					deliver_ms += conf.live_late_ms;
+				}
+				direct_in_flight.insert(InFlightDirect{deliver_ms, seq++, author, uint32_t(i), message_id, text});
+			}
+		}
+
+		while (!direct_in_flight.empty() && direct_in_flight.begin()->deliver_ms <= now_ms) {
+			const auto msg = *direct_in_flight.begin();
+			direct_in_flight.erase(direct_in_flight.begin());
+
+			auto& node = *nodes.at(msg.to);
+			add_message(node, group_number, msg.author, msg.message_id, msg.text, uint64_t(int64_t(now_ms) + node.clock_offset_ms));
+			node.direct_messages++;
+		}
+
+		while (!in_flight.empty() && in_flight.begin()->deliver_ms <= now_ms) {
+			const auto packet = *in_flight.begin();
+			in_flight.erase(in_flight.begin());
+
+			nodes.at(packet.to)->zngc.onGroupCustomPacket(group_number, packet.from, packet.data.data(), packet.data.size(), true);
+		}
+
+		for (auto& node : nodes) {
+			node->hs.tick(conf.step_ms / 1000.f);
+		}
+
+		if (!res.converged) {
+			bool all = true;
+			for (auto& node : nodes) {
+				if (count_distinct_messages(*node, group_number, 0, true) < total_messages) {
+					all = false;
+					break;
+				}
+			}
+			if (all) {
+				res.converged = true;
+				res.convergence_ms = now_ms - epoch_ms;
+			}
+		}
+
+		// live messages get synced back with the next requests, which come much later
+		if (res.converged && conf.live_messages == 0) {
+			break;
+		}
+	}
+
+	for (auto& node : nodes) {
+		const size_t messages = count_messages(*node, group_number, 0);
+		const size_t new_messages = messages - node->initial_messages - std::min(messages - node->initial_messages, node->direct_messages);
+		res.syncmsgs += node->counter.count;
+		res.duplicates += node->counter.count - std::min(node->counter.count, new_messages);
+		res.duplicate_messages += messages - count_distinct_messages(*node, group_number, 0);
+		res.bytes_total += node->t.sent_bytes;
+	}
+
+	return res;
+}
+
+static void print_usage(const char* self) {
+	std::cerr << "usage: " << self << " [--sizes 2,4,8,16] [--seed n] [--loss f] [--latency ms] [--bandwidth bytes/s] [--messages n] [--have f] [--workers n] [--oldest-first] [--reorder s] [--live n] [--live-late ms] [--clock-skew ms] [--clock-step ms] [--minutes n] [--source] [--verbose]\n";
+}
+
+int main(int argc, char** argv) {
+	SimConfig conf;
+	std::vector<size_t> sizes {2, 4, 8, 16};
+	bool verbose = false;
+
+	for (int i = 1; i < argc; i++) {
+		const bool has_value = i+1 < argc;
+		if (std::strcmp(argv[i], "--sizes") == 0 && has_value) {
+			sizes.clear();
+			std::stringstream ss{argv[++i]};
+			for (std::string item; std::getline(ss, item, ',');) {
+				sizes.push_back(std::stoul(item));
+			}
+		} else if (std::strcmp(argv[i], "--seed") == 0 && has_value) {
+			conf.seed = std::stoul(argv[++i]);
+		} else if (std::strcmp(argv[i], "--loss") == 0 && has_value) {
+			conf.loss = std::stof(argv[++i]);
+		} else if (std::strcmp(argv[i], "--latency") == 0 && has_value) {
+			conf.latency_ms = std::stoull(argv[++i]);
+		} else if (std::strcmp(argv[i], "--bandwidth") == 0 && has_value) {
+			conf.bandwidth_bps = std::max<uint64_t>(1u, std::stoull(argv[++i]));
+		} else if (std::strcmp(argv[i], "--messages") == 0 && has_value) {
+			conf.messages = std::stoul(argv[++i]);
+		} else if (std::strcmp(argv[i], "--have") == 0 && has_value) {
+			conf.have_ratio = std::stof(argv[++i]);
+		} else if (std::strcmp(argv[i], "--workers") == 0 && has_value) {
+			conf.workers = std::stoul(argv[++i]);
+		} else if (std::strcmp(argv[i], "--oldest-first") == 0) {
+			conf.order = ZoxNGCSyncOrder::oldest_first;
+		} else if (std::strcmp(argv[i], "--reorder") == 0 && has_value) {
+			conf.reorder_s = std::stof(argv[++i]);
+		} else if (std::strcmp(argv[i], "--live") == 0 && has_value) {
+			conf.live_messages = std::stoul(argv[++i]);
+		} else if (std::strcmp(argv[i], "--live-late") == 0 && has_value) {
+			conf.live_late_ms = std::stoull(argv[++i]);
+		} else if (std::strcmp(argv[i], "--clock-skew") == 0 && has_value) {
+			conf.clock_skew_ms = std::stoll(argv[++i]);
+		} else if (std::strcmp(argv[i], "--clock-step") == 0 && has_value) {
+			conf.clock_step_ms = std::stoll(argv[++i]);
+		} else if (std::strcmp(argv[i], "--minutes") == 0 && has_value) {
+			conf.max_ms = std::stoull(argv[++i]) * 60u*1000u;
+		} else if (std::strcmp(argv[i], "--source") == 0) {
+			conf.source = true;
+		} else if (std::strcmp(argv[i], "--verbose") == 0) {
+			verbose = true;
+		} else {
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	std::cout << "peers | converged | time s | syncmsgs | duplicates | dup msgs | KiB total | KiB per peer\n";
+
+	for (const size_t peer_count : sizes) {
+		if (peer_count < 2) {
+			continue;
+		}
+
+		// the components log every packet
+		std::ostringstream discard;
+		auto* cout_buf = std::cout.rdbuf();
+		auto* cerr_buf = std::cerr.rdbuf();
+		if (!verbose) {
+			std::cout.rdbuf(discard.rdbuf());
+			std::cerr.rdbuf(discard.rdbuf());
+		}
+
+		const auto res = run(peer_count, conf);
+
+		std::cout.rdbuf(cout_buf);
+		std::cerr.rdbuf(cerr_buf);
+
+		std::cout
+			<< peer_count
+			<< " | " << (res.converged ? "yes" : "no")
+			<< " | " << res.convergence_ms / 1000.0
+			<< " | " << res.syncmsgs
+			<< " | " << res.duplicates
+			<< " | " << res.duplicate_messages
+			<< " | " << res.bytes_total / 1024.0
+			<< " | " << res.bytes_total / 1024.0 / peer_count
+			<< "\n"
+		;
+	}
+
+	return 0;
+}
+
@@ -0,0 +1,92 @@
+// compares zox_utf8_valid_prefix() against the scalar version
+// on 40KB messages (about the largest ngch_syncmsg text) of different scripts
+
+#include <solanaceae/zox/utf8.hpp>
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+static void print_usage(const char* self) {
+	std::cerr << "usage: " << self << " [--iterations <n>]\n";
+}
+
+// repeats the pattern to size bytes, without cutting the last character
+static std::string make_message(std::string_view pattern, size_t size) {
+	std::string msg;
+	msg.reserve(size);
+	while (msg.size() + pattern.size() <= size) {
+		msg += pattern;
+	}
+	return msg;
+}
+
+int main(int argc, char** argv) {
+	size_t iterations = 2000;
+
+	for (int i = 1; i < argc; i++) {
+		if (std::strcmp(argv[i], "--iterations") == 0 && i+1 < argc) {
+			iterations = std::stoul(argv[++i]);
+		} else {
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	constexpr size_t message_size = 40*1024;
+
+	struct Case {
+		const char* name;
+		std::string msg;
+	};
+	std::vector<Case> cases;
+	cases.push_back({"ascii", make_message("the quick brown fox jumps over the lazy dog. ", message_size)});
+	cases.push_back({"latin", make_message("Grüße aus Köln, schöne Übersetzung für Straße. ", message_size)});
+	cases.push_back({"cyrillic", make_message("съешь же ещё этих мягких французских булок ", message_size)});
+	cases.push_back({"cjk", make_message("敏捷的棕色狐狸跳过了懒狗。", message_size)});
+	cases.push_back({"emoji", make_message("ok 👍 lol 😂 ", message_size)});
+	{ // invalid byte near the end, everything before is scanned
+		auto msg = make_message("the quick brown fox jumps over the lazy dog. ", message_size);
+		msg[msg.size() - 10] = char(0xff);
+		cases.push_back({"ascii-invalid-end", std::move(msg)});
+	}
+
+	bool mismatch = false;
+	for (const auto& c : cases) {
+		const auto* data = reinterpret_cast<const uint8_t*>(c.msg.data());
+
+		size_t simd_result = 0;
+		const auto simd_start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < iterations; i++) {
+			simd_result += zox_utf8_valid_prefix(data, c.msg.size());
+		}
+		const double simd_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - simd_start).count();
+
+		size_t scalar_result = 0;
+		const auto scalar_start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < iterations; i++) {
+			scalar_result += zox_utf8_valid_prefix_scalar(data, c.msg.size());
+		}
+		const double scalar_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - scalar_start).count();
+
+		if (simd_result != scalar_result) {
+			std::cerr << "error: " << c.name << " results differ " << simd_result << " vs " << scalar_result << "\n";
+			mismatch = true;
+		}
+
+		const double mb = double(c.msg.size()) * iterations / (1024.*1024.);
+		std::cout << c.name
+			<< " size:" << c.msg.size()
+			<< " valid:" << simd_result / iterations
+			<< " simd:" << mb / simd_s << "MiB/s"
+			<< " scalar:" << mb / scalar_s << "MiB/s"
+			<< " speedup:" << scalar_s / simd_s << "x"
+			<< "\n";
+	}
+
+	return mismatch ? 2 : 0;
+}
+